@@ -8,8 +8,8 @@
 #       BITSHUFFLE_INCLUDE
 #       BITSHUFFLE_STATIC_LIBRARY
 
-find_path(BITSHUFFLE_INCLUDE bitshuffle.h REQUIRED)
-find_library(BITSHUFFLE_STATIC_LIBRARY bitshuffle.a REQUIRED)
+find_path(BITSHUFFLE_INCLUDE bitshuffle.h)
+find_library(BITSHUFFLE_STATIC_LIBRARY bitshuffle.a)
 
 find_package(LZ4)
 
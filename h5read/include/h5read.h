@@ -31,6 +31,17 @@ typedef struct image_modules_t {
     size_t fast;     ///< Number of pixels in fast direction per module
 } image_modules_t;
 
+/// A single module, viewed in place within a full image
+typedef struct image_module_view_t {
+    uint16_t *data;      ///< First pixel of the module, inside the full image
+    uint8_t *mask;       ///< First mask pixel of the module, inside the full mask
+    size_t slow;         ///< Number of rows in the module
+    size_t fast;         ///< Number of pixels in each module row
+    size_t pitch;        ///< Distance from one row to the next, in pixels
+    size_t origin_slow;  ///< Row of the module's first pixel in the full image
+    size_t origin_fast;  ///< Column of the module's first pixel in the full image
+} image_module_view_t;
+
 /// Read an h5 file. Returns NULL if failed.
 h5read_handle *h5read_open(const char *master_filename);
 
@@ -60,9 +71,23 @@ float h5read_get_beam_center_y(h5read_handle *obj);
 /** Borrow a pointer to the image mask.
  *
  * This must not be released by the caller, and must not be used beyond
- * the point that h5read_free is called. */
+ * the point that h5read_free is called. The mask is only read from the
+ * file on the first call, which must not race with other calls on the
+ * same handle. */
 uint8_t *h5read_get_mask(h5read_handle *obj);
 
+/** Describe the mask as stored, without reading it into a mask.
+ *
+ * For a chunked mask, this is the raw bytes of its chunks, which are small
+ * when compressed. Otherwise it is the master file's device, inode, size
+ * and modification time, and where in the file the mask is. Either way, it
+ * changes whenever the mask might.
+ *
+ * @param size  Set to the size of the description
+ * @returns The description, for the caller to free, or NULL if there is no
+ *          mask */
+void *h5read_get_mask_source(h5read_handle *obj, size_t *size);
+
 /// Read an image from a dataset
 image_t *h5read_get_image(h5read_handle *obj, size_t number);
 /// Free a previously read image
@@ -84,11 +109,64 @@ void h5read_get_raw_chunk(h5read_handle *obj,
 
 size_t h5read_get_chunk_size(h5read_handle *obj, size_t index);
 
+/** Hint that a run of images will be read soon.
+ *
+ * The kernel is asked to start reading their chunks into the page cache.
+ * Images not yet written are skipped.
+ */
+void h5read_prefetch_chunks(h5read_handle *obj, size_t first, size_t count);
+
+/// Hint that a run of images has been read, and can leave the page cache
+void h5read_release_chunks(h5read_handle *obj, size_t first, size_t count);
+
+/// Get how many chunks h5read_get_raw_chunks read straight from data files,
+/// and how many of those were already in the page cache
+void h5read_get_chunk_cache_stats(h5read_handle *obj, size_t *reads, size_t *hits);
+
+/** Refresh the datasets, and count the frames written so far.
+ *
+ * Only frames from known onwards are checked, so pass the last count
+ * back in to pick up new frames cheaply. Returns the number of frames,
+ * from the start, that can all be read.
+ */
+size_t h5read_get_frames_available(h5read_handle *obj, size_t known);
+
+/** Read the raw chunks for a run of consecutive images.
+ *
+ * Chunks stored one after another in a data file are read together, with
+ * a single call where possible. Each of data must have room for max_size
+ * bytes. The size of each chunk read is written to sizes.
+ *
+ * Returns the number of chunks read. This stops at the first image that
+ * hasn't been written yet, so can be less than count.
+ */
+size_t h5read_get_raw_chunks(h5read_handle *obj,
+                             size_t first,
+                             size_t count,
+                             uint8_t **data,
+                             size_t max_size,
+                             size_t *sizes);
+
 /// Read an image from a dataset, split up into modules
 image_modules_t *h5read_get_image_modules(h5read_handle *obj, size_t frame_number);
 /// Free an image read as modules
 void h5read_free_image_modules(image_modules_t *modules);
 
+/// Get the number of modules making up each image
+size_t h5read_get_number_of_modules(h5read_handle *obj);
+
+/** Describe where each module lies within a full image, without copying.
+ *
+ * Row r of module m starts at views[m].data + r * views[m].pitch. The
+ * views point into the caller's image and mask buffers, so are only valid
+ * while those are. mask may be NULL, in which case so are the view masks.
+ * views must have room for h5read_get_number_of_modules entries.
+ */
+void h5read_get_module_views(h5read_handle *obj,
+                             image_t_type *image,
+                             uint8_t *mask,
+                             image_module_view_t *views);
+
 /// Parse basic command arguments with verbose, filename in form:
 ///     Usage: <prog> [-h|--help] [-v] [FILE.nxs]
 h5read_handle *h5read_parse_standard_args(int argc, char **argv);
@@ -96,11 +174,17 @@ h5read_handle *h5read_parse_standard_args(int argc, char **argv);
 #ifdef __cplusplus
 }
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <memory>
 #include <optional>
 #include <span>
 #include <string>
+#include <thread>
 #include <vector>
 
 class Image {
@@ -111,6 +195,9 @@ class Image {
   public:
     Image(std::shared_ptr<h5read_handle> reader, size_t i) noexcept;
 
+    /// Views of each module within this image, sharing its data
+    std::vector<image_module_view_t> module_views() const;
+
     const std::span<image_t_type> data;
     const std::span<uint8_t> mask;
     const size_t slow;
@@ -146,15 +233,99 @@ class Reader {
     enum ChunkCompression {
         BITSHUFFLE_LZ4,
         BYTE_OFFSET_32,
+        JUNGFRAU_RAW,  ///< Raw gain-encoded Jungfrau pixels, needing calibration
+        NONE,          ///< Plain pixels, ready to use as they are
     };
 
     virtual ~Reader() {};
 
     virtual bool is_image_available(size_t index) = 0;
 
+    /**
+     * @brief Whether something other than the caller is tracking new images.
+     *
+     * If so, wait_for_image can be called without holding any lock around
+     * the reader.
+     */
+    virtual bool has_image_watcher() const {
+        return false;
+    }
+
+    /**
+     * @brief Wait for an image to become available.
+     *
+     * By default this polls is_image_available.
+     *
+     * @returns Whether the image is available, or false if timed out
+     */
+    virtual bool wait_for_image(size_t index, std::chrono::milliseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (!is_image_available(index)) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::min<std::chrono::milliseconds>(
+              timeout, std::chrono::milliseconds(100)));
+        }
+        return true;
+    }
+
     virtual std::span<uint8_t> get_raw_chunk(size_t index,
                                              std::span<uint8_t> destination) = 0;
+    /**
+     * @brief Read the raw chunks for a run of consecutive images.
+     *
+     * Readers can combine the reads for a batch, and callers only need
+     * to lock the reader once for all of them.
+     *
+     * @param first         The first image to read
+     * @param destinations  A buffer for each image, as for get_raw_chunk
+     * @returns The chunk read into each buffer, in order. This stops at the
+     *          first image that isn't available yet, so can be shorter than
+     *          destinations.
+     */
+    virtual std::vector<std::span<uint8_t>> get_raw_chunks(
+      size_t first,
+      std::span<const std::span<uint8_t>> destinations) {
+        std::vector<std::span<uint8_t>> chunks;
+        for (size_t i = 0; i < destinations.size(); ++i) {
+            if (!is_image_available(first + i)) {
+                break;
+            }
+            chunks.push_back(get_raw_chunk(first + i, destinations[i]));
+        }
+        return chunks;
+    }
     virtual ChunkCompression get_raw_chunk_compression() = 0;
+
+    /// Chunks read, and how many of those were already in memory
+    struct CacheStats {
+        size_t reads;
+        size_t hits;
+    };
+
+    /**
+     * @brief Hint at which images will be read next.
+     *
+     * Readers backed by files can use this to start fetching them. By
+     * default, does nothing.
+     */
+    virtual void prefetch(size_t first, size_t count) {}
+    /// Hint that images have been read and won't be needed again
+    virtual void release(size_t first, size_t count) {}
+    /**
+     * @brief Finish with an image's chunk.
+     *
+     * Called once the span that get_raw_chunk returned is no longer used,
+     * or for an image that was skipped and won't be read, so that readers
+     * handing out their own memory can reuse it. May be called without
+     * the reader locked. By default, does nothing.
+     */
+    virtual void release_chunk(size_t index) {}
+    /// How well reads were served from the page cache, if known
+    virtual std::optional<CacheStats> get_cache_stats() const {
+        return std::nullopt;
+    }
     virtual size_t get_number_of_images() const = 0;
     virtual std::array<image_t_type, 2> get_trusted_range() const = 0;
     virtual std::array<size_t, 2> image_shape() const = 0;
@@ -166,8 +337,25 @@ class Reader {
       const = 0;  ///< Beam center (y, x), in pixels
     virtual std::optional<float> get_detector_distance()
       const = 0;  ///< Distance to detector, in meters.
+
+    /**
+     * @brief Describe where the mask comes from, without making it.
+     *
+     * This changes whenever the mask might, e.g. the mask's bytes as stored
+     * or the identity of the file they're in, and is much cheaper to get
+     * than get_mask(). So it can be used to look up a mask made from this
+     * one by an earlier run. Readers that can't tell cheaply return
+     * nullopt, and are never cached.
+     */
+    virtual std::optional<std::string> get_mask_source() const {
+        return std::nullopt;
+    }
 };
 
+/// Identify a file by device, inode, size and modification time, to tell if
+/// it has changed. nullopt if it doesn't exist.
+std::optional<std::string> file_fingerprint(const std::string &path);
+
 // Declare a C++ "object" version so we don't have to keep track of allocations
 class H5Read : public Reader {
   public:
@@ -182,6 +370,7 @@ class H5Read : public Reader {
 
     /// Read image data into an existing buffer
     void get_image_into(size_t index, uint16_t *data) {
+        std::scoped_lock lock(mutex);
         h5read_get_image_into(_handle.get(), index, data);
     }
     /// Read image data into an existing buffer
@@ -189,15 +378,39 @@ class H5Read : public Reader {
 #ifndef NDEBUG
         assert(data.size() >= get_image_slow() * get_image_fast());
 #endif
+        std::scoped_lock lock(mutex);
         h5read_get_image_into(_handle.get(), index, data.data());
     }
 
+    /**
+     * @brief Watch for new images from a background thread.
+     *
+     * Every interval, the watcher refreshes the datasets and counts the
+     * frames written so far. is_image_available and wait_for_image then
+     * only check that count, without touching the file. Once frames_needed
+     * have been counted the watcher stops, so it leaves an idle file alone.
+     *
+     * This must be called before any other threads use the reader.
+     */
+    void watch(std::chrono::milliseconds interval, size_t frames_needed);
+
+    bool has_image_watcher() const {
+        return _watcher.joinable();
+    }
+
     /// See if an image is available for raw chunk read
     bool is_image_available(size_t index) {
+        if (has_image_watcher()) {
+            return index < _frames_available;
+        }
+        std::scoped_lock lock(mutex);
         return h5read_get_chunk_size(_handle.get(), index) > 0;
     }
 
+    bool wait_for_image(size_t index, std::chrono::milliseconds timeout);
+
     std::span<uint8_t> get_raw_chunk(size_t index, std::span<uint8_t> destination) {
+        std::scoped_lock lock(mutex);
         size_t chunk_bytes;
         h5read_get_raw_chunk(_handle.get(),
                              index,
@@ -207,26 +420,87 @@ class H5Read : public Reader {
         return {destination.data(), chunk_bytes};
     }
 
+    /// Adjacent chunks in a data file are read together
+    std::vector<std::span<uint8_t>> get_raw_chunks(
+      size_t first,
+      std::span<const std::span<uint8_t>> destinations) {
+        std::vector<uint8_t *> data;
+        size_t max_size = SIZE_MAX;
+        for (auto &destination : destinations) {
+            data.push_back(destination.data());
+            max_size = std::min(max_size, destination.size_bytes());
+        }
+        auto sizes = std::vector<size_t>(destinations.size());
+        std::scoped_lock lock(mutex);
+        size_t count = h5read_get_raw_chunks(
+          _handle.get(), first, data.size(), data.data(), max_size, sizes.data());
+        std::vector<std::span<uint8_t>> chunks;
+        for (size_t i = 0; i < count; ++i) {
+            chunks.push_back({data[i], sizes[i]});
+        }
+        return chunks;
+    }
+
     virtual auto get_raw_chunk_compression() -> ChunkCompression {
         return Reader::ChunkCompression::BITSHUFFLE_LZ4;
     }
 
+    void prefetch(size_t first, size_t count) {
+        std::scoped_lock lock(mutex);
+        h5read_prefetch_chunks(_handle.get(), first, count);
+    }
+    void release(size_t first, size_t count) {
+        std::scoped_lock lock(mutex);
+        h5read_release_chunks(_handle.get(), first, count);
+    }
+    std::optional<CacheStats> get_cache_stats() const {
+        CacheStats stats;
+        std::scoped_lock lock(mutex);
+        h5read_get_chunk_cache_stats(_handle.get(), &stats.reads, &stats.hits);
+        return stats;
+    }
+
     Image get_image(size_t index) {
         return Image(_handle, index);
     }
 
     virtual std::optional<std::span<const uint8_t>> get_mask() const {
+        std::scoped_lock lock(mutex);
         auto mask = h5read_get_mask(_handle.get());
         if (mask == nullptr) {
             return std::nullopt;
         }
         return {{h5read_get_mask(_handle.get()), get_image_slow() * get_image_fast()}};
     }
+    virtual std::optional<std::string> get_mask_source() const {
+        std::scoped_lock lock(mutex);
+        size_t size = 0;
+        auto source = h5read_get_mask_source(_handle.get(), &size);
+        if (source == nullptr) {
+            return std::nullopt;
+        }
+        auto description = std::string(static_cast<const char *>(source), size);
+        free(source);
+        return description;
+    }
 
     ImageModules get_image_modules(size_t index) {
         return ImageModules(_handle, index);
     }
 
+    /// Views of each module within a full image buffer, without copying
+    std::vector<image_module_view_t> get_module_views(
+      std::span<image_t_type> image,
+      std::span<uint8_t> mask = {}) const {
+        auto views =
+          std::vector<image_module_view_t>(h5read_get_number_of_modules(_handle.get()));
+        h5read_get_module_views(_handle.get(),
+                                image.data(),
+                                mask.empty() ? nullptr : mask.data(),
+                                views.data());
+        return views;
+    }
+
     /// Get the total number of image frames
     virtual size_t get_number_of_images() const {
         return h5read_get_number_of_images(_handle.get());
@@ -272,10 +546,18 @@ class H5Read : public Reader {
     virtual std::optional<float> get_detector_distance() const {
         return {h5read_get_detector_distance(_handle.get())};
     }
-    std::mutex mutex;
+    /// Held around every use of the file, so the watcher can share it
+    mutable std::mutex mutex;
 
   protected:
     std::shared_ptr<h5read_handle> _handle;
+
+    /// Frames counted by the watcher. Only ever goes up.
+    std::atomic<size_t> _frames_available{0};
+    std::mutex _frames_mutex;
+    std::condition_variable _frames_changed;
+    /// Declared last, so it stops before anything it uses goes away
+    std::jthread _watcher;
 };
 
 using pixel_t = H5Read::image_type;
@@ -1,11 +1,20 @@
+// For preadv, preadv2 and IOV_MAX
+#define _GNU_SOURCE
+
 #include "h5read.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef HAVE_HDF5
@@ -15,34 +24,62 @@
 typedef uint8_t hid_t;
 #endif
 
+#ifdef HAVE_BITSHUFFLE
+#include <bitshuffle.h>
+#endif
+
 #include "eiger2xe.h"
 
 // VDS stuff
 
 #define MAXFILENAME 256
-#define MAXDATAFILES 100
 #define MAXDIM 3
+/// Least time between re-reading the master file for new data files
+#define DATA_FILE_REFRESH_SECONDS 1.0
+
+/// HDF5 filter ID registered for bitshuffle
+#define BITSHUFFLE_FILTER_ID 32008
+/// Bitshuffle filter option selecting LZ4 compression
+#define BITSHUFFLE_LZ4 2
+
+/// How images are read from a data file
+typedef enum {
+    DECODE_UNCHECKED = 0,  ///< Not worked out yet
+    DECODE_NATIVE,  ///< Read whole-image bitshuffle-LZ4 chunks, decoding ourselves
+    DECODE_HDF5,    ///< Read through H5Dread and the filter pipeline
+} image_decode_t;
 
 typedef struct h5_data_file {
     char filename[MAXFILENAME];
     char dsetname[MAXFILENAME];
-    hid_t file;
+    hid_t file;          ///< Only opened on first access, 0 until then
     hid_t dataset;
     size_t frames;
-    size_t offset;
+    size_t offset;       ///< First frame used, in the data file's dataset
+    size_t first_frame;  ///< Index of the first frame, in the whole dataset
+    image_decode_t decode;
+    int raw_fd;           ///< File descriptor for reading chunks directly, or -1
+    size_t base_address;  ///< Where HDF5 addresses start in the file
+    size_t readahead;     ///< Most the kernel will prefetch from one hint, in bytes
 } h5_data_file;
 
 struct _h5read_handle {
     hid_t master_file;
+    char master_filename[MAXFILENAME];
     int data_file_count;
     h5_data_file *data_files;
-    size_t frames;  ///< Number of frames in this dataset
-    size_t slow;    ///< Pixel dimension of images in the slow direction
-    size_t fast;    ///< Pixel dimensions of images in the fast direction
+    /// Frames in every data file, if all but the last hold the same number.
+    /// Lets a frame's data file be found with a single divide. 0 otherwise.
+    size_t frames_per_data_file;
+    size_t frames;        ///< Number of frames in this dataset
+    double last_refresh;  ///< When the data files were last re-read, in seconds
+    size_t slow;          ///< Pixel dimension of images in the slow direction
+    size_t fast;          ///< Pixel dimensions of images in the fast direction
 
     uint8_t *mask;         ///< Shared image mask
     uint8_t *module_mask;  ///< Shared module mask
     size_t mask_size;      ///< Total size(in pixels) of mask
+    bool mask_loaded;      ///< Whether mask and module_mask have been read yet
     image_t_type trusted_range_min,
       trusted_range_max;  ///< Trusted range of this dataset
     float wavelength;     ///< Wavelength of the X-ray beam
@@ -50,17 +87,26 @@ struct _h5read_handle {
     float pixel_size_x, pixel_size_y;
     float detector_distance;
     float beam_center_x, beam_center_y;
+
+    uint8_t *chunk_buffer;  ///< Compressed chunks are read here, for native decode
+    size_t chunk_buffer_size;
+
+    size_t chunk_reads;       ///< Chunks read directly from data files
+    size_t chunk_cache_hits;  ///< How many of those were already in the page cache
 };
 
 void h5read_free(h5read_handle *obj) {
 #ifdef HAVE_HDF5
     for (int i = 0; i < obj->data_file_count; i++) {
-        H5Dclose(obj->data_files[i].dataset);
-        H5Fclose(obj->data_files[i].file);
+        if (obj->data_files[i].file > 0) {
+            H5Dclose(obj->data_files[i].dataset);
+            H5Fclose(obj->data_files[i].file);
+        }
     }
     if (obj->master_file) H5Fclose(obj->master_file);
 #endif
     if (obj->data_files) free(obj->data_files);
+    free(obj->chunk_buffer);
     free(obj->mask);
     free(obj->module_mask);
 
@@ -86,60 +132,183 @@ void h5read_free_image(image_t *i) {
     free(i);
 }
 
+#ifdef HAVE_HDF5
+void read_mask(h5read_handle *obj);
+#endif
+
+/// Read the mask, if this is the first time it has been asked for.
+///
+/// Reading and converting a large mask is a good part of opening a file,
+/// and callers with a cached copy may never need it.
+void _ensure_mask(h5read_handle *obj) {
+    if (obj->mask_loaded) {
+        return;
+    }
+#ifdef HAVE_HDF5
+    read_mask(obj);
+#endif
+    obj->mask_loaded = true;
+}
+
 uint8_t *h5read_get_mask(h5read_handle *obj) {
+    _ensure_mask(obj);
     return obj->mask;
 }
 
-/// blit the relevent pixel data across from a single image into a collection
-/// of image modules - will allocate the latter
-///
-/// @param image    The image to blit from
-/// @param modules  The modules object to fill
-void _blit(image_t *image, image_modules_t *modules) {
-    // Number of modules in fast, slow directions
-    size_t fast, slow;
-    if (image->slow == E2XE_16M_SLOW) {
-        fast = 4;
-        slow = 8;
-    } else {
-        fast = 2;
-        slow = 4;
+#ifdef HAVE_HDF5
+/// Read every chunk of a dataset as stored, one after another
+void *_read_stored_chunks(hid_t dataset, hid_t space, size_t *size) {
+    hsize_t num_chunks = 0;
+    if (H5Dget_num_chunks(dataset, space, &num_chunks) < 0) {
+        return NULL;
+    }
+    // Size them all first, to read them into a single buffer
+    size_t total_size = 0;
+    hsize_t offset[MAXDIM];
+    unsigned int filter_mask;
+    haddr_t address;
+    hsize_t chunk_size;
+    for (hsize_t i = 0; i < num_chunks; ++i) {
+        if (H5Dget_chunk_info(
+              dataset, space, i, offset, &filter_mask, &address, &chunk_size)
+            < 0) {
+            return NULL;
+        }
+        total_size += chunk_size;
     }
+    uint8_t *chunks = malloc(total_size > 0 ? total_size : 1);
+    if (chunks == NULL) {
+        return NULL;
+    }
+    size_t position = 0;
+    for (hsize_t i = 0; i < num_chunks; ++i) {
+        if (H5Dget_chunk_info(
+              dataset, space, i, offset, &filter_mask, &address, &chunk_size)
+              < 0
+            || position + chunk_size > total_size
+            || H5Dread_chunk(
+                 dataset, H5P_DEFAULT, offset, &filter_mask, chunks + position)
+                 < 0) {
+            free(chunks);
+            return NULL;
+        }
+        position += chunk_size;
+    }
+    *size = position;
+    return chunks;
+}
+#endif
 
-    modules->slow = E2XE_MOD_SLOW;
-    modules->fast = E2XE_MOD_FAST;
-    modules->modules = slow * fast;
+void *h5read_get_mask_source(h5read_handle *obj, size_t *size) {
+    *size = 0;
+#ifdef HAVE_HDF5
+    if (obj->master_file <= 0) {
+        return NULL;
+    }
+    hid_t dataset;
+    // Not having a mask is allowed, so isn't an error to report
+    H5E_BEGIN_TRY {
+        dataset = H5Dopen(
+          obj->master_file, "/entry/instrument/detector/pixel_mask", H5P_DEFAULT);
+    }
+    H5E_END_TRY;
+    if (dataset < 0) {
+        return NULL;
+    }
+    void *source = NULL;
+    hid_t plist = H5Dget_create_plist(dataset);
+    if (H5Pget_layout(plist) == H5D_CHUNKED) {
+        hid_t space = H5Dget_space(dataset);
+        source = _read_stored_chunks(dataset, space, size);
+        H5Sclose(space);
+    } else {
+        struct stat info;
+        if (stat(obj->master_filename, &info) == 0) {
+            uint64_t identity[] = {info.st_dev,
+                                   info.st_ino,
+                                   (uint64_t)info.st_size,
+                                   (uint64_t)info.st_mtim.tv_sec,
+                                   (uint64_t)info.st_mtim.tv_nsec,
+                                   H5Dget_offset(dataset)};
+            source = malloc(sizeof(identity));
+            if (source != NULL) {
+                memcpy(source, identity, sizeof(identity));
+                *size = sizeof(identity);
+            }
+        }
+    }
+    H5Pclose(plist);
+    H5Dclose(dataset);
+    return source;
+#else
+    return NULL;
+#endif
+}
 
-    size_t module_pixels = E2XE_MOD_SLOW * E2XE_MOD_FAST;
+/// Work out how many modules make up the image, in each direction
+void _module_grid(h5read_handle *obj, size_t *n_slow, size_t *n_fast) {
+    if (obj->slow == E2XE_16M_SLOW) {
+        *n_slow = E2XE_16M_NSLOW;
+        *n_fast = E2XE_16M_NFAST;
+    } else {
+        *n_slow = E2XE_4M_NSLOW;
+        *n_fast = E2XE_4M_NFAST;
+    }
+}
 
-    modules->data = (uint16_t *)malloc(sizeof(uint16_t) * slow * fast * module_pixels);
+size_t h5read_get_number_of_modules(h5read_handle *obj) {
+    size_t n_slow, n_fast;
+    _module_grid(obj, &n_slow, &n_fast);
+    return n_slow * n_fast;
+}
 
-    for (size_t _slow = 0; _slow < slow; _slow++) {
-        size_t row0 = _slow * (E2XE_MOD_SLOW + E2XE_GAP_SLOW) * image->fast;
-        for (size_t _fast = 0; _fast < fast; _fast++) {
-            for (size_t row = 0; row < E2XE_MOD_SLOW; row++) {
-                size_t offset =
-                  (row0 + row * image->fast + _fast * (E2XE_MOD_FAST + E2XE_GAP_FAST));
-                size_t target =
-                  (_slow * fast + _fast) * module_pixels + row * E2XE_MOD_FAST;
-                memcpy((void *)&modules->data[target],
-                       (void *)&image->data[offset],
-                       sizeof(uint16_t) * E2XE_MOD_FAST);
-            }
+void h5read_get_module_views(h5read_handle *obj,
+                             image_t_type *image,
+                             uint8_t *mask,
+                             image_module_view_t *views) {
+    size_t n_slow, n_fast;
+    _module_grid(obj, &n_slow, &n_fast);
+    for (size_t _slow = 0; _slow < n_slow; _slow++) {
+        for (size_t _fast = 0; _fast < n_fast; _fast++) {
+            image_module_view_t *view = &views[_slow * n_fast + _fast];
+            view->slow = E2XE_MOD_SLOW;
+            view->fast = E2XE_MOD_FAST;
+            view->pitch = obj->fast;
+            view->origin_slow = _slow * (E2XE_MOD_SLOW + E2XE_GAP_SLOW);
+            view->origin_fast = _fast * (E2XE_MOD_FAST + E2XE_GAP_FAST);
+            size_t offset = view->origin_slow * obj->fast + view->origin_fast;
+            view->data = image + offset;
+            view->mask = mask == NULL ? NULL : mask + offset;
         }
     }
 }
 
 image_modules_t *h5read_get_image_modules(h5read_handle *obj, size_t n) {
-    image_t *image = h5read_get_image(obj, n);
+    size_t n_modules = h5read_get_number_of_modules(obj);
+    image_t_type *image = malloc(sizeof(image_t_type) * obj->slow * obj->fast);
+    h5read_get_image_into(obj, n, image);
+    image_module_view_t *views = malloc(sizeof(image_module_view_t) * n_modules);
+    h5read_get_module_views(obj, image, NULL, views);
+
     image_modules_t *modules = malloc(sizeof(image_modules_t));
-    modules->data = NULL;
+    _ensure_mask(obj);
     modules->mask = obj->module_mask;
-    modules->modules = -1;
-    modules->fast = -1;
-    modules->slow = -1;
-    _blit(image, modules);
-    h5read_free_image(image);
+    modules->modules = n_modules;
+    modules->slow = E2XE_MOD_SLOW;
+    modules->fast = E2XE_MOD_FAST;
+    size_t module_pixels = E2XE_MOD_SLOW * E2XE_MOD_FAST;
+    modules->data = malloc(sizeof(uint16_t) * n_modules * module_pixels);
+
+    // Pack each module's rows together
+    for (size_t i = 0; i < n_modules; i++) {
+        for (size_t row = 0; row < views[i].slow; row++) {
+            memcpy(&modules->data[i * module_pixels + row * views[i].fast],
+                   &views[i].data[row * views[i].pitch],
+                   sizeof(uint16_t) * views[i].fast);
+        }
+    }
+    free(views);
+    free(image);
     return modules;
 }
 
@@ -240,21 +409,185 @@ void _generate_sample_image(h5read_handle *obj, size_t n, image_t_type *data) {
     }
 }
 
+#ifdef HAVE_HDF5
+int unpack_vds(const char *filename, h5_data_file **data_files);
+#endif
+
+/// Work out where each data file's frames start in the whole dataset
+void _index_data_files(h5read_handle *obj) {
+    obj->frames = 0;
+    obj->frames_per_data_file =
+      obj->data_file_count > 0 ? obj->data_files[0].frames : 0;
+    for (int j = 0; j < obj->data_file_count; j++) {
+        obj->data_files[j].first_frame = obj->frames;
+        obj->frames += obj->data_files[j].frames;
+        if (j < obj->data_file_count - 1
+            && obj->data_files[j].frames != obj->frames_per_data_file) {
+            obj->frames_per_data_file = 0;
+        }
+    }
+}
+
+/// Re-read the VDS mapping from the master file, to find any data files
+/// added since it was opened. Data files we already know about keep
+/// their open handles.
+///
+/// This opens and parses the master file, so is done at most once every
+/// DATA_FILE_REFRESH_SECONDS, however often frames past the end are asked for.
+///
+/// @returns true if any frames were added
+bool _refresh_data_files(h5read_handle *obj) {
+#ifdef HAVE_HDF5
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double now_seconds = now.tv_sec + now.tv_nsec * 1e-9;
+    if (obj->last_refresh > 0
+        && now_seconds - obj->last_refresh < DATA_FILE_REFRESH_SECONDS) {
+        return false;
+    }
+    obj->last_refresh = now_seconds;
+    h5_data_file *data_files = NULL;
+    int count = unpack_vds(obj->master_filename, &data_files);
+    if (count <= obj->data_file_count) {
+        free(data_files);
+        return false;
+    }
+    for (int j = 0; j < obj->data_file_count; j++) {
+        if (strcmp(data_files[j].filename, obj->data_files[j].filename) != 0
+            || data_files[j].frames != obj->data_files[j].frames) {
+            fprintf(stderr, "Warning: Existing VDS mappings changed; ignoring\n");
+            free(data_files);
+            return false;
+        }
+        data_files[j].file = obj->data_files[j].file;
+        data_files[j].dataset = obj->data_files[j].dataset;
+        data_files[j].decode = obj->data_files[j].decode;
+        data_files[j].raw_fd = obj->data_files[j].raw_fd;
+        data_files[j].base_address = obj->data_files[j].base_address;
+        data_files[j].readahead = obj->data_files[j].readahead;
+    }
+    free(obj->data_files);
+    obj->data_files = data_files;
+    obj->data_file_count = count;
+    _index_data_files(obj);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// Find how much the kernel will read ahead for one hint on a file. This is
+/// the read_ahead_kb of the device it's on, which is often only 128 KiB.
+size_t _get_readahead_size(int fd) {
+    size_t readahead_kb = 128;
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+        char path[64];
+        snprintf(path,
+                 sizeof(path),
+                 "/sys/class/bdi/%u:%u/read_ahead_kb",
+                 major(info.st_dev),
+                 minor(info.st_dev));
+        FILE *f = fopen(path, "r");
+        if (f) {
+            if (fscanf(f, "%zu", &readahead_kb) != 1 || readahead_kb == 0) {
+                readahead_kb = 128;
+            }
+            fclose(f);
+        }
+    }
+    return readahead_kb * 1024;
+}
+
+/// Open a data file, if it isn't already.
+///
+/// Data files are opened on first access, so that opening a master file
+/// with many data files is quick, and so that data files that haven't been
+/// written yet can be waited for.
+///
+/// @returns false if the data file does not exist yet, or can't be opened
+bool _open_data_file(h5read_handle *obj, int data_file) {
+#ifdef HAVE_HDF5
+    h5_data_file *current = &obj->data_files[data_file];
+    if (current->file > 0) {
+        return true;
+    }
+    // Check first, to avoid HDF5 printing errors for a file still to come
+    if (access(current->filename, R_OK) != 0) {
+        return false;
+    }
+    current->file =
+      H5Fopen(current->filename, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
+    if (current->file < 0) {
+        fprintf(stderr, "Error: Opening child file %s\n", current->filename);
+        current->file = 0;
+        return false;
+    }
+    current->dataset = H5Dopen(current->file, current->dsetname, H5P_DEFAULT);
+    if (current->dataset < 0) {
+        fprintf(stderr,
+                "Error: Reading datasets of child file %s\n",
+                current->filename);
+        H5Fclose(current->file);
+        current->file = 0;
+        current->dataset = 0;
+        return false;
+    }
+    // Runs of chunks can be read straight from the file, if we can get at it
+    current->raw_fd = -1;
+    hid_t access_plist = H5Fget_access_plist(current->file);
+    void *handle = NULL;
+    if (H5Pget_driver(access_plist) == H5FD_SEC2
+        && H5Fget_vfd_handle(current->file, access_plist, &handle) >= 0) {
+        current->raw_fd = *(int *)handle;
+    }
+    H5Pclose(access_plist);
+    hid_t create_plist = H5Fget_create_plist(current->file);
+    hsize_t userblock = 0;
+    H5Pget_userblock(create_plist, &userblock);
+    current->base_address = userblock;
+    H5Pclose(create_plist);
+    if (current->raw_fd >= 0) {
+        current->readahead = _get_readahead_size(current->raw_fd);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 /// Find the data file index for a particular image number.
 /// If the image isn't found on any data files, returns obj->data_file_count
 /// FIXME returns updated in index in place
 int _find_data_file_for_image(h5read_handle *obj, size_t *index) {
-    int data_file = 0;
-    size_t subtracted = *index;
-    for (; data_file < obj->data_file_count; data_file++) {
-        if ((subtracted + obj->data_files[data_file].offset)
-            < (obj->data_files[data_file].frames + obj->data_files[data_file].offset)) {
-            break;
-        } else {
-            subtracted -= obj->data_files[data_file].frames;
+    if (*index >= obj->frames) {
+        // It might be in a data file added since we last looked
+        _refresh_data_files(obj);
+        if (*index >= obj->frames) {
+            return obj->data_file_count;
         }
     }
-    *index = subtracted;
+    int data_file;
+    if (obj->frames_per_data_file > 0) {
+        data_file = *index / obj->frames_per_data_file;
+        // The last file can have more frames than the rest
+        if (data_file >= obj->data_file_count) {
+            data_file = obj->data_file_count - 1;
+        }
+    } else {
+        // Binary search for the last file starting at or before the frame
+        int low = 0, high = obj->data_file_count - 1;
+        while (low < high) {
+            int mid = (low + high + 1) / 2;
+            if (obj->data_files[mid].first_frame <= *index) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+        data_file = low;
+    }
+    *index -= obj->data_files[data_file].first_frame;
     return data_file;
 }
 
@@ -263,16 +596,16 @@ size_t h5read_get_chunk_size(h5read_handle *obj, size_t index) {
         fprintf(stderr, "Error: Cannot do direct chunk read with sample data\n", index);
         exit(1);
     }
+    hsize_t chunk_size = 0;
 #ifdef HAVE_HDF5
     int data_file = _find_data_file_for_image(obj, &index);
-    if (data_file == obj->data_file_count) {
-        fprintf(stderr, "Error: Could not find data file for frame %ld\n", index);
-        exit(1);
+    if (data_file == obj->data_file_count || !_open_data_file(obj, data_file)) {
+        // Not written yet
+        return 0;
     }
     h5_data_file *current = &(obj->data_files[data_file]);
 
     hsize_t offset[3] = {index + current->offset, 0, 0};
-    hsize_t chunk_size = 0;
     // H5Drefresh(current->dataset);
     H5Dget_chunk_storage_size(current->dataset, offset, &chunk_size);
 #endif
@@ -282,6 +615,45 @@ size_t h5read_get_chunk_size(h5read_handle *obj, size_t index) {
     return (size_t)chunk_size;
 }
 
+size_t h5read_get_frames_available(h5read_handle *obj, size_t known) {
+    if (obj->data_files == 0) {
+        // Sample data is all there from the start
+        return obj->frames;
+    }
+    size_t available = known;
+#ifdef HAVE_HDF5
+    int refreshed = -1;
+    hsize_t extent[MAXDIM] = {0};
+    while (true) {
+        size_t index = available;
+        int data_file = _find_data_file_for_image(obj, &index);
+        if (data_file == obj->data_file_count || !_open_data_file(obj, data_file)) {
+            break;
+        }
+        h5_data_file *current = &(obj->data_files[data_file]);
+        if (data_file != refreshed) {
+            // Only see the writer's latest metadata once per data file
+            H5Drefresh(current->dataset);
+            hid_t space = H5Dget_space(current->dataset);
+            H5Sget_simple_extent_dims(space, extent, NULL);
+            H5Sclose(space);
+            refreshed = data_file;
+        }
+        if (index + current->offset >= extent[0]) {
+            break;
+        }
+        hsize_t offset[3] = {index + current->offset, 0, 0};
+        hsize_t chunk_size = 0;
+        if (H5Dget_chunk_storage_size(current->dataset, offset, &chunk_size) < 0
+            || chunk_size == 0) {
+            break;
+        }
+        available++;
+    }
+#endif
+    return available;
+}
+
 void h5read_get_raw_chunk(h5read_handle *obj,
                           size_t index,
                           size_t *size,
@@ -293,7 +665,7 @@ void h5read_get_raw_chunk(h5read_handle *obj,
     }
 #ifdef HAVE_HDF5
     int data_file = _find_data_file_for_image(obj, &index);
-    if (data_file == obj->data_file_count) {
+    if (data_file == obj->data_file_count || !_open_data_file(obj, data_file)) {
         fprintf(stderr, "Error: Could not find data file for frame %ld\n", index);
         exit(1);
     }
@@ -325,7 +697,300 @@ void h5read_get_raw_chunk(h5read_handle *obj,
 #endif
 }
 
+#ifdef HAVE_HDF5
+/// Move an iovec array past bytes that were read, which might end mid-buffer
+///
+/// @returns The number of buffers that were completely filled
+size_t _advance_iov(struct iovec **iov, size_t *count, size_t bytes) {
+    size_t filled = 0;
+    while (*count > 0 && bytes >= (*iov)->iov_len) {
+        bytes -= (*iov)->iov_len;
+        (*iov)++;
+        (*count)--;
+        filled++;
+    }
+    if (*count > 0) {
+        (*iov)->iov_base = (uint8_t *)(*iov)->iov_base + bytes;
+        (*iov)->iov_len -= bytes;
+    }
+    return filled;
+}
+
+/// Read chunks stored back to back in a file with as few calls as possible
+///
+/// @param cached   Set to how many chunks were already in the page cache
+/// @returns false if the file couldn't be read
+bool _read_chunk_run(int fd,
+                     struct iovec *iov,
+                     size_t count,
+                     off_t address,
+                     size_t *cached) {
+    *cached = 0;
+#ifdef RWF_NOWAIT
+    // Take whatever is already cached first, so we can tell how much it was
+    ssize_t cached_bytes =
+      preadv2(fd, iov, count > IOV_MAX ? IOV_MAX : count, address, RWF_NOWAIT);
+    if (cached_bytes > 0) {
+        address += cached_bytes;
+        *cached = _advance_iov(&iov, &count, cached_bytes);
+    }
+#endif
+    while (count > 0) {
+        ssize_t bytes = preadv(fd, iov, count > IOV_MAX ? IOV_MAX : count, address);
+        if (bytes <= 0) {
+            return false;
+        }
+        address += bytes;
+        _advance_iov(&iov, &count, bytes);
+    }
+    return true;
+}
+
+/// Pass advice about the file ranges holding a run of chunks to the kernel
+void _advise_chunks(h5read_handle *obj, size_t first, size_t count, int advice) {
+    if (obj->data_files == 0 || first >= obj->frames) {
+        return;
+    }
+    // Don't go looking for data files that we don't know about yet
+    if (count > obj->frames - first) {
+        count = obj->frames - first;
+    }
+    size_t done = 0;
+    while (done < count) {
+        size_t index = first + done;
+        int data_file = _find_data_file_for_image(obj, &index);
+        if (data_file == obj->data_file_count || !_open_data_file(obj, data_file)) {
+            return;
+        }
+        h5_data_file *current = &(obj->data_files[data_file]);
+        if (current->raw_fd < 0) {
+            // No file to advise on, so move on to the next one
+            done += current->frames - index;
+            continue;
+        }
+        // Advise on each chunk separately, in pieces no bigger than the
+        // kernel will read ahead for one hint
+        for (; done < count && index < current->frames; done++, index++) {
+            hsize_t offset[3] = {index + current->offset, 0, 0};
+            unsigned int filter_mask;
+            haddr_t address;
+            hsize_t chunk_size = 0;
+            if (H5Dget_chunk_info_by_coord(
+                  current->dataset, offset, &filter_mask, &address, &chunk_size)
+                  < 0
+                || address == HADDR_UNDEF || chunk_size == 0) {
+                // Not written yet, so neither is anything after it
+                return;
+            }
+            for (hsize_t piece = 0; piece < chunk_size; piece += current->readahead) {
+                size_t piece_size = chunk_size - piece < current->readahead
+                                      ? chunk_size - piece
+                                      : current->readahead;
+                posix_fadvise(current->raw_fd,
+                              current->base_address + address + piece,
+                              piece_size,
+                              advice);
+            }
+        }
+    }
+}
+#endif
+
+void h5read_prefetch_chunks(h5read_handle *obj, size_t first, size_t count) {
+#ifdef HAVE_HDF5
+    _advise_chunks(obj, first, count, POSIX_FADV_WILLNEED);
+#endif
+}
+
+void h5read_release_chunks(h5read_handle *obj, size_t first, size_t count) {
+#ifdef HAVE_HDF5
+    _advise_chunks(obj, first, count, POSIX_FADV_DONTNEED);
+#endif
+}
+
+void h5read_get_chunk_cache_stats(h5read_handle *obj, size_t *reads, size_t *hits) {
+    *reads = obj->chunk_reads;
+    *hits = obj->chunk_cache_hits;
+}
+
+size_t h5read_get_raw_chunks(h5read_handle *obj,
+                             size_t first,
+                             size_t count,
+                             uint8_t **data,
+                             size_t max_size,
+                             size_t *sizes) {
+    if (obj->data_files == 0) {
+        fprintf(stderr, "Error: Cannot do direct chunk read with sample data\n");
+        exit(1);
+    }
+    size_t done = 0;
+#ifdef HAVE_HDF5
+    struct iovec *iov = malloc(sizeof(struct iovec) * count);
+    while (done < count) {
+        size_t index = first + done;
+        int data_file = _find_data_file_for_image(obj, &index);
+        if (data_file == obj->data_file_count || !_open_data_file(obj, data_file)) {
+            break;
+        }
+        h5_data_file *current = &(obj->data_files[data_file]);
+
+        // Find the run of chunks in this file that lie one after another
+        size_t run = 0;
+        haddr_t start = HADDR_UNDEF, end = HADDR_UNDEF;
+        while (done + run < count && index + run < current->frames) {
+            hsize_t offset[3] = {index + run + current->offset, 0, 0};
+            unsigned int filter_mask;
+            haddr_t address;
+            hsize_t chunk_size = 0;
+            if (H5Dget_chunk_info_by_coord(
+                  current->dataset, offset, &filter_mask, &address, &chunk_size)
+                  < 0
+                || address == HADDR_UNDEF || chunk_size == 0) {
+                // Not written yet
+                break;
+            }
+            if (chunk_size > max_size) {
+                fprintf(stderr, "Error: Not enough room to store compressed chunk\n");
+                exit(1);
+            }
+            if (run > 0 && address != end) {
+                break;
+            }
+            if (run == 0) {
+                start = address;
+            }
+            end = address + chunk_size;
+            iov[run].iov_base = data[done + run];
+            iov[run].iov_len = chunk_size;
+            sizes[done + run] = chunk_size;
+            run++;
+        }
+        if (run == 0) {
+            break;
+        }
+        size_t cached = 0;
+        if (current->raw_fd >= 0
+            && _read_chunk_run(
+              current->raw_fd, iov, run, current->base_address + start, &cached)) {
+            obj->chunk_reads += run;
+            obj->chunk_cache_hits += cached;
+        } else {
+            // Fall back to reading them one at a time through HDF5
+            for (size_t i = 0; i < run; i++) {
+                hsize_t offset[3] = {index + i + current->offset, 0, 0};
+                uint32_t filter = 0;
+                if (H5Dread_chunk(
+                      current->dataset, H5P_DEFAULT, offset, &filter, data[done + i])
+                    < 0) {
+                    fprintf(stderr, "Error: Failed to read chunk\n");
+                    exit(1);
+                }
+            }
+        }
+        done += run;
+    }
+    free(iov);
+#endif
+    return done;
+}
+
+#if defined(HAVE_HDF5) && defined(HAVE_BITSHUFFLE)
+/// Work out whether a data file's images can be decoded natively: each
+/// chunk must be one whole 16-bit image, compressed with bitshuffle-LZ4 and
+/// nothing else.
+image_decode_t _choose_image_decode(h5read_handle *obj, h5_data_file *current) {
+    image_decode_t decode = DECODE_HDF5;
+    hid_t datatype = H5Dget_type(current->dataset);
+    hid_t plist = H5Dget_create_plist(current->dataset);
+    hsize_t chunk_dims[MAXDIM];
+    if (H5Tget_size(datatype) == 2 && H5Pget_layout(plist) == H5D_CHUNKED
+        && H5Pget_chunk(plist, MAXDIM, chunk_dims) == 3 && chunk_dims[0] == 1
+        && chunk_dims[1] == obj->slow && chunk_dims[2] == obj->fast
+        && H5Pget_nfilters(plist) == 1) {
+        unsigned int flags;
+        size_t num_values = 8;
+        unsigned int values[8] = {0};
+        unsigned int filter_config;
+        H5Z_filter_t filter = H5Pget_filter2(
+          plist, 0, &flags, &num_values, values, 0, NULL, &filter_config);
+        if (filter == BITSHUFFLE_FILTER_ID && num_values >= 5
+            && values[4] == BITSHUFFLE_LZ4) {
+            decode = DECODE_NATIVE;
+        }
+    }
+    H5Pclose(plist);
+    H5Tclose(datatype);
+    return decode;
+}
+
+/// Read an image's chunk directly and decode it, skipping the HDF5 filter
+/// pipeline.
+///
+/// @returns false if the chunk couldn't be decoded this way
+bool _read_image_native(h5read_handle *obj,
+                        h5_data_file *current,
+                        size_t index,
+                        image_t_type *data) {
+    hsize_t offset[3] = {index + current->offset, 0, 0};
+    hsize_t chunk_size = 0;
+    if (H5Dget_chunk_storage_size(current->dataset, offset, &chunk_size) < 0
+        || chunk_size == 0) {
+        return false;
+    }
+    if (chunk_size > obj->chunk_buffer_size) {
+        free(obj->chunk_buffer);
+        obj->chunk_buffer = malloc(chunk_size);
+        if (obj->chunk_buffer == NULL) {
+            // Leave it to the HDF5 filter pipeline
+            obj->chunk_buffer_size = 0;
+            return false;
+        }
+        obj->chunk_buffer_size = chunk_size;
+    }
+    uint32_t filter_mask = 0;
+    if (H5Dread_chunk(
+          current->dataset, H5P_DEFAULT, offset, &filter_mask, obj->chunk_buffer)
+        < 0) {
+        return false;
+    }
+    size_t image_bytes = obj->slow * obj->fast * sizeof(image_t_type);
+    if (filter_mask & 1) {
+        // The filter was skipped for this chunk, so it is stored as-is
+        if (chunk_size != image_bytes) {
+            return false;
+        }
+        memcpy(data, obj->chunk_buffer, image_bytes);
+        return true;
+    }
+    // Bitshuffle header: big-endian uncompressed size, then block size, in bytes
+    if (chunk_size < 12) {
+        return false;
+    }
+    const uint8_t *header = obj->chunk_buffer;
+    uint64_t total_bytes = 0;
+    for (int i = 0; i < 8; ++i) {
+        total_bytes = (total_bytes << 8) | header[i];
+    }
+    uint32_t block_bytes = (uint32_t)header[8] << 24 | (uint32_t)header[9] << 16
+                           | (uint32_t)header[10] << 8 | header[11];
+    if (total_bytes != image_bytes) {
+        return false;
+    }
+    return bshuf_decompress_lz4(obj->chunk_buffer + 12,
+                                data,
+                                obj->slow * obj->fast,
+                                sizeof(image_t_type),
+                                block_bytes / sizeof(image_t_type))
+           >= 0;
+}
+#endif
+
 void h5read_get_image_into(h5read_handle *obj, size_t index, image_t_type *data) {
+    if (index >= obj->frames && obj->data_files) {
+        // It might be in a data file added since we last looked. That's only
+        // checked once a second, so asking again doesn't reopen the master
+        _refresh_data_files(obj);
+    }
     if (index >= obj->frames) {
         fprintf(stderr,
                 "Error: image %ld greater than number of frames (%ld)\n",
@@ -345,13 +1010,24 @@ void h5read_get_image_into(h5read_handle *obj, size_t index, image_t_type *data)
        but probably cheap */
     int data_file = _find_data_file_for_image(obj, &index);
 
-    if (data_file == obj->data_file_count) {
+    if (data_file == obj->data_file_count || !_open_data_file(obj, data_file)) {
         fprintf(stderr, "Error: Could not find data file for frame %ld\n", index);
         exit(1);
     }
 
     h5_data_file *current = &(obj->data_files[data_file]);
 
+#ifdef HAVE_BITSHUFFLE
+    // Skipping HDF5's filter pipeline, and its buffering, is much faster
+    if (current->decode == DECODE_UNCHECKED) {
+        current->decode = _choose_image_decode(obj, current);
+    }
+    if (current->decode == DECODE_NATIVE
+        && _read_image_native(obj, current, index, data)) {
+        return;
+    }
+#endif
+
     hid_t space = H5Dget_space(current->dataset);
     hid_t datatype = H5Dget_type(current->dataset);
 
@@ -375,7 +1051,7 @@ void h5read_get_image_into(h5read_handle *obj, size_t index, image_t_type *data)
 image_t *h5read_get_image(h5read_handle *obj, size_t n) {
     // Make an image_t to write into
     image_t *result = malloc(sizeof(image_t));
-    result->mask = obj->mask;
+    result->mask = h5read_get_mask(obj);
     result->fast = obj->fast;
     result->slow = obj->slow;
     // Create the buffer here. This will be freed by h5read_free_image
@@ -811,8 +1487,7 @@ int vds_info(char *root, hid_t master, hid_t dataset, h5_data_file **data_files_
 ///
 /// @returns The number of VDS files
 int unpack_vds(const char *filename, h5_data_file **data_files) {
-    // TODO if we want this to become SWMR aware in the future will need to
-    // allow for that here
+    // Called again as the acquisition grows, so must see the latest mapping
     hid_t file = H5Fopen(filename, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
 
     if (file < 0) {
@@ -826,6 +1501,8 @@ int unpack_vds(const char *filename, h5_data_file **data_files) {
         fprintf(stderr, "Error: Reading H5 entry %s\n", "/entry/data/data");
         return -1;
     }
+    // The master file may already be open, with older metadata cached
+    H5Drefresh(dataset);
 
     /* always set the absolute path to file information */
     char rootpath[MAXFILENAME];
@@ -892,30 +1569,18 @@ h5read_handle *h5read_open(const char *master_filename) {
         return NULL;
     }
 
-    // open up the actual data files, count all the frames
-    file->frames = 0;
-    h5_data_file *data_files = file->data_files;
-    for (int j = 0; j < file->data_file_count; j++) {
-        data_files[j].file = H5Fopen(
-          data_files[j].filename, H5F_ACC_RDONLY | H5F_ACC_SWMR_READ, H5P_DEFAULT);
-        if (data_files[j].file < 0) {
-            fprintf(stderr, "Error: Opening child file %s\n", data_files[j].filename);
-            H5Fclose(master_file);
-            free(file);
-            return NULL;
-        }
-        data_files[j].dataset =
-          H5Dopen(data_files[j].file, data_files[j].dsetname, H5P_DEFAULT);
-        if (data_files[j].dataset < 0) {
-            fprintf(stderr,
-                    "Error: Reading datasets of child file %s\n",
-                    data_files[j].filename);
-            H5Fclose(data_files[j].file);
-            H5Fclose(master_file);
-            free(file);
-            return NULL;
-        }
-        file->frames += data_files[j].frames;
+    snprintf(file->master_filename, MAXFILENAME, "%s", master_filename);
+    _index_data_files(file);
+
+    // Other data files are opened when needed, but we need the first to
+    // know the image size
+    if (file->data_file_count == 0 || !_open_data_file(file, 0)) {
+        fprintf(
+          stderr, "Error: Could not open first data file of %s\n", master_filename);
+        free(file->data_files);
+        H5Fclose(master_file);
+        free(file);
+        return NULL;
     }
 
     read_trusted_range(file);
@@ -924,7 +1589,7 @@ h5read_handle *h5read_open(const char *master_filename) {
 
     read_detector_metadata(file);
 
-    read_mask(file);
+    // The mask is read on first use
 
     setup_data(file);
 
@@ -989,6 +1654,7 @@ h5read_handle *h5read_generate_samples() {
     // fwrite(file->mask, sizeof(uint8_t), E2XE_16M_SLOW * E2XE_16M_FAST, fo);
     // fclose(fo);
 
+    file->mask_loaded = true;
     file->frames = NUM_SAMPLE_IMAGES;
     return file;
 }
@@ -1,5 +1,7 @@
 #include <h5read.h>
 
+#include <sys/stat.h>
+
 #include <cassert>
 #include <iostream>
 
@@ -31,6 +33,47 @@ H5Read::H5Read(int argc, char **argv) noexcept {
                                              h5read_freeer);
 }
 
+void H5Read::watch(std::chrono::milliseconds interval, size_t frames_needed) {
+    // Count what's already there, so it doesn't wait for the first refresh
+    _frames_available = h5read_get_frames_available(_handle.get(), 0);
+    _watcher = std::jthread([this, interval, frames_needed](std::stop_token stop) {
+        auto wakeup = std::condition_variable_any{};
+        auto wakeup_mutex = std::mutex{};
+        while (!stop.stop_requested() && _frames_available < frames_needed) {
+            // Sleep until the next refresh, or until we're told to stop
+            {
+                std::unique_lock lock(wakeup_mutex);
+                wakeup.wait_for(lock, stop, interval, [] { return false; });
+            }
+            if (stop.stop_requested()) {
+                break;
+            }
+            size_t available;
+            {
+                std::scoped_lock lock(mutex);
+                available =
+                  h5read_get_frames_available(_handle.get(), _frames_available);
+            }
+            if (available > _frames_available) {
+                {
+                    std::scoped_lock lock(_frames_mutex);
+                    _frames_available = available;
+                }
+                _frames_changed.notify_all();
+            }
+        }
+    });
+}
+
+bool H5Read::wait_for_image(size_t index, std::chrono::milliseconds timeout) {
+    if (!has_image_watcher()) {
+        return Reader::wait_for_image(index, timeout);
+    }
+    std::unique_lock lock(_frames_mutex);
+    return _frames_changed.wait_for(
+      lock, timeout, [&] { return index < _frames_available; });
+}
+
 Image::Image(std::shared_ptr<h5read_handle> handle, size_t i) noexcept
     : _handle(handle),
       _image{std::shared_ptr<image_t>(h5read_get_image(_handle.get(), i),
@@ -43,6 +86,13 @@ Image::Image(std::shared_ptr<h5read_handle> handle, size_t i) noexcept
     assert(_image);
 }
 
+std::vector<image_module_view_t> Image::module_views() const {
+    auto views =
+      std::vector<image_module_view_t>(h5read_get_number_of_modules(_handle.get()));
+    h5read_get_module_views(_handle.get(), data.data(), mask.data(), views.data());
+    return views;
+}
+
 ImageModules::ImageModules(std::shared_ptr<h5read_handle> handle, size_t i) noexcept
     : _handle{handle},
       _modules{
@@ -64,4 +114,14 @@ ImageModules::ImageModules(std::shared_ptr<h5read_handle> handle, size_t i) noex
         _modules_data[i] = std::span{_modules->data + slow * fast * i, slow * fast};
         _modules_masks[i] = std::span{_modules->mask + slow * fast * i, slow * fast};
     }
-}
\ No newline at end of file
+}
+
+std::optional<std::string> file_fingerprint(const std::string &path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return std::nullopt;
+    }
+    return path + ":" + to_string(info.st_dev) + ":" + to_string(info.st_ino) + ":"
+           + to_string(info.st_size) + ":" + to_string(info.st_mtim.tv_sec) + "."
+           + to_string(info.st_mtim.tv_nsec);
+}
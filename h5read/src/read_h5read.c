@@ -19,6 +19,9 @@ int main(int argc, char **argv) {
     // A buffer we own, to check reading image data into a preallocated buffer
     image_t_type *buffer = malloc(h5read_get_image_fast(obj)
                                   * h5read_get_image_slow(obj) * sizeof(image_t_type));
+    // Views of the modules within that buffer
+    image_module_view_t *views =
+      malloc(h5read_get_number_of_modules(obj) * sizeof(image_module_view_t));
 
     image_t_type max, min;
     h5read_get_trusted_range(obj, &min, &max);
@@ -48,6 +51,22 @@ int main(int argc, char **argv) {
                 zero_m++;
             }
         }
+
+        // Modules viewed in place should agree with the copied modules
+        size_t zero_v = 0;
+        h5read_get_module_views(obj, buffer, image->mask, views);
+        for (size_t m = 0; m < h5read_get_number_of_modules(obj); m++) {
+            for (size_t row = 0; row < views[m].slow; row++) {
+                for (size_t col = 0; col < views[m].fast; col++) {
+                    size_t i = row * views[m].pitch + col;
+                    if (views[m].data[i] == 0 && views[m].mask[i] == 1) {
+                        zero_v++;
+                    }
+                }
+            }
+        }
+        assert(zero_v == zero_m);
+
         char *colour = "\033[31m";
         if (zero == zero_m) {
             colour = "\033[32m";
@@ -65,6 +84,7 @@ int main(int argc, char **argv) {
         h5read_free_image(image);
     }
 
+    free(views);
     free(buffer);
     h5read_free(obj);
 
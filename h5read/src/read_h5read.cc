@@ -40,6 +40,21 @@ int main(int argc, char **argv) {
                 zero_m++;
             }
         }
+
+        // Modules viewed in place should agree with the copied modules
+        size_t zero_v = 0;
+        for (auto &view : image.module_views()) {
+            for (size_t row = 0; row < view.slow; row++) {
+                for (size_t col = 0; col < view.fast; col++) {
+                    size_t i = row * view.pitch + col;
+                    if (view.data[i] == 0 && view.mask[i] == 1) {
+                        zero_v++;
+                    }
+                }
+            }
+        }
+        assert(zero_v == zero_m);
+
         if (zero == zero_m) {
             std::cout << "\033[32m";
         } else {
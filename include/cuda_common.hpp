@@ -158,6 +158,9 @@ class CUDAArgumentParser : public argparse::ArgumentParser {
         try {
             ArgumentParser::parse_args(args);
         } catch (std::runtime_error &e) {
+            if (_throw_on_error) {
+                throw std::invalid_argument(e.what());
+            }
             fmt::print("{}: {}\n{}\n",
                        bold(red("Error")),
                        red(e.what()),
@@ -167,6 +170,10 @@ class CUDAArgumentParser : public argparse::ArgumentParser {
 
         // cudaDeviceProp deviceProp;
         if (cudaSetDevice(_arguments.device_index) != cudaSuccess) {
+            if (_throw_on_error) {
+                throw cuda_error(fmt::format("Could not select device ({})",
+                                             cuda_error_string(cudaGetLastError())));
+            }
             fmt::print(
               "\033[1;31m{}\033[0m\033[31m: Could not select device ({})\033[0m\n",
               "Error",
@@ -175,6 +182,10 @@ class CUDAArgumentParser : public argparse::ArgumentParser {
         }
         if (cudaGetDeviceProperties(&_arguments.device, _arguments.device_index)
             != cudaSuccess) {
+            if (_throw_on_error) {
+                throw cuda_error(fmt::format("Could not inspect GPU ({})",
+                                             cuda_error_string(cudaGetLastError())));
+            }
             fmt::print(fmt::runtime(red("{}: Could not inspect GPU ({})\n",
                                         bold("Error"),
                                         cuda_error_string(cudaGetLastError()))));
@@ -212,9 +223,16 @@ class CUDAArgumentParser : public argparse::ArgumentParser {
         _activated_h5read = true;
     }
 
+    /// Throw from parse_args if the arguments can't be used, rather than
+    /// exiting, e.g. so that a daemon can carry on with the next job
+    void throw_on_error() {
+        _throw_on_error = true;
+    }
+
   private:
     CUDAArguments _arguments{};
     bool _activated_h5read = false;
+    bool _throw_on_error = false;
 };
 
 template <typename T>
@@ -0,0 +1,357 @@
+/**
+ * Microbenchmarks for the CPU-side stages of the spotfinder.
+ *
+ * Benchmarks that need real detector data read their input paths from
+ * the environment, and are skipped if these are not set:
+ *
+ *   FFS_BM_CBF     Template path (e.g. image_#####.cbf) of Pilatus CBF
+ *                  images. The first image is used.
+ *
+ * Others generate their own synthetic input.
+ */
+#include <benchmark/benchmark.h>
+#include <bitshuffle.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "cbfread.hpp"
+#include "connected_components.hpp"
+#include "decompression.hpp"
+#include "fused_dispersion.hpp"
+#include "jungfrauread.hpp"
+#include "synthetic.hpp"
+#include "topology.hpp"
+
+#pragma region CBF Byte Offset
+/// Compressed data and shape for a single CBF image, read once
+struct CBFSample {
+    std::vector<uint8_t> packed;
+    size_t num_pixels;
+};
+
+auto load_cbf_sample() -> const std::optional<CBFSample> & {
+    static std::optional<CBFSample> sample = []() -> std::optional<CBFSample> {
+        const char *cbf_template = std::getenv("FFS_BM_CBF");
+        if (cbf_template == nullptr) {
+            return std::nullopt;
+        }
+        auto reader = CBFRead(cbf_template, 1, 1);
+        size_t num_pixels = reader.image_shape()[0] * reader.image_shape()[1];
+        // CBF files are compressed 32-bit, so need more storage
+        auto buffer = std::vector<uint8_t>(num_pixels * 4);
+        auto chunk = reader.get_raw_chunk(0, buffer);
+        buffer.resize(chunk.size());
+        return CBFSample{std::move(buffer), num_pixels};
+    }();
+    return sample;
+}
+
+template <typename T, unsigned int (*Decompress)(const char *, size_t, T *, size_t)>
+static void BM_cbf_decompress(benchmark::State &state) {
+    auto &sample = load_cbf_sample();
+    if (!sample) {
+        state.SkipWithError("FFS_BM_CBF not set");
+        return;
+    }
+    auto output = std::vector<T>(sample->num_pixels);
+    auto packed = reinterpret_cast<const char *>(sample->packed.data());
+
+    // Make sure we are comparing like-for-like before timing
+    auto reference = std::vector<T>(sample->num_pixels);
+    cbf_decompress_scalar(
+      packed, sample->packed.size(), reference.data(), reference.size());
+    Decompress(packed, sample->packed.size(), output.data(), output.size());
+    if (output != reference) {
+        state.SkipWithError("Decompressed data does not match scalar reference");
+        return;
+    }
+
+    for (auto _ : state) {
+        Decompress(packed, sample->packed.size(), output.data(), output.size());
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * sample->packed.size());
+    state.counters["Mpx/s"] = benchmark::Counter(
+      state.iterations() * sample->num_pixels / 1e6, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_cbf_decompress<uint16_t, cbf_decompress_scalar<uint16_t>>)
+  ->Name("BM_cbf_decompress_scalar/uint16_t")
+  ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_cbf_decompress<uint16_t, cbf_decompress<uint16_t>>)
+  ->Name("BM_cbf_decompress/uint16_t")
+  ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_cbf_decompress<int32_t, cbf_decompress_scalar<int32_t>>)
+  ->Name("BM_cbf_decompress_scalar/int32_t")
+  ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_cbf_decompress<int32_t, cbf_decompress<int32_t>>)
+  ->Name("BM_cbf_decompress/int32_t")
+  ->Unit(benchmark::kMillisecond);
+#pragma endregion CBF Byte Offset
+
+#pragma region Bitshuffle LZ4
+/// A synthetic Eiger 16M frame, compressed the way the HDF5 filter does
+struct BitshuffleSample {
+    size_t width, height;
+    std::vector<uint16_t> image;
+    std::vector<uint8_t> mask;
+    std::vector<uint8_t> chunk;
+};
+
+auto make_bitshuffle_sample() -> const BitshuffleSample & {
+    static BitshuffleSample sample = []() {
+        // Background, spots and module gaps, like a typical diffraction image
+        auto generator = SyntheticImageGenerator(SyntheticParameters{});
+        auto [height, width] = generator.image_shape();
+        auto image = std::vector<uint16_t>(width * height);
+        generator.generate(0, image);
+        auto chunk = bshuf_compress_lz4_chunk(
+          {reinterpret_cast<const uint8_t *>(image.data()),
+           image.size() * sizeof(uint16_t)},
+          sizeof(uint16_t));
+        auto mask = std::vector<uint8_t>(generator.mask().begin(),
+                                         generator.mask().end());
+        return BitshuffleSample{
+          width, height, std::move(image), std::move(mask), std::move(chunk)};
+    }();
+    return sample;
+}
+
+static void BM_bshuf_decompress_lz4(benchmark::State &state) {
+    auto &sample = make_bitshuffle_sample();
+    auto output = std::vector<uint16_t>(sample.image.size());
+    for (auto _ : state) {
+        bshuf_decompress_lz4(
+          sample.chunk.data() + 12, output.data(), output.size(), 2, 0);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    if (output != sample.image) {
+        state.SkipWithError("Decompressed data does not match input");
+    }
+    state.SetBytesProcessed(state.iterations() * output.size() * sizeof(uint16_t));
+    state.counters["ratio"] =
+      static_cast<double>(output.size() * sizeof(uint16_t)) / sample.chunk.size();
+}
+BENCHMARK(BM_bshuf_decompress_lz4)->Unit(benchmark::kMillisecond);
+
+/// Argument is the total number of threads, including the caller
+static void BM_bshuf_decompress_lz4_parallel(benchmark::State &state) {
+    auto &sample = make_bitshuffle_sample();
+    auto output = std::vector<uint16_t>(sample.image.size());
+    auto output_bytes = std::span{reinterpret_cast<uint8_t *>(output.data()),
+                                  output.size() * sizeof(uint16_t)};
+    ThreadPool pool(state.range(0) - 1);
+    for (auto _ : state) {
+        bshuf_decompress_lz4_parallel(pool, sample.chunk, output_bytes, 2);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    if (output != sample.image) {
+        state.SkipWithError("Decompressed data does not match input");
+    }
+    state.SetBytesProcessed(state.iterations() * output_bytes.size());
+}
+BENCHMARK(BM_bshuf_decompress_lz4_parallel)
+  ->RangeMultiplier(2)
+  ->Range(1, std::max(1u, std::thread::hardware_concurrency()))
+  ->UseRealTime()
+  ->Unit(benchmark::kMillisecond);
+#pragma endregion Bitshuffle LZ4
+
+#pragma region CPU Dispersion
+/// Decompress the whole image, then threshold it in a second pass
+static void BM_dispersion_separate(benchmark::State &state) {
+    auto &sample = make_bitshuffle_sample();
+    auto dispersion =
+      FusedDispersion(sample.width, sample.height, sample.mask, 65534);
+    auto image = std::vector<pixel_t>(sample.image.size());
+    auto strong = std::vector<uint8_t>(sample.image.size());
+    for (auto _ : state) {
+        bshuf_decompress_lz4(
+          sample.chunk.data() + 12, image.data(), image.size(), 2, 0);
+        dispersion.process_image(image, strong);
+        benchmark::DoNotOptimize(strong.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * image.size() * sizeof(pixel_t));
+    state.counters["strong"] = std::count(strong.begin(), strong.end(), 1);
+}
+BENCHMARK(BM_dispersion_separate)->Unit(benchmark::kMillisecond);
+
+/// Threshold each block of rows as soon as it is decompressed
+static void BM_dispersion_fused(benchmark::State &state) {
+    auto &sample = make_bitshuffle_sample();
+    auto dispersion =
+      FusedDispersion(sample.width, sample.height, sample.mask, 65534);
+    auto strong = std::vector<uint8_t>(sample.image.size());
+
+    // Check against the two-pass version
+    auto reference = std::vector<uint8_t>(sample.image.size());
+    dispersion.process_image(sample.image, reference);
+    if (!dispersion.process_bitshuffle_lz4(sample.chunk, strong)
+        || strong != reference) {
+        state.SkipWithError("Fused result does not match two-pass result");
+        return;
+    }
+
+    for (auto _ : state) {
+        dispersion.process_bitshuffle_lz4(sample.chunk, strong);
+        benchmark::DoNotOptimize(strong.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * strong.size() * sizeof(pixel_t));
+    state.counters["strong"] = std::count(strong.begin(), strong.end(), 1);
+}
+BENCHMARK(BM_dispersion_fused)->Unit(benchmark::kMillisecond);
+#pragma endregion CPU Dispersion
+
+#pragma region Connected Components
+/// Argument is the total number of threads, including the caller
+static void BM_find_reflections(benchmark::State &state) {
+    auto &sample = make_bitshuffle_sample();
+    auto dispersion =
+      FusedDispersion(sample.width, sample.height, sample.mask, 65534);
+    auto strong = std::vector<uint8_t>(sample.image.size());
+    dispersion.process_image(sample.image, strong);
+    ThreadPool pool(state.range(0) - 1);
+    size_t num_reflections = 0;
+    for (auto _ : state) {
+        auto reflections = find_reflections(strong, sample.width, sample.height, pool);
+        num_reflections = reflections.size();
+        benchmark::DoNotOptimize(reflections.data());
+    }
+    state.SetBytesProcessed(state.iterations() * strong.size());
+    state.counters["reflections"] = num_reflections;
+}
+BENCHMARK(BM_find_reflections)
+  ->RangeMultiplier(2)
+  ->Range(1, std::max(1u, std::thread::hardware_concurrency()))
+  ->UseRealTime()
+  ->Unit(benchmark::kMillisecond);
+#pragma endregion Connected Components
+
+#pragma region NUMA Placement
+/// Decompress into a buffer allocated on the first NUMA node, from a thread
+/// on the node given by the argument. Needs a machine with two nodes.
+static void BM_numa_decompress(benchmark::State &state) {
+    auto topology = Topology::detect();
+    if (topology.nodes().size() <= static_cast<size_t>(state.range(0))) {
+        state.SkipWithError("Not enough NUMA nodes");
+        return;
+    }
+    auto &sample = make_bitshuffle_sample();
+    std::vector<uint16_t> output;
+    run_on_node(topology.nodes().front(),
+                [&]() { output = std::vector<uint16_t>(sample.image.size()); });
+
+    auto all_cpus = std::vector<int>();
+    for (auto &node : topology.nodes()) {
+        all_cpus.insert(all_cpus.end(), node.cpus.begin(), node.cpus.end());
+    }
+    pin_current_thread(topology.nodes()[state.range(0)].cpus);
+    for (auto _ : state) {
+        bshuf_decompress_lz4(
+          sample.chunk.data() + 12, output.data(), output.size(), 2, 0);
+        benchmark::DoNotOptimize(output.data());
+        benchmark::ClobberMemory();
+    }
+    pin_current_thread(all_cpus);
+    state.SetBytesProcessed(state.iterations() * output.size() * sizeof(uint16_t));
+}
+BENCHMARK(BM_numa_decompress)
+  ->ArgName("node")
+  ->Arg(0)
+  ->Arg(1)
+  ->Unit(benchmark::kMillisecond);
+#pragma endregion NUMA Placement
+
+#pragma region Jungfrau Conversion
+/// Raw frame and calibration for a Jungfrau 4M (8 modules, without gaps)
+struct JungfrauSample {
+    std::vector<uint16_t> raw;
+    JungfrauCalibration calibration;
+};
+
+auto make_jungfrau_sample() -> const JungfrauSample & {
+    static JungfrauSample sample = []() {
+        constexpr size_t num_pixels = 2048 * 2048;
+        // Realistic-ish calibration: G1 and G2 gains are negative, since
+        // the ADC value falls as charge rises in those stages.
+        // Gains are in ADU/keV, times a 12.4 keV photon energy
+        constexpr std::array<float, 3> gains = {
+          40.0f * 12.4f, -1.5f * 12.4f, -0.11f * 12.4f};
+        constexpr std::array<float, 3> pedestals = {3000, 14000, 15000};
+        auto pedestal = std::vector<float>(3 * num_pixels);
+        auto gain = std::vector<float>(3 * num_pixels);
+        uint32_t state = 1;
+        auto next = [&]() {
+            state = state * 1664525 + 1013904223;
+            return state >> 8;
+        };
+        for (size_t g = 0; g < 3; ++g) {
+            for (size_t i = 0; i < num_pixels; ++i) {
+                pedestal[g * num_pixels + i] = pedestals[g] + next() % 200;
+                gain[g * num_pixels + i] =
+                  gains[g] * (0.95f + (next() % 100) / 1000.0f);
+            }
+        }
+        // Mostly low counts in G0, with a few pixels switched to G1 and G2
+        auto raw = std::vector<uint16_t>(num_pixels);
+        for (size_t i = 0; i < num_pixels; ++i) {
+            uint32_t r = next() % 1000;
+            if (r < 5) {
+                raw[i] = 0x4000 | (10000 + next() % 4000);
+            } else if (r < 6) {
+                raw[i] = 0xC000 | (12000 + next() % 3000);
+            } else {
+                raw[i] = 3000 + next() % 1500;
+            }
+        }
+        return JungfrauSample{std::move(raw),
+                              JungfrauCalibration(num_pixels, pedestal, gain)};
+    }();
+    return sample;
+}
+
+using JungfrauConvert = void (JungfrauCalibration::*)(std::span<const uint16_t>,
+                                                      std::span<pixel_t>) const;
+
+template <JungfrauConvert Convert>
+static void BM_jungfrau_convert(benchmark::State &state) {
+    auto &sample = make_jungfrau_sample();
+    auto image = std::vector<pixel_t>(sample.raw.size());
+
+    // Check against the scalar version
+    auto reference = std::vector<pixel_t>(sample.raw.size());
+    sample.calibration.convert_scalar(sample.raw, reference);
+    (sample.calibration.*Convert)(sample.raw, image);
+    if (image != reference) {
+        state.SkipWithError("Result does not match scalar result");
+        return;
+    }
+
+    for (auto _ : state) {
+        (sample.calibration.*Convert)(sample.raw, image);
+        benchmark::DoNotOptimize(image.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * sample.raw.size() * sizeof(uint16_t));
+    // The Jungfrau target is 2500 frames/s
+    state.counters["frames"] =
+      benchmark::Counter(state.iterations(), benchmark::Counter::kIsRate);
+    state.counters["avx2"] = JungfrauCalibration::has_avx2();
+}
+BENCHMARK(BM_jungfrau_convert<&JungfrauCalibration::convert_scalar>)
+  ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_jungfrau_convert<&JungfrauCalibration::convert>)
+  ->Unit(benchmark::kMillisecond);
+#pragma endregion Jungfrau Conversion
+
+BENCHMARK_MAIN();
@@ -1,12 +1,23 @@
 
 #include "cbfread.hpp"
 
+#include <fcntl.h>
 #include <fmt/core.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <bit>
 #include <cassert>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <stdexcept>
 #include <string_view>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "bitshuffle.h"
 #include "common.hpp"
@@ -23,6 +34,175 @@ auto expand_template(const std::string &template_path, size_t index) -> std::str
     return format("{}{:0{}d}{}", prefix, index, template_length, suffix);
 }
 
+#pragma region Byte Offset Decompression
+namespace {
+/// Read a little-endian signed 16-bit delta from the packed stream
+inline int read_le16(const char *p) {
+    return static_cast<int16_t>(static_cast<uint8_t>(p[0])
+                                | static_cast<uint8_t>(p[1]) << 8);
+}
+/// Read a little-endian signed 32-bit delta from the packed stream
+inline int read_le32(const char *p) {
+    return static_cast<int32_t>(
+      static_cast<uint32_t>(static_cast<uint8_t>(p[0]))
+      | static_cast<uint32_t>(static_cast<uint8_t>(p[1])) << 8
+      | static_cast<uint32_t>(static_cast<uint8_t>(p[2])) << 16
+      | static_cast<uint32_t>(static_cast<uint8_t>(p[3])) << 24);
+}
+
+#if defined(__SSE2__)
+/// Bitmask of the escape byte (0x80) positions in the next 32 packed bytes
+inline uint32_t find_escapes_32(const char *packed) {
+#if defined(__AVX2__)
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(packed));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(-0x80)));
+#else
+    const __m128i escape = _mm_set1_epi8(-0x80);
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(packed));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(packed + 16));
+    uint32_t mask_lo = _mm_movemask_epi8(_mm_cmpeq_epi8(lo, escape));
+    uint32_t mask_hi = _mm_movemask_epi8(_mm_cmpeq_epi8(hi, escape));
+    return mask_lo | (mask_hi << 16);
+#endif
+}
+
+/// Inclusive prefix sum of eight 16-bit lanes
+inline __m128i prefix_sum_epi16(__m128i x) {
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+    return _mm_add_epi16(x, _mm_slli_si128(x, 8));
+}
+
+/// Broadcast the last 16-bit lane to every lane
+inline __m128i broadcast_last_epi16(__m128i x) {
+    x = _mm_shufflehi_epi16(x, 0xFF);
+    return _mm_unpackhi_epi64(x, x);
+}
+
+/**
+ * @brief Decode 16 single-byte deltas that are known not to contain escapes.
+ *
+ * The deltas are sign-extended to 16 bits and prefix-summed in-register.
+ * Sixteen deltas can't sum past ±2048, so 16-bit lanes don't overflow
+ * before they are either stored (16-bit outputs, where wraparound
+ * matches truncation of the running total) or widened to 32 bits.
+ *
+ * @param packed    Pointer to the 16 packed delta bytes
+ * @param current   Running total, updated to the last decoded value
+ * @param values    Output for the 16 decoded values
+ */
+template <typename Tout>
+inline void decode_deltas_16(const char *packed, int &current, Tout *values) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(packed));
+    // Sign-extend each byte by duplicating into both halves, then shifting
+    __m128i lo = prefix_sum_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(bytes, bytes), 8));
+    __m128i hi = prefix_sum_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(bytes, bytes), 8));
+    hi = _mm_add_epi16(hi, broadcast_last_epi16(lo));
+
+    if constexpr (sizeof(Tout) == 2) {
+        __m128i base = _mm_set1_epi16(static_cast<int16_t>(current));
+        lo = _mm_add_epi16(lo, base);
+        hi = _mm_add_epi16(hi, base);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(values), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(values + 8), hi);
+        // Only the low 16 bits of the running total reach a 16-bit output
+        current = static_cast<int16_t>(_mm_extract_epi16(hi, 7));
+    } else {
+        static_assert(sizeof(Tout) == 4);
+        __m128i base = _mm_set1_epi32(current);
+        auto widen_lo = [](__m128i x) {
+            return _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        };
+        auto widen_hi = [](__m128i x) {
+            return _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        };
+        auto *out = reinterpret_cast<__m128i *>(values);
+        _mm_storeu_si128(out + 0, _mm_add_epi32(widen_lo(lo), base));
+        _mm_storeu_si128(out + 1, _mm_add_epi32(widen_hi(lo), base));
+        _mm_storeu_si128(out + 2, _mm_add_epi32(widen_lo(hi), base));
+        _mm_storeu_si128(out + 3, _mm_add_epi32(widen_hi(hi), base));
+        current += static_cast<int16_t>(_mm_extract_epi16(hi, 7));
+    }
+}
+#endif
+}  // namespace
+
+template <typename Tout>
+unsigned int cbf_decompress(const char *packed,
+                            std::size_t packed_sz,
+                            Tout *values,
+                            std::size_t values_sz) {
+    static_assert(std::is_integral_v<Tout> && (sizeof(Tout) == 2 || sizeof(Tout) == 4),
+                  "Byte-offset decompression writes 16- or 32-bit integers");
+    int current = 0;
+    std::size_t j = 0;
+    std::size_t n = 0;
+
+    while (j < packed_sz && n < values_sz) {
+#if defined(__SSE2__)
+        if (packed_sz - j >= 32 && values_sz - n >= 32) {
+            uint32_t escapes = find_escapes_32(packed + j);
+            if (escapes == 0) {
+                decode_deltas_16(packed + j, current, values + n);
+                decode_deltas_16(packed + j + 16, current, values + n + 16);
+                j += 32;
+                n += 32;
+                continue;
+            }
+            // Decode the run of plain deltas up to the first escape
+            int run = std::countr_zero(escapes);
+            if (run >= 16) {
+                decode_deltas_16(packed + j, current, values + n);
+                j += 16;
+                n += 16;
+                run -= 16;
+            }
+            for (; run > 0; --run) {
+                current += static_cast<int8_t>(packed[j++]);
+                values[n++] = current;
+            }
+        }
+#endif
+        // Scalar path: decode exactly one value, escaped or not
+        char c = packed[j++];
+        if (c != -0x80) {
+            current += c;
+        } else {
+            if (j + 2 > packed_sz) break;
+            int s = read_le16(packed + j);
+            j += 2;
+            if (s != -0x8000) {
+                current += s;
+            } else {
+                if (j + 4 > packed_sz) break;
+                current += read_le32(packed + j);
+                j += 4;
+            }
+        }
+        values[n++] = current;
+    }
+
+    return n;
+}
+
+template unsigned int cbf_decompress<uint16_t>(const char *,
+                                               std::size_t,
+                                               uint16_t *,
+                                               std::size_t);
+template unsigned int cbf_decompress<int16_t>(const char *,
+                                              std::size_t,
+                                              int16_t *,
+                                              std::size_t);
+template unsigned int cbf_decompress<uint32_t>(const char *,
+                                               std::size_t,
+                                               uint32_t *,
+                                               std::size_t);
+template unsigned int cbf_decompress<int32_t>(const char *,
+                                              std::size_t,
+                                              int32_t *,
+                                              std::size_t);
+#pragma endregion Byte Offset Decompression
+
 // template <>
 // void decompress_byte_offset(const std::span<uint8_t> in, std::span<uint16_t> out);
 
@@ -38,8 +218,7 @@ auto get_value_contents(const std::string &input) -> std::string {
 CBFRead::CBFRead(const std::string &templatestr, size_t num_images, size_t first_index)
     : _num_images(num_images), _first_index(first_index), _template_path(templatestr) {
     if (first_index > 1) {
-        print("Error: Can only handle CBF start index of 0 or 1\n");
-        std::exit(1);
+        throw std::invalid_argument("Can only handle CBF start index of 0 or 1");
     }
     // We must have our first file, as we read this for mask and metadata
     assert(std::filesystem::exists(expand_template(templatestr, _first_index)));
@@ -60,11 +239,16 @@ CBFRead::CBFRead(const std::string &templatestr, size_t num_images, size_t first
             }
         }
     }
+}
+
+void CBFRead::read_mask() const {
     // Read the data for the first image to generate a mask
     const size_t num_pixels = _image_shape[0] * _image_shape[1];
     // CBF files are compressed 32-bit, so need more storage
     auto compressed_data_buffer = std::make_unique<uint8_t[]>(num_pixels * 4);
-    get_raw_chunk(0, {compressed_data_buffer.get(), num_pixels * 4});
+    // Reading a chunk doesn't change the reader
+    const_cast<CBFRead *>(this)->get_raw_chunk(
+      0, {compressed_data_buffer.get(), num_pixels * 4});
     for (int i = 0; i < 32; ++i) {
         print("{:02x} ", compressed_data_buffer[i]);
     }
@@ -84,44 +268,73 @@ CBFRead::CBFRead(const std::string &templatestr, size_t num_images, size_t first
     draw_image_data(_mask.data(), 0, 190, 30, 30, _image_shape[1], _image_shape[0]);
 }
 
+std::optional<std::string> CBFRead::get_mask_source() const {
+    return file_fingerprint(expand_template(_template_path, _first_index));
+}
+
 bool CBFRead::is_image_available(size_t index) {
     return std::filesystem::exists(
       expand_template(_template_path, index + _first_index));
 }
 
-std::span<uint8_t> CBFRead::get_raw_chunk(size_t index,
-                                          std::span<uint8_t> destination) {
+auto CBFRead::read_chunk(size_t index,
+                         std::span<uint8_t> destination,
+                         std::vector<char> &file_data)
+  -> std::optional<std::span<uint8_t>> {
     auto filename = expand_template(_template_path, index + _first_index);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    // Read the whole file in one go
+    struct stat info;
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        return std::nullopt;
+    }
+    file_data.resize(info.st_size);
+    size_t bytes_read = 0;
+    while (bytes_read < file_data.size()) {
+        ssize_t bytes =
+          read(fd, file_data.data() + bytes_read, file_data.size() - bytes_read);
+        if (bytes <= 0) {
+            break;
+        }
+        bytes_read += bytes;
+    }
+    close(fd);
 
-    // std::vector<char> file_data;
-    std::string file_data;
-    file_data.reserve(std::filesystem::file_size(filename));
-    // file_data.reserve);
-
-    auto f = std::ifstream(filename, std::ios::in | std::ios::binary);
-    std::array<char, 4096> read_buffer;
-
-    // Read until we find the binary marker
-    do {
-        f.read(read_buffer.data(), read_buffer.size());
-        file_data.append(read_buffer.data(), f.gcount());
-    } while (f.gcount());
-    size_t data_start = file_data.find(BINARY_MARKER) + BINARY_MARKER.length();
-    // auto byte_data = std::string_view
-
-    //   reinterpret_cast<uint8_t *>(file_data.data()) + data_start,
-    //   file_data.length() - data_start};
+    auto contents = std::string_view{file_data.data(), bytes_read};
+    size_t marker = contents.find(BINARY_MARKER);
+    if (marker == std::string_view::npos) {
+        return std::nullopt;
+    }
+    auto binary = contents.substr(marker + BINARY_MARKER.length());
+    assert(destination.size_bytes() >= binary.size());
+    std::copy(binary.begin(), binary.end(), destination.begin());
+    return {{destination.data(), binary.size()}};
+}
 
-    assert(destination.size_bytes() >= (file_data.length() - data_start));
-    // auto resized_span =
-    //   std::span<uint8_t>(destination.begin(), file_data.length() - data_start);
-    std::copy(file_data.begin() + data_start, file_data.end(), destination.begin());
+std::span<uint8_t> CBFRead::get_raw_chunk(size_t index,
+                                          std::span<uint8_t> destination) {
+    std::vector<char> file_data;
+    return read_chunk(index, destination, file_data).value_or(std::span<uint8_t>{});
+}
 
-    for (size_t i = data_start; i < file_data.length(); ++i) {
-        destination[i - data_start] = file_data[i];
+auto CBFRead::get_raw_chunks(size_t first,
+                             std::span<const std::span<uint8_t>> destinations)
+  -> std::vector<std::span<uint8_t>> {
+    // Share one read buffer across the batch
+    std::vector<char> file_data;
+    std::vector<std::span<uint8_t>> chunks;
+    for (size_t i = 0; i < destinations.size(); ++i) {
+        auto chunk = read_chunk(first + i, destinations[i], file_data);
+        if (!chunk) {
+            break;
+        }
+        chunks.push_back(*chunk);
     }
-
-    return {destination.data(), file_data.length() - data_start};
+    return chunks;
 }
 
 template <>
@@ -3,6 +3,9 @@
 #include <cuda_runtime.h>
 #include <fmt/core.h>
 
+#include <cassert>
+#include <mutex>
+#include <span>
 #include <vector>
 
 #include "h5read.h"
@@ -46,11 +49,14 @@ inline bool little_endian() {
     }
 }
 
+/// Reference byte-offset decompressor, one packed byte at a time.
+///
+/// Kept for validating and benchmarking the vectorised cbf_decompress.
 template <typename Tout>
-unsigned int cbf_decompress(const char *packed,
-                            std::size_t packed_sz,
-                            Tout *values,
-                            std::size_t values_sz) {
+unsigned int cbf_decompress_scalar(const char *packed,
+                                   std::size_t packed_sz,
+                                   Tout *values,
+                                   std::size_t values_sz) {
     int current = 0;
     Tout *original = values;
     unsigned int j = 0;
@@ -105,6 +111,25 @@ unsigned int cbf_decompress(const char *packed,
     return values - original;
 }
 
+/**
+ * @brief Decompress CBF byte-offset packed data.
+ *
+ * The packed stream is scanned 32 bytes at a time for escape bytes
+ * (0x80). Blocks without any escapes are decoded with a vectorised
+ * prefix sum straight into the output; escaped 16- and 32-bit deltas
+ * are decoded on the scalar path. Values are truncated to the output
+ * type in the same way as cbf_decompress_scalar.
+ *
+ * Instantiated for 16- and 32-bit integer outputs.
+ *
+ * @returns The number of values written
+ */
+template <typename Tout>
+unsigned int cbf_decompress(const char *packed,
+                            std::size_t packed_sz,
+                            Tout *values,
+                            std::size_t values_sz);
+
 template <typename Tout>
 void decompress_byte_offset(const std::span<uint8_t> in, std::span<Tout> out) {
     cbf_decompress(reinterpret_cast<const char *>(in.data()),
@@ -119,7 +144,18 @@ class CBFRead : public Reader {
     size_t _first_index;
     std::array<size_t, 2> _image_shape;
     const std::string _template_path;
-    std::vector<uint8_t> _mask;
+    /// Made from the first image on first use, since a cached copy of the
+    /// final mask might be used instead
+    mutable std::vector<uint8_t> _mask;
+    mutable std::once_flag _mask_read;
+
+    void read_mask() const;
+    /// Read an image's binary section, or nullopt if it isn't there yet.
+    /// The whole file is read into file_data first.
+    auto read_chunk(size_t index,
+                    std::span<uint8_t> destination,
+                    std::vector<char> &file_data)
+      -> std::optional<std::span<uint8_t>>;
 
   public:
     CBFRead(const std::string &templatestr, size_t num_images, size_t first_index);
@@ -127,6 +163,8 @@ class CBFRead : public Reader {
     bool is_image_available(size_t index);
 
     std::span<uint8_t> get_raw_chunk(size_t index, std::span<uint8_t> destination);
+    auto get_raw_chunks(size_t first, std::span<const std::span<uint8_t>> destinations)
+      -> std::vector<std::span<uint8_t>>;
 
     ChunkCompression get_raw_chunk_compression() {
         return Reader::ChunkCompression::BYTE_OFFSET_32;
@@ -138,8 +176,11 @@ class CBFRead : public Reader {
         return _image_shape;
     };
     std::optional<std::span<const uint8_t>> get_mask() const {
+        std::call_once(_mask_read, [this] { read_mask(); });
         return {{_mask.data(), _mask.size()}};
     }
+    /// The mask is made from the first image
+    std::optional<std::string> get_mask_source() const;
     virtual std::array<image_t_type, 2> get_trusted_range() const {
         return {0, std::numeric_limits<image_t_type>::max()};
     }
@@ -0,0 +1,177 @@
+#include "connected_components.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+namespace {
+/// A horizontal run of strong pixels, covering [start, end) of one row
+struct Run {
+    int row;
+    int start;
+    int end;
+};
+
+/// Runs found in a band of rows, with a forest joining the connected ones
+struct Band {
+    std::vector<Run> runs;
+    std::vector<uint32_t> parent;
+    /// Runs on the band's first row are [0, first_row_end)
+    size_t first_row_end = 0;
+    /// Runs on the band's last row are [last_row_begin, runs.size())
+    size_t last_row_begin = 0;
+};
+
+/// Follow parents up to the root, halving the path on the way
+auto find_root(std::vector<uint32_t> &parent, uint32_t i) -> uint32_t {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+/// Join two sets. The earlier root is kept, so each root is the first run
+/// of its set in the image.
+void join(std::vector<uint32_t> &parent, uint32_t a, uint32_t b) {
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b) {
+        parent[b] = a;
+    } else if (b < a) {
+        parent[a] = b;
+    }
+}
+
+/// Join each run in [begin, end) to the runs it touches in [above_begin,
+/// above_end), the row above. Both rows' runs are in order along the row.
+void join_rows(const std::vector<Run> &runs,
+               std::vector<uint32_t> &parent,
+               size_t above_begin,
+               size_t above_end,
+               size_t begin,
+               size_t end) {
+    size_t above = above_begin;
+    for (size_t i = begin; i < end; ++i) {
+        // Runs above that finish before this one starts can't touch
+        // this or any later run
+        while (above < above_end && runs[above].end <= runs[i].start) {
+            ++above;
+        }
+        for (size_t j = above; j < above_end && runs[j].start < runs[i].end; ++j) {
+            join(parent, j, i);
+        }
+    }
+}
+
+void label_band(std::span<const uint8_t> strong,
+                int width,
+                int row_begin,
+                int row_end,
+                Band &band) {
+    size_t above_begin = 0, above_end = 0;
+    for (int row = row_begin; row < row_end; ++row) {
+        const uint8_t *pixels = strong.data() + static_cast<size_t>(row) * width;
+        size_t row_runs_begin = band.runs.size();
+        for (int x = 0; x < width;) {
+            // Strong pixels are sparse, so skip over eight blanks at a time
+            if (x + 8 <= width) {
+                uint64_t eight;
+                std::memcpy(&eight, pixels + x, sizeof(eight));
+                if (eight == 0) {
+                    x += 8;
+                    continue;
+                }
+            }
+            if (!pixels[x]) {
+                ++x;
+                continue;
+            }
+            int start = x;
+            while (x < width && pixels[x]) {
+                ++x;
+            }
+            band.runs.push_back({row, start, x});
+            band.parent.push_back(band.parent.size());
+        }
+        if (row == row_begin) {
+            band.first_row_end = band.runs.size();
+        } else {
+            join_rows(band.runs,
+                      band.parent,
+                      above_begin,
+                      above_end,
+                      row_runs_begin,
+                      band.runs.size());
+        }
+        above_begin = row_runs_begin;
+        above_end = band.runs.size();
+    }
+    band.last_row_begin = above_begin;
+}
+}  // namespace
+
+auto find_reflections(std::span<const uint8_t> strong,
+                      int width,
+                      int height,
+                      ThreadPool &pool) -> std::vector<Reflection> {
+    if (height <= 0) {
+        return {};
+    }
+    // A few bands per thread, so that a band dense with spots doesn't
+    // leave the others waiting
+    size_t num_bands = std::min<size_t>((pool.size() + 1) * 4, height);
+    auto bands = std::vector<Band>(num_bands);
+    pool.parallel_for(num_bands, [&](size_t i) {
+        label_band(strong,
+                   width,
+                   i * height / num_bands,
+                   (i + 1) * height / num_bands,
+                   bands[i]);
+    });
+
+    // Gather every band's runs into one forest
+    auto offsets = std::vector<size_t>(num_bands + 1);
+    for (size_t i = 0; i < num_bands; ++i) {
+        offsets[i + 1] = offsets[i] + bands[i].runs.size();
+    }
+    auto runs = std::vector<Run>();
+    auto parent = std::vector<uint32_t>();
+    runs.reserve(offsets.back());
+    parent.reserve(offsets.back());
+    for (size_t i = 0; i < num_bands; ++i) {
+        runs.insert(runs.end(), bands[i].runs.begin(), bands[i].runs.end());
+        for (auto p : bands[i].parent) {
+            parent.push_back(offsets[i] + p);
+        }
+    }
+    // Join up the reflections that cross from one band into the next
+    for (size_t i = 1; i < num_bands; ++i) {
+        join_rows(runs,
+                  parent,
+                  offsets[i - 1] + bands[i - 1].last_row_begin,
+                  offsets[i],
+                  offsets[i],
+                  offsets[i] + bands[i].first_row_end);
+    }
+
+    // Runs are in image order, so the first run seen of each reflection
+    // is its root
+    auto reflection_of_root = std::vector<int>(runs.size(), -1);
+    auto reflections = std::vector<Reflection>();
+    for (size_t i = 0; i < runs.size(); ++i) {
+        auto root = find_root(parent, i);
+        if (reflection_of_root[root] < 0) {
+            reflection_of_root[root] = reflections.size();
+            reflections.push_back({width, height, 0, 0});
+        }
+        auto &run = runs[i];
+        auto &reflection = reflections[reflection_of_root[root]];
+        reflection.l = std::min(reflection.l, run.start);
+        reflection.r = std::max(reflection.r, run.end - 1);
+        reflection.t = std::min(reflection.t, run.row);
+        reflection.b = std::max(reflection.b, run.row);
+        reflection.num_pixels += run.end - run.start;
+    }
+    return reflections;
+}
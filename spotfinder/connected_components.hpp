@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+struct Reflection {
+    int l, t, r, b;
+    int num_pixels = 0;
+};
+
+/**
+ * @brief Group strong pixels into reflections, as DIALS' connected components does.
+ *
+ * Strong pixels belong to the same reflection if they touch along an edge.
+ * The image is cut into bands of rows, which are labelled in parallel over
+ * the pool and then joined up where they meet.
+ *
+ * @param strong Non-zero for every strong pixel
+ * @returns The bounding box and pixel count of every reflection, ordered
+ *          by where each one's first pixel is in the image.
+ */
+auto find_reflections(std::span<const uint8_t> strong,
+                      int width,
+                      int height,
+                      ThreadPool &pool) -> std::vector<Reflection>;
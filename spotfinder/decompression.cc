@@ -0,0 +1,149 @@
+#include "decompression.hpp"
+
+#include <bitshuffle.h>
+
+#include <algorithm>
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+namespace {
+/// Tasks to split each chunk into, per thread. More than one per thread
+/// so that a slow block doesn't leave the other threads idle.
+constexpr size_t tasks_per_thread = 4;
+
+auto read_be32(const uint8_t *data) -> uint32_t {
+    return (uint32_t{data[0]} << 24) | (uint32_t{data[1]} << 16)
+           | (uint32_t{data[2]} << 8) | uint32_t{data[3]};
+}
+auto read_be64(const uint8_t *data) -> uint64_t {
+    return (uint64_t{read_be32(data)} << 32) | read_be32(data + 4);
+}
+void write_be32(uint8_t *data, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        data[i] = value >> (24 - 8 * i);
+    }
+}
+void write_be64(uint8_t *data, uint64_t value) {
+    write_be32(data, value >> 32);
+    write_be32(data + 4, value);
+}
+}  // namespace
+
+auto read_bshuf_chunk_header(std::span<const uint8_t> chunk, size_t elem_size)
+  -> std::optional<BitshuffleChunkHeader> {
+    if (chunk.size() < BitshuffleChunkHeader::size || elem_size == 0) {
+        return std::nullopt;
+    }
+    auto header = BitshuffleChunkHeader{read_be64(chunk.data()),
+                                        read_be32(chunk.data() + 8)};
+    size_t block_elems = header.block_bytes / elem_size;
+    if (header.uncompressed_bytes % elem_size != 0
+        || header.block_bytes % elem_size != 0 || block_elems == 0
+        || block_elems % BitshuffleChunkHeader::block_multiple != 0) {
+        return std::nullopt;
+    }
+    return header;
+}
+
+auto bshuf_block_length(std::span<const uint8_t> chunk, size_t offset)
+  -> std::optional<size_t> {
+    if (offset + 4 > chunk.size()) {
+        return std::nullopt;
+    }
+    size_t length = 4 + read_be32(chunk.data() + offset);
+    if (offset + length > chunk.size()) {
+        return std::nullopt;
+    }
+    return length;
+}
+
+auto bshuf_decompress_lz4_parallel(ThreadPool &pool,
+                                   std::span<const uint8_t> chunk,
+                                   std::span<uint8_t> dest,
+                                   size_t elem_size) -> int64_t {
+    auto header = read_bshuf_chunk_header(chunk, elem_size);
+    if (!header || header->uncompressed_bytes != dest.size()) {
+        return -1;
+    }
+    size_t block_bytes = header->block_bytes;
+    size_t num_elems = header->uncompressed_bytes / elem_size;
+    size_t block_elems = block_bytes / elem_size;
+
+    // Walk the compressed size prefixes to find where each full block
+    // starts. Whatever remains after these is a (possibly empty) partial
+    // block and the uncompressed leftover elements.
+    size_t num_blocks = num_elems / block_elems;
+    auto block_offsets = std::vector<size_t>(num_blocks + 1);
+    size_t offset = BitshuffleChunkHeader::size;
+    for (size_t block = 0; block < num_blocks; ++block) {
+        auto length = bshuf_block_length(chunk, offset);
+        if (!length) {
+            return -1;
+        }
+        block_offsets[block] = offset;
+        offset += *length;
+    }
+    block_offsets[num_blocks] = offset;
+
+    // Runs of consecutive blocks are contiguous in both the input and the
+    // output, so each task hands a whole run to bitshuffle in one call.
+    // The final task handles the tail.
+    size_t num_tasks = std::min(num_blocks, (pool.size() + 1) * tasks_per_thread);
+    std::atomic<bool> failed = false;
+    int64_t tail_consumed = 0;
+    pool.parallel_for(num_tasks + 1, [&](size_t task) {
+        if (task == num_tasks) {
+            size_t remaining = num_elems - num_blocks * block_elems;
+            if (remaining > 0) {
+                tail_consumed =
+                  bshuf_decompress_lz4(chunk.data() + offset,
+                                       dest.data() + num_blocks * block_bytes,
+                                       remaining,
+                                       elem_size,
+                                       block_elems);
+                if (tail_consumed < 0) {
+                    failed = true;
+                }
+            }
+            return;
+        }
+        size_t first = task * num_blocks / num_tasks;
+        size_t last = (task + 1) * num_blocks / num_tasks;
+        int64_t consumed = bshuf_decompress_lz4(chunk.data() + block_offsets[first],
+                                                dest.data() + first * block_bytes,
+                                                (last - first) * block_elems,
+                                                elem_size,
+                                                block_elems);
+        auto expected = block_offsets[last] - block_offsets[first];
+        if (consumed != static_cast<int64_t>(expected)) {
+            failed = true;
+        }
+    });
+    if (failed) {
+        return -1;
+    }
+    return offset + tail_consumed;
+}
+
+auto bshuf_compress_lz4_chunk(std::span<const uint8_t> data, size_t elem_size)
+  -> std::vector<uint8_t> {
+    size_t num_elems = data.size() / elem_size;
+    size_t block_elems = bshuf_default_block_size(elem_size);
+    auto chunk = std::vector<uint8_t>(
+      BitshuffleChunkHeader::size
+      + bshuf_compress_lz4_bound(num_elems, elem_size, block_elems));
+    write_be64(chunk.data(), data.size());
+    write_be32(chunk.data() + 8, block_elems * elem_size);
+    int64_t compressed_size =
+      bshuf_compress_lz4(data.data(),
+                         chunk.data() + BitshuffleChunkHeader::size,
+                         num_elems,
+                         elem_size,
+                         block_elems);
+    if (compressed_size < 0) {
+        throw std::runtime_error("Bitshuffle compression failed");
+    }
+    chunk.resize(BitshuffleChunkHeader::size + compressed_size);
+    return chunk;
+}
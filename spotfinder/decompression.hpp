@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+/// The header the HDF5 bitshuffle filter writes at the start of each chunk
+struct BitshuffleChunkHeader {
+    static constexpr size_t size = 12;
+    /// Bitshuffle block sizes must be a multiple of this many elements
+    static constexpr size_t block_multiple = 8;
+
+    uint64_t uncompressed_bytes;
+    uint32_t block_bytes;
+};
+
+/// Read and sanity-check the bitshuffle filter header for a chunk
+auto read_bshuf_chunk_header(std::span<const uint8_t> chunk, size_t elem_size)
+  -> std::optional<BitshuffleChunkHeader>;
+
+/**
+ * @brief Find the length of a compressed bitshuffle block.
+ *
+ * @param chunk  The raw chunk
+ * @param offset Offset of the start of the block's size prefix
+ * @returns The length of the block, including its 4-byte size prefix,
+ *          or nothing if the block would run off the end of the chunk.
+ */
+auto bshuf_block_length(std::span<const uint8_t> chunk, size_t offset)
+  -> std::optional<size_t>;
+
+/**
+ * @brief Decompress a bitshuffle-LZ4 HDF5 chunk, sharing the blocks out over a pool.
+ *
+ * The chunk must include the 12-byte filter header (uncompressed size and
+ * block size). Every bitshuffle block is independently compressed, so
+ * once the block headers have been walked the blocks can be decoded in
+ * any order straight into their final place in the destination.
+ *
+ * @param pool      Helper threads. The calling thread also does work.
+ * @param chunk     The raw chunk, as read from the file
+ * @param dest      Destination for the decompressed data
+ * @param elem_size Size of each element, in bytes
+ * @returns The number of bytes of the chunk consumed, or a negative
+ *          value if the chunk was malformed or does not match dest.
+ */
+auto bshuf_decompress_lz4_parallel(ThreadPool &pool,
+                                   std::span<const uint8_t> chunk,
+                                   std::span<uint8_t> dest,
+                                   size_t elem_size) -> int64_t;
+
+/**
+ * @brief Compress data into a bitshuffle-LZ4 chunk, as the HDF5 filter does.
+ *
+ * The output includes the 12-byte filter header, and uses bitshuffle's
+ * default block size.
+ */
+auto bshuf_compress_lz4_chunk(std::span<const uint8_t> data, size_t elem_size)
+  -> std::vector<uint8_t>;
@@ -0,0 +1,223 @@
+#include "fused_dispersion.hpp"
+
+#include <bitshuffle.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "decompression.hpp"
+
+FusedDispersion::FusedDispersion(size_t width,
+                                 size_t height,
+                                 std::span<const uint8_t> mask,
+                                 pixel_t max_valid_pixel,
+                                 int kernel_radius,
+                                 float nsig_b,
+                                 float nsig_s)
+    : _width(width),
+      _height(height),
+      _mask(mask),
+      _max_valid_pixel(max_valid_pixel),
+      _radius(kernel_radius),
+      _nsig_b(nsig_b),
+      _nsig_s(nsig_s),
+      _col_sum(width + 2 * kernel_radius),
+      _col_sumsq(width + 2 * kernel_radius),
+      _col_count(width + 2 * kernel_radius),
+      _row_sum(width),
+      _row_sumsq(width),
+      _row_count(width) {}
+
+auto FusedDispersion::row(size_t y) const -> const pixel_t * {
+    if (_image) {
+        return _image + y * _width;
+    }
+    return _ring.data() + (y % _ring_rows) * _width;
+}
+
+void FusedDispersion::reset() {
+    std::ranges::fill(_col_sum, 0);
+    std::ranges::fill(_col_sumsq, 0);
+    std::ranges::fill(_col_count, 0);
+}
+
+void FusedDispersion::add_row(size_t y) {
+    const pixel_t *pixels = row(y);
+    const uint8_t *mask = _mask.data() + y * _width;
+    // The column sums are padded with kernel radius zeros on each side
+    int32_t *col_sum = _col_sum.data() + _radius;
+    double *col_sumsq = _col_sumsq.data() + _radius;
+    int32_t *col_count = _col_count.data() + _radius;
+    for (size_t x = 0; x < _width; ++x) {
+        int32_t valid = mask[x] != 0;
+        int32_t value = pixels[x] * valid;
+        col_sum[x] += value;
+        col_sumsq[x] += static_cast<double>(value) * value;
+        col_count[x] += valid;
+    }
+}
+
+void FusedDispersion::remove_row(size_t y) {
+    const pixel_t *pixels = row(y);
+    const uint8_t *mask = _mask.data() + y * _width;
+    int32_t *col_sum = _col_sum.data() + _radius;
+    double *col_sumsq = _col_sumsq.data() + _radius;
+    int32_t *col_count = _col_count.data() + _radius;
+    for (size_t x = 0; x < _width; ++x) {
+        int32_t valid = mask[x] != 0;
+        int32_t value = pixels[x] * valid;
+        col_sum[x] -= value;
+        col_sumsq[x] -= static_cast<double>(value) * value;
+        col_count[x] -= valid;
+    }
+}
+
+void FusedDispersion::threshold_row(size_t y, std::span<uint8_t> strong) {
+    const pixel_t *pixels = row(y);
+    const uint8_t *mask = _mask.data() + y * _width;
+    uint8_t *out = strong.data() + y * _width;
+
+    // Sum the kernel across the row, one offset at a time. Thanks to the
+    // zero padding there are no edge cases, and every pass vectorises.
+    std::copy_n(_col_sum.data(), _width, _row_sum.data());
+    std::copy_n(_col_sumsq.data(), _width, _row_sumsq.data());
+    std::copy_n(_col_count.data(), _width, _row_count.data());
+    for (int k = 1; k <= 2 * _radius; ++k) {
+        for (size_t x = 0; x < _width; ++x) {
+            _row_sum[x] += _col_sum[x + k];
+            _row_sumsq[x] += _col_sumsq[x + k];
+            _row_count[x] += _col_count[x + k];
+        }
+    }
+
+    // Same calculation as calculate_dispersion_flags in thresholding.cu,
+    // but without branches. Masked pixels always have n >= 1, but the
+    // n < 2 results are junk and discarded. Everything is pulled into
+    // locals first, as otherwise the compiler has to assume that writing
+    // the output could change them, and won't vectorise.
+    const int32_t *row_sum = _row_sum.data();
+    const double *row_sumsq = _row_sumsq.data();
+    const int32_t *row_count = _row_count.data();
+    const float nsig_b = _nsig_b;
+    const float nsig_s = _nsig_s;
+    const pixel_t max_valid_pixel = _max_valid_pixel;
+    const size_t width = _width;
+    for (size_t x = 0; x < width; ++x) {
+        pixel_t this_pixel = pixels[x];
+        int n = row_count[x];
+        float sum_f = static_cast<float>(row_sum[x]);
+        float sumsq_f = static_cast<float>(row_sumsq[x]);
+
+        float mean = sum_f / n;
+        float variance = (n * sumsq_f - (sum_f * sum_f)) / (n * (n - 1));
+        float dispersion = variance / mean;
+
+        float background_threshold = 1 + nsig_b * std::sqrt(2.0f / (n - 1));
+        bool not_background = dispersion > background_threshold;
+        float signal_threshold = mean + nsig_s * std::sqrt(mean);
+        bool is_signal = this_pixel > signal_threshold;
+
+        bool px_is_valid = (mask[x] != 0) & (this_pixel <= max_valid_pixel);
+        out[x] = px_is_valid & not_background & is_signal & (n > 1);
+    }
+}
+
+void FusedDispersion::push_row(size_t y, std::span<uint8_t> strong) {
+    const size_t radius = _radius;
+    // Keep the column sums covering rows [y - 2r, y], which is exactly
+    // the kernel for row y - r.
+    if (y >= 2 * radius + 1) {
+        remove_row(y - 2 * radius - 1);
+    }
+    add_row(y);
+    if (y >= radius) {
+        threshold_row(y - radius, strong);
+    }
+}
+
+void FusedDispersion::finish(std::span<uint8_t> strong) {
+    const size_t radius = _radius;
+    // The last rows have no rows below them to wait for
+    for (size_t y = _height > radius ? _height - radius : 0; y < _height; ++y) {
+        if (y >= radius + 1) {
+            remove_row(y - radius - 1);
+        }
+        threshold_row(y, strong);
+    }
+}
+
+bool FusedDispersion::process_bitshuffle_lz4(std::span<const uint8_t> chunk,
+                                             std::span<uint8_t> strong,
+                                             std::span<pixel_t> image_out) {
+    const size_t num_pixels = _width * _height;
+    auto header = read_bshuf_chunk_header(chunk, sizeof(pixel_t));
+    if (!header || header->uncompressed_bytes != num_pixels * sizeof(pixel_t)
+        || strong.size() < num_pixels
+        || (!image_out.empty() && image_out.size() < num_pixels)) {
+        return false;
+    }
+    const size_t block_elems = header->block_bytes / sizeof(pixel_t);
+
+    // The ring needs the rows in the current kernel, the row about to
+    // leave it, and every row that one block can write into.
+    _ring_rows = 2 * _radius + 2 + (block_elems + _width - 1) / _width;
+    _ring.resize(_ring_rows * _width);
+    _block.resize(block_elems);
+    _image = nullptr;
+    reset();
+
+    size_t offset = BitshuffleChunkHeader::size;
+    size_t pixels_done = 0;
+    size_t rows_done = 0;
+    while (pixels_done < num_pixels) {
+        size_t count = std::min(block_elems, num_pixels - pixels_done);
+        // The end of the chunk is an optional partial block, followed by
+        // the leftover elements that bitshuffle stores uncompressed.
+        size_t partial = count - count % BitshuffleChunkHeader::block_multiple;
+        size_t length = 0;
+        if (partial > 0) {
+            auto block_length = bshuf_block_length(chunk, offset);
+            if (!block_length) {
+                return false;
+            }
+            length = *block_length;
+        }
+        length += (count - partial) * sizeof(pixel_t);
+        if (offset + length > chunk.size()) {
+            return false;
+        }
+        auto consumed = bshuf_decompress_lz4(
+          chunk.data() + offset, _block.data(), count, sizeof(pixel_t), block_elems);
+        if (consumed != static_cast<int64_t>(length)) {
+            return false;
+        }
+        offset += length;
+
+        // Copy into the ring, which might wrap around
+        size_t ring_pos = pixels_done % _ring.size();
+        size_t before_wrap = std::min(count, _ring.size() - ring_pos);
+        std::copy_n(_block.data(), before_wrap, _ring.data() + ring_pos);
+        std::copy_n(_block.data() + before_wrap, count - before_wrap, _ring.data());
+        if (!image_out.empty()) {
+            std::copy_n(_block.data(), count, image_out.data() + pixels_done);
+        }
+        pixels_done += count;
+
+        for (; rows_done < pixels_done / _width; ++rows_done) {
+            push_row(rows_done, strong);
+        }
+    }
+    finish(strong);
+    return true;
+}
+
+void FusedDispersion::process_image(std::span<const pixel_t> image,
+                                    std::span<uint8_t> strong) {
+    _image = image.data();
+    reset();
+    for (size_t y = 0; y < _height; ++y) {
+        push_row(y, strong);
+    }
+    finish(strong);
+    _image = nullptr;
+}
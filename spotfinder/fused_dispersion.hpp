@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "h5read.h"
+
+/**
+ * @brief CPU dispersion thresholding, fused with decompression.
+ *
+ * Rather than decompressing a whole image and then walking over it again,
+ * each bitshuffle block is decompressed into a small ring of rows and
+ * any rows whose kernel neighbourhood is now complete are thresholded
+ * straight away, while they are still in cache. The ring only needs to
+ * hold the kernel height plus one block's worth of rows, so the memory
+ * traffic per image is roughly the compressed chunk plus the output.
+ *
+ * The threshold calculation is the same as the GPU "dispersion" kernel.
+ *
+ * An instance holds the working buffers, so use one per thread.
+ */
+class FusedDispersion {
+  public:
+    /**
+     * @param width             Image width, in pixels
+     * @param height            Image height, in pixels
+     * @param mask              Mask, nonzero for valid pixels. Must outlive this.
+     * @param max_valid_pixel   Pixels above this value are never strong
+     * @param kernel_radius     One-direction kernel size. Total span is (K * 2 + 1)
+     * @param nsig_b            Background noise significance level
+     * @param nsig_s            Signal significance level
+     */
+    FusedDispersion(size_t width,
+                    size_t height,
+                    std::span<const uint8_t> mask,
+                    pixel_t max_valid_pixel,
+                    int kernel_radius = 3,
+                    float nsig_b = 6.0f,
+                    float nsig_s = 3.0f);
+
+    /**
+     * @brief Decompress a bitshuffle-LZ4 chunk and threshold it.
+     *
+     * @param chunk     The raw chunk, including the 12-byte filter header
+     * @param strong    Output, set nonzero for each strong pixel
+     * @param image_out If not empty, also receives the decompressed image
+     * @returns false if the chunk was malformed. The outputs are then
+     *          incomplete.
+     */
+    bool process_bitshuffle_lz4(std::span<const uint8_t> chunk,
+                                std::span<uint8_t> strong,
+                                std::span<pixel_t> image_out = {});
+
+    /// Threshold an image that has already been decompressed
+    void process_image(std::span<const pixel_t> image, std::span<uint8_t> strong);
+
+  private:
+    /// Start of an image row, either in the ring or the external image
+    auto row(size_t y) const -> const pixel_t *;
+    void reset();
+    /// A new row is complete: slide the window down and emit what we can
+    void push_row(size_t y, std::span<uint8_t> strong);
+    /// Drain the rows held back waiting for the kernel to fill
+    void finish(std::span<uint8_t> strong);
+    void add_row(size_t y);
+    void remove_row(size_t y);
+    void threshold_row(size_t y, std::span<uint8_t> strong);
+
+    size_t _width, _height;
+    std::span<const uint8_t> _mask;
+    pixel_t _max_valid_pixel;
+    int _radius;
+    float _nsig_b, _nsig_s;
+
+    /// Recently decompressed rows, with row y at slot (y % _ring_rows)
+    std::vector<pixel_t> _ring;
+    size_t _ring_rows = 0;
+    /// Staging area for a single decompressed bitshuffle block
+    std::vector<pixel_t> _block;
+    /// If processing an already decompressed image, the image
+    const pixel_t *_image = nullptr;
+
+    /// Per-column sums over the rows currently inside the kernel, with
+    /// kernel radius zeros of padding on either side. Squares are kept as
+    /// double, which is exact for these and converts faster than integers.
+    std::vector<int32_t> _col_sum;
+    std::vector<double> _col_sumsq;
+    std::vector<int32_t> _col_count;
+    /// Kernel sums for each pixel of the row being thresholded
+    std::vector<int32_t> _row_sum;
+    std::vector<double> _row_sumsq;
+    std::vector<int32_t> _row_count;
+};
@@ -0,0 +1,294 @@
+/**
+ * @file generate_synthetic_data.cc
+ * @brief Write synthetic diffraction images to disk, for benchmarking.
+ *
+ * If OUTPUT ends in .nxs, writes a NeXus master file and data files in the
+ * same layout as the Eiger filewriter, with bitshuffle-LZ4 chunks written
+ * directly. Otherwise, writes a directory in the layout that SHMRead reads.
+ */
+#include <fmt/core.h>
+#include <hdf5.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+#include "shmwrite.hpp"
+#include "synthetic.hpp"
+#include "synthetic_arguments.hpp"
+#include "version.hpp"
+
+using namespace fmt;
+
+namespace {
+/// HDF5 filter ID registered for bitshuffle
+constexpr H5Z_filter_t bitshuffle_filter_id = 32008;
+/// Filter options as the Eiger writes them: element size 2, LZ4 compression
+constexpr std::array<unsigned int, 5> bitshuffle_filter_options = {0, 0, 2, 0, 2};
+
+/// Throw if an HDF5 call failed
+template <typename T>
+auto h5check(T result, const std::string &what) -> T {
+    if (result < 0) {
+        throw std::runtime_error(format("HDF5 error: While {}", what));
+    }
+    return result;
+}
+
+void set_nx_class(hid_t object, const char *nx_class) {
+    hid_t type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(type, std::strlen(nx_class));
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t attr = h5check(
+      H5Acreate2(object, "NX_class", type, space, H5P_DEFAULT, H5P_DEFAULT),
+      "creating NX_class attribute");
+    H5Awrite(attr, type, nx_class);
+    H5Aclose(attr);
+    H5Sclose(space);
+    H5Tclose(type);
+}
+
+auto create_group(hid_t parent, const char *name, const char *nx_class) -> hid_t {
+    hid_t group =
+      h5check(H5Gcreate2(parent, name, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT),
+              format("creating group {}", name));
+    set_nx_class(group, nx_class);
+    return group;
+}
+
+template <typename T>
+void write_scalar(hid_t group, const char *name, hid_t type, T value) {
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t dataset = h5check(
+      H5Dcreate2(group, name, type, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT),
+      format("creating {}", name));
+    h5check(H5Dwrite(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, &value),
+            format("writing {}", name));
+    H5Dclose(dataset);
+    H5Sclose(space);
+}
+
+auto create_file(const std::filesystem::path &path) -> hid_t {
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    // SWMR readers need the latest file format
+    H5Pset_libver_bounds(fapl, H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+    hid_t file = h5check(H5Fcreate(path.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, fapl),
+                         format("creating {}", path.string()));
+    H5Pclose(fapl);
+    return file;
+}
+
+/// Write one data file, holding images [first, first + count)
+void write_nexus_data_file(const std::filesystem::path &path,
+                           Reader &reader,
+                           size_t first,
+                           size_t count) {
+    auto [slow, fast] = reader.image_shape();
+    hid_t file = create_file(path);
+    hid_t entry = create_group(file, "entry", "NXentry");
+    hid_t data = create_group(entry, "data", "NXdata");
+
+    std::array<hsize_t, 3> dims = {count, slow, fast};
+    std::array<hsize_t, 3> chunk_dims = {1, slow, fast};
+    hid_t space = H5Screate_simple(3, dims.data(), nullptr);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 3, chunk_dims.data());
+    // Optional, so that the dataset can be created without the filter
+    // plugin. The chunks are written already compressed.
+    H5Pset_filter(dcpl,
+                  bitshuffle_filter_id,
+                  H5Z_FLAG_OPTIONAL,
+                  bitshuffle_filter_options.size(),
+                  bitshuffle_filter_options.data());
+    hid_t dataset = h5check(
+      H5Dcreate2(
+        data, "data", H5T_STD_U16LE, space, H5P_DEFAULT, dcpl, H5P_DEFAULT),
+      "creating data dataset");
+
+    auto buffer = std::vector<uint8_t>(slow * fast * sizeof(pixel_t) * 2);
+    for (size_t i = 0; i < count; ++i) {
+        auto chunk = reader.get_raw_chunk(first + i, buffer);
+        std::array<hsize_t, 3> offset = {i, 0, 0};
+        h5check(
+          H5Dwrite_chunk(
+            dataset, H5P_DEFAULT, 0, offset.data(), chunk.size(), chunk.data()),
+          format("writing image {}", first + i));
+    }
+
+    H5Dclose(dataset);
+    H5Pclose(dcpl);
+    H5Sclose(space);
+    H5Gclose(data);
+    H5Gclose(entry);
+    H5Fclose(file);
+}
+
+void write_nexus(const std::filesystem::path &master_path,
+                 Reader &reader,
+                 size_t images_per_file) {
+    auto [slow, fast] = reader.image_shape();
+    size_t num_images = reader.get_number_of_images();
+    auto stem = master_path.stem().string();
+    if (stem.ends_with("_master")) {
+        stem = stem.substr(0, stem.size() - 7);
+    }
+
+    // Write the data files, keeping the views for the master file
+    std::array<hsize_t, 3> dims = {num_images, slow, fast};
+    hid_t virtual_space = H5Screate_simple(3, dims.data(), nullptr);
+    hid_t vds_dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    for (size_t first = 0, file_index = 1; first < num_images;
+         first += images_per_file, ++file_index) {
+        size_t count = std::min(images_per_file, num_images - first);
+        auto filename = format("{}_data_{:06d}.h5", stem, file_index);
+        print("Writing {}\n", filename);
+        write_nexus_data_file(
+          master_path.parent_path() / filename, reader, first, count);
+
+        std::array<hsize_t, 3> start = {first, 0, 0};
+        std::array<hsize_t, 3> one = {1, 1, 1};
+        std::array<hsize_t, 3> block = {count, slow, fast};
+        H5Sselect_hyperslab(virtual_space,
+                            H5S_SELECT_SET,
+                            start.data(),
+                            nullptr,
+                            one.data(),
+                            block.data());
+        hid_t source_space = H5Screate_simple(3, block.data(), nullptr);
+        std::array<hsize_t, 3> zero = {0, 0, 0};
+        H5Sselect_hyperslab(source_space,
+                            H5S_SELECT_SET,
+                            zero.data(),
+                            nullptr,
+                            one.data(),
+                            block.data());
+        h5check(H5Pset_virtual(vds_dcpl,
+                               virtual_space,
+                               filename.c_str(),
+                               "/entry/data/data",
+                               source_space),
+                "mapping virtual dataset");
+        H5Sclose(source_space);
+    }
+    H5Sselect_all(virtual_space);
+
+    print("Writing {}\n", master_path.string());
+    hid_t file = create_file(master_path);
+    hid_t entry = create_group(file, "entry", "NXentry");
+    hid_t data = create_group(entry, "data", "NXdata");
+    hid_t dataset = h5check(H5Dcreate2(data,
+                                       "data",
+                                       H5T_STD_U16LE,
+                                       virtual_space,
+                                       H5P_DEFAULT,
+                                       vds_dcpl,
+                                       H5P_DEFAULT),
+                            "creating virtual dataset");
+    H5Dclose(dataset);
+    H5Pclose(vds_dcpl);
+    H5Sclose(virtual_space);
+
+    hid_t instrument = create_group(entry, "instrument", "NXinstrument");
+    hid_t beam = create_group(instrument, "beam", "NXbeam");
+    if (auto wavelength = reader.get_wavelength()) {
+        write_scalar(beam, "incident_wavelength", H5T_NATIVE_FLOAT, *wavelength);
+    }
+    H5Gclose(beam);
+
+    hid_t detector = create_group(instrument, "detector", "NXdetector");
+    auto [underload, saturation] = reader.get_trusted_range();
+    write_scalar(detector, "underload_value", H5T_NATIVE_UINT16, underload);
+    write_scalar(detector, "saturation_value", H5T_NATIVE_UINT16, saturation);
+    if (auto pixel_size = reader.get_pixel_size()) {
+        write_scalar(detector, "y_pixel_size", H5T_NATIVE_FLOAT, (*pixel_size)[0]);
+        write_scalar(detector, "x_pixel_size", H5T_NATIVE_FLOAT, (*pixel_size)[1]);
+    }
+    if (auto beam_center = reader.get_beam_center()) {
+        write_scalar(detector, "beam_center_y", H5T_NATIVE_FLOAT, (*beam_center)[0]);
+        write_scalar(detector, "beam_center_x", H5T_NATIVE_FLOAT, (*beam_center)[1]);
+    }
+    if (auto distance = reader.get_detector_distance()) {
+        write_scalar(detector, "distance", H5T_NATIVE_FLOAT, *distance);
+    }
+    if (auto mask = reader.get_mask()) {
+        // NeXus masks are nonzero for bad pixels, the opposite of ours
+        auto pixel_mask = std::vector<uint32_t>(mask->size());
+        std::transform(mask->begin(), mask->end(), pixel_mask.begin(), [](auto v) {
+            return v ? 0u : 1u;
+        });
+        std::array<hsize_t, 2> mask_dims = {slow, fast};
+        hid_t space = H5Screate_simple(2, mask_dims.data(), nullptr);
+        hid_t mask_dataset = h5check(H5Dcreate2(detector,
+                                                "pixel_mask",
+                                                H5T_STD_U32LE,
+                                                space,
+                                                H5P_DEFAULT,
+                                                H5P_DEFAULT,
+                                                H5P_DEFAULT),
+                                     "creating pixel_mask");
+        h5check(H5Dwrite(mask_dataset,
+                         H5T_NATIVE_UINT32,
+                         H5S_ALL,
+                         H5S_ALL,
+                         H5P_DEFAULT,
+                         pixel_mask.data()),
+                "writing pixel_mask");
+        H5Dclose(mask_dataset);
+        H5Sclose(space);
+    }
+    H5Gclose(detector);
+    H5Gclose(instrument);
+    H5Gclose(data);
+    H5Gclose(entry);
+    H5Fclose(file);
+}
+
+void write_shm(const std::filesystem::path &path, Reader &reader) {
+    std::filesystem::create_directories(path);
+    auto [slow, fast] = reader.image_shape();
+    size_t num_images = reader.get_number_of_images();
+    write_shm_headers(path, reader, num_images);
+    auto buffer = std::vector<uint8_t>(slow * fast * sizeof(pixel_t) * 2);
+    for (size_t i = 0; i < num_images; ++i) {
+        write_shm_image(path, i, reader.get_raw_chunk(i, buffer));
+    }
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    auto parser = argparse::ArgumentParser("generate_synthetic_data", FFS_VERSION);
+    parser.add_argument("output")
+      .help("Output path. NeXus master file if ending .nxs, otherwise a directory")
+      .metavar("OUTPUT");
+    parser.add_argument("--images")
+      .help("Number of images to write")
+      .metavar("NUM")
+      .default_value<size_t>(100)
+      .scan<'u', size_t>();
+    parser.add_argument("--images-per-file")
+      .help("Number of images in each NeXus data file")
+      .metavar("NUM")
+      .default_value<size_t>(1000)
+      .scan<'u', size_t>();
+    add_synthetic_arguments(parser);
+    parser.parse_args(argc, argv);
+
+    try {
+        auto params = get_synthetic_parameters(parser, parser.get<size_t>("images"));
+        print("Generating {} unique images\n", params.unique_images);
+        SyntheticRead reader(params);
+
+        auto output = std::filesystem::path(parser.get<std::string>("output"));
+        if (output.extension() == ".nxs") {
+            write_nexus(output, reader, parser.get<size_t>("images-per-file"));
+        } else {
+            write_shm(output, reader);
+        }
+    } catch (std::exception &e) {
+        print("Error: {}\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <vector>
+
+/**
+ * @brief Decides which images each reader reads next.
+ *
+ * Images are handed out in batches of consecutive images, each image
+ * exactly once.
+ *
+ * In order, every batch starts at the lowest image not yet handed out.
+ *
+ * Latest first, a reader is handed the newest images that have arrived,
+ * so that when the spotfinder falls behind, feedback on the newest image
+ * stays current instead of lagging further and further. The images skipped
+ * over are filled in oldest first: by background lanes, which only ever
+ * do that, and by any other reader when nothing newer has arrived. Once
+ * the spotfinder keeps up, both policies hand out the same batches.
+ *
+ * With a latency target, when the images waiting to be read would take
+ * longer than the target to get through, only a sample of them is handed
+ * out and the rest are skipped. Skipped images are handed out later, as
+ * backfill, once there is nothing newer waiting, unless that's turned off.
+ *
+ * Thread-safe.
+ */
+class ImageScheduler {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    enum class Policy { in_order, latest_first };
+
+    /// Which image to keep out of each run skipped for the latency target
+    enum class Sampling {
+        /// The newest of each run, i.e. every k-th image
+        stride,
+        /// One picked at random from each run, so that a regular pattern in
+        /// the images, such as the rows of a grid scan, isn't aliased
+        stratified,
+    };
+
+    struct LatencyTarget {
+        /// From an image arriving to its result
+        std::chrono::duration<double> latency;
+        Sampling sampling = Sampling::stride;
+        /// Whether to go back for skipped images, for sources that keep them
+        bool backfill = true;
+    };
+
+    struct Claim {
+        size_t first;
+        size_t count;
+        /// Skipped ahead of images that haven't been handed out yet
+        bool newest = false;
+        /// Skipped earlier to meet the latency target
+        bool backfill = false;
+        /// Images newly skipped to meet the latency target
+        std::vector<size_t> skipped;
+    };
+
+    struct Stats {
+        /// Images handed out by skipping ahead
+        size_t newest = 0;
+        /// Images handed out after a later image, to fill in what was skipped
+        size_t filled_in = 0;
+        /// Images skipped to meet the latency target
+        size_t skipped = 0;
+        /// Skipped images handed out afterwards
+        size_t backfilled = 0;
+    };
+
+    ImageScheduler(Policy policy,
+                   size_t num_images,
+                   size_t batch_size,
+                   std::optional<LatencyTarget> latency_target = std::nullopt)
+        : _policy(policy),
+          _num_images(num_images),
+          _batch_size(batch_size),
+          _latency_target(latency_target),
+          _state(num_images, State::unclaimed) {}
+
+    /**
+     * @brief Claim the next batch of images to read.
+     *
+     * @param background   Whether the caller only fills in skipped images
+     * @param is_available Whether an image has arrived. Only called latest
+     *                     first or with a latency target, from one thread
+     *                     at a time, and never with the scheduler locked, so
+     *                     it can take locks of its own. Images are assumed
+     *                     to arrive in order.
+     * @returns The batch, or nothing once every image has been handed out
+     */
+    template <typename F>
+    auto claim(bool background, F &&is_available) -> std::optional<Claim> {
+        size_t arrived = 0;
+        if (!background
+            && (_policy == Policy::latest_first || _latency_target.has_value())) {
+            arrived = find_arrived(is_available);
+        }
+        std::scoped_lock lock(_mutex);
+        if (_next >= _num_images && _skipped.empty()) {
+            return std::nullopt;
+        }
+        _arrived = std::max(_arrived, arrived);
+        bool overloaded =
+          _latency_target && predicted_latency() > _latency_target->latency;
+        // Skipped images wait until nothing newer is waiting to be read, or
+        // there is nothing newer left to come
+        if (!_skipped.empty()
+            && (_next >= _num_images
+                || (!overloaded && (_arrived <= _next || background)))) {
+            return claim_backfill();
+        }
+        if (_policy == Policy::latest_first && !background) {
+            if (_arrived > _next && _state[_arrived - 1] == State::unclaimed) {
+                // The newest run of unclaimed images, ending at the newest
+                size_t first = _arrived - 1;
+                while (first > _next && _arrived - first < _batch_size
+                       && _state[first - 1] == State::unclaimed) {
+                    --first;
+                }
+                bool newest = first > _next;
+                if (newest) {
+                    _stats.newest += _arrived - first;
+                }
+                return mark_claimed(first, _arrived - first, newest);
+            }
+        }
+        if (overloaded && !background) {
+            return claim_sample();
+        }
+        // Otherwise, the oldest images not handed out yet
+        return mark_claimed(_next, unclaimed_run(_next), false);
+    }
+
+    /// Note that an image's results have been sent, to measure throughput
+    void finished() {
+        std::scoped_lock lock(_mutex);
+        _finished += 1;
+        auto now = clock::now();
+        if (_finished == 1) {
+            _window_start = now;
+            _window_finished = _finished;
+            return;
+        }
+        // Smooth the rate over windows long enough not to be all noise
+        auto window = std::chrono::duration<double>(now - _window_start).count();
+        if (window >= 0.1) {
+            double rate = (_finished - _window_finished) / window;
+            _images_per_second =
+              _images_per_second > 0 ? 0.7 * _images_per_second + 0.3 * rate : rate;
+            _window_start = now;
+            _window_finished = _finished;
+        }
+    }
+
+    /// The lowest image not handed out yet
+    auto next_in_order() const -> size_t {
+        std::scoped_lock lock(_mutex);
+        return _next;
+    }
+
+    auto stats() const -> Stats {
+        std::scoped_lock lock(_mutex);
+        return _stats;
+    }
+
+  private:
+    enum class State : uint8_t { unclaimed, claimed, skipped };
+
+    /// Count the images that have arrived, checking further ahead each
+    /// time, so that being far behind costs only a few checks
+    template <typename F>
+    auto find_arrived(F &is_available) -> size_t {
+        std::scoped_lock lock(_probe_mutex);
+        size_t step = 1;
+        size_t not_arrived = _num_images;
+        while (_probed < _num_images) {
+            size_t probe = std::min(_probed + step - 1, _num_images - 1);
+            if (!is_available(probe)) {
+                not_arrived = probe;
+                break;
+            }
+            _probed = probe + 1;
+            step *= 2;
+        }
+        while (_probed < not_arrived) {
+            size_t middle = _probed + (not_arrived - _probed) / 2;
+            if (is_available(middle)) {
+                _probed = middle + 1;
+            } else {
+                not_arrived = middle;
+            }
+        }
+        return _probed;
+    }
+
+    /// How many images waiting to be read there are
+    auto backlog() const -> size_t {
+        return _arrived > _next ? _arrived - _next : 0;
+    }
+
+    /// How long an image arriving now would take to get a result, if
+    /// everything ahead of it is handled at the recent rate
+    auto predicted_latency() const -> std::chrono::duration<double> {
+        if (_images_per_second <= 0) {
+            return {};
+        }
+        size_t in_flight = _claimed_count - _finished;
+        return std::chrono::duration<double>((backlog() + in_flight)
+                                             / _images_per_second);
+    }
+
+    /// Keep one image of the next run of waiting images, skipping the rest,
+    /// with the run as long as it takes to get back within the target
+    auto claim_sample() -> Claim {
+        double ratio = predicted_latency() / _latency_target->latency;
+        size_t stride = std::clamp<size_t>(
+          static_cast<size_t>(std::ceil(ratio)), 1, std::max<size_t>(backlog(), 1));
+        stride = std::min(stride, unclaimed_run(_next, stride));
+        size_t first = _next;
+        size_t keep = first + stride - 1;
+        if (_latency_target->sampling == Sampling::stratified) {
+            keep = first + mix(first) % stride;
+        }
+        auto skipped = std::vector<size_t>{};
+        for (size_t image = first; image < first + stride; ++image) {
+            if (image != keep) {
+                _state[image] = State::skipped;
+                if (_latency_target->backfill) {
+                    _skipped.insert(image);
+                }
+                skipped.push_back(image);
+            }
+        }
+        _stats.skipped += skipped.size();
+        auto claim = mark_claimed(keep, 1, false);
+        claim.skipped = std::move(skipped);
+        return claim;
+    }
+
+    /// The oldest run of skipped images
+    auto claim_backfill() -> Claim {
+        size_t first = *_skipped.begin();
+        size_t count = 0;
+        while (count < _batch_size && !_skipped.empty()
+               && *_skipped.begin() == first + count) {
+            _skipped.erase(_skipped.begin());
+            ++count;
+        }
+        _stats.backfilled += count;
+        return mark_claimed(first, count, false, true);
+    }
+
+    /// How many unclaimed images there are from first, up to limit
+    auto unclaimed_run(size_t first, size_t limit = 0) const -> size_t {
+        limit = limit ? limit : _batch_size;
+        size_t count = 1;
+        while (count < limit && first + count < _num_images
+               && _state[first + count] == State::unclaimed) {
+            ++count;
+        }
+        return count;
+    }
+
+    auto mark_claimed(size_t first, size_t count, bool newest, bool backfill = false)
+      -> Claim {
+        if (first < _claimed_until && !newest && !backfill) {
+            _stats.filled_in += count;
+        }
+        std::fill_n(_state.begin() + first, count, State::claimed);
+        _claimed_count += count;
+        _claimed_until = std::max(_claimed_until, first + count);
+        while (_next < _num_images && _state[_next] != State::unclaimed) {
+            ++_next;
+        }
+        return {first, count, newest, backfill};
+    }
+
+    /// Scramble an index, to pick a pseudo-random image from a run
+    static auto mix(size_t value) -> size_t {
+        uint64_t x = value + 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    const Policy _policy;
+    const size_t _num_images;
+    const size_t _batch_size;
+    const std::optional<LatencyTarget> _latency_target;
+    mutable std::mutex _mutex;
+    std::vector<State> _state;
+    /// Skipped for the latency target, and still to be backfilled
+    std::set<size_t> _skipped;
+    /// Every image before this has been handed out, or skipped
+    size_t _next = 0;
+    /// Every image before this has arrived
+    size_t _arrived = 0;
+    /// Held while checking for arrivals, which is done without _mutex
+    std::mutex _probe_mutex;
+    /// Every image before this was seen to have arrived. Guarded by
+    /// _probe_mutex.
+    size_t _probed = 0;
+    /// One past the latest image handed out
+    size_t _claimed_until = 0;
+    size_t _claimed_count = 0;
+    size_t _finished = 0;
+    /// Recent throughput, or zero until known
+    double _images_per_second = 0;
+    clock::time_point _window_start;
+    size_t _window_finished = 0;
+    Stats _stats;
+};
@@ -0,0 +1,127 @@
+#include "job_server.hpp"
+
+#include <fmt/core.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+using namespace fmt;
+
+JobServer::JobServer(const std::string &socket_path) : _socket_path(socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error(format("Socket path too long: {}", socket_path));
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+    // A socket left behind by an earlier daemon would stop us binding
+    unlink(socket_path.c_str());
+    _listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_listen_socket < 0
+        || bind(_listen_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address))
+             < 0
+        || listen(_listen_socket, 4) < 0) {
+        throw std::runtime_error(
+          format("Could not listen on {}: {}", socket_path, std::strerror(errno)));
+    }
+}
+
+JobServer::~JobServer() {
+    drop_client();
+    if (_listen_socket >= 0) {
+        close(_listen_socket);
+        unlink(_socket_path.c_str());
+    }
+}
+
+bool JobServer::wait_readable(int socket, std::stop_token stop) {
+    // Wake up now and then to check for being stopped
+    pollfd poll_socket{socket, POLLIN, 0};
+    while (!stop.stop_requested()) {
+        int ready = poll(&poll_socket, 1, 100);
+        if (ready > 0) {
+            return true;
+        }
+        if (ready < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return false;
+}
+
+void JobServer::drop_client() {
+    if (_client >= 0) {
+        close(_client);
+        _client = -1;
+    }
+    _received.clear();
+}
+
+auto JobServer::next_job(std::stop_token stop) -> std::optional<Job> {
+    while (!stop.stop_requested()) {
+        if (_client < 0) {
+            if (!wait_readable(_listen_socket, stop)) {
+                continue;
+            }
+            _client = accept(_listen_socket, nullptr, nullptr);
+            if (_client < 0) {
+                continue;
+            }
+            print("Job client connected\n");
+        }
+        // Take the next whole line we have, if any
+        if (auto end = _received.find('\n'); end != std::string::npos) {
+            auto line = _received.substr(0, end);
+            _received.erase(0, end + 1);
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            auto description = nlohmann::json::parse(line, nullptr, false);
+            if (description.is_discarded() || !description.is_object()) {
+                send(
+                  {{}, _client},
+                  {{"job_done", true}, {"status", 1}, {"error", "Invalid job JSON"}});
+                continue;
+            }
+            return Job{std::move(description), _client};
+        }
+        if (!wait_readable(_client, stop)) {
+            continue;
+        }
+        auto buffer = std::array<char, 4096>{};
+        ssize_t count = recv(_client, buffer.data(), buffer.size(), 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            print("Job client disconnected\n");
+            drop_client();
+            continue;
+        }
+        _received.append(buffer.data(), count);
+    }
+    return std::nullopt;
+}
+
+void JobServer::send(const Job &job, const nlohmann::json &message) {
+    auto line = message.dump() + "\n";
+    size_t sent = 0;
+    while (sent < line.size()) {
+        // A client that has gone away shouldn't take the daemon with it
+        ssize_t count =
+          ::send(job.socket, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            return;
+        }
+        sent += count;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+#include <optional>
+#include <stop_token>
+#include <string>
+
+/**
+ * @brief Takes spotfinding jobs from clients of a local Unix socket.
+ *
+ * A client sends one job per line, as a JSON object, and gets each job's
+ * results back on the same connection, one JSON line per image, ending
+ * with a line containing "job_done". Jobs run one at a time, in the
+ * order they arrive. Clients are served one after another.
+ */
+class JobServer {
+  public:
+    struct Job {
+        nlohmann::json description;
+        /// The client's connection, to send results back on
+        int socket;
+    };
+
+    /// Listen on socket_path, replacing anything already there
+    explicit JobServer(const std::string &socket_path);
+    ~JobServer();
+    JobServer(const JobServer &) = delete;
+    JobServer &operator=(const JobServer &) = delete;
+
+    /// Wait for the next job. Nothing once stop is requested.
+    auto next_job(std::stop_token stop) -> std::optional<Job>;
+
+    /// Send a line to the client that sent job, e.g. its summary
+    void send(const Job &job, const nlohmann::json &message);
+
+  private:
+    /// Wait for the socket to be readable, giving up if stop is requested
+    bool wait_readable(int socket, std::stop_token stop);
+    void drop_client();
+
+    std::string _socket_path;
+    int _listen_socket = -1;
+    int _client = -1;
+    /// Bytes received from the client that aren't yet a whole line
+    std::string _received;
+};
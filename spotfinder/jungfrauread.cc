@@ -0,0 +1,311 @@
+#include "jungfrauread.hpp"
+
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+using json = nlohmann::json;
+using namespace fmt;
+
+#pragma region Pedestal and Gain Conversion
+namespace {
+/// Calibration planes to use for each value of the two gain bits. The
+/// encoding 10 is invalid; it uses G2 and is overwritten afterwards.
+constexpr std::array<size_t, 4> gain_plane = {0, 1, 2, 2};
+
+/// Raw gain bits for an invalid gain encoding
+constexpr uint16_t invalid_gain_bits = 2;
+
+void convert_scalar_range(const uint16_t *raw,
+                          pixel_t *out,
+                          size_t begin,
+                          size_t end,
+                          const float *pedestal,
+                          const float *inverse_gain,
+                          size_t num_pixels,
+                          float max_value) {
+    for (size_t i = begin; i < end; ++i) {
+        uint16_t gain_bits = raw[i] >> 14;
+        size_t plane = gain_plane[gain_bits] * num_pixels + i;
+        float adc = raw[i] & 0x3FFF;
+        float photons = std::nearbyint((adc - pedestal[plane]) * inverse_gain[plane]);
+        photons = std::min(std::max(photons, 0.0f), max_value);
+        out[i] = gain_bits == invalid_gain_bits ? JungfrauCalibration::invalid_value
+                                                : static_cast<pixel_t>(photons);
+    }
+}
+
+#if defined(__x86_64__)
+/**
+ * @brief Convert eight pixels at a time.
+ *
+ * Built for AVX2 regardless of the compiler flags, and only called once
+ * the CPU is known to support it. Nearly all pixels in a frame stay in G0,
+ * so blocks that don't switch gain only load the G0 calibration.
+ */
+__attribute__((target("avx2"))) void convert_avx2(const uint16_t *raw,
+                                                  pixel_t *out,
+                                                  size_t num_pixels,
+                                                  const float *pedestal,
+                                                  const float *inverse_gain,
+                                                  float max_value) {
+    const float *pedestal_g1 = pedestal + num_pixels;
+    const float *pedestal_g2 = pedestal + 2 * num_pixels;
+    const float *inverse_gain_g1 = inverse_gain + num_pixels;
+    const float *inverse_gain_g2 = inverse_gain + 2 * num_pixels;
+    const __m256i adc_bits = _mm256_set1_epi32(0x3FFF);
+    const __m256i g1_bits = _mm256_set1_epi32(1);
+    const __m256i g2_bits = _mm256_set1_epi32(3);
+    const __m256i invalid_bits = _mm256_set1_epi32(invalid_gain_bits);
+    const __m256i invalid = _mm256_set1_epi32(JungfrauCalibration::invalid_value);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 max = _mm256_set1_ps(max_value);
+
+    size_t i = 0;
+    for (; i + 8 <= num_pixels; i += 8) {
+        __m256i values = _mm256_cvtepu16_epi32(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(raw + i)));
+        __m256i gain_bits = _mm256_srli_epi32(values, 14);
+        __m256 adc = _mm256_cvtepi32_ps(_mm256_and_si256(values, adc_bits));
+        __m256 ped = _mm256_loadu_ps(pedestal + i);
+        __m256 inv = _mm256_loadu_ps(inverse_gain + i);
+        bool switched = !_mm256_testz_si256(gain_bits, gain_bits);
+        if (switched) {
+            __m256 is_g1 = _mm256_castsi256_ps(_mm256_cmpeq_epi32(gain_bits, g1_bits));
+            // Invalid pixels use G2, as in the scalar version
+            __m256 is_g2 = _mm256_castsi256_ps(
+              _mm256_cmpeq_epi32(_mm256_or_si256(gain_bits, g1_bits), g2_bits));
+            ped = _mm256_blendv_ps(ped, _mm256_loadu_ps(pedestal_g1 + i), is_g1);
+            ped = _mm256_blendv_ps(ped, _mm256_loadu_ps(pedestal_g2 + i), is_g2);
+            inv = _mm256_blendv_ps(inv, _mm256_loadu_ps(inverse_gain_g1 + i), is_g1);
+            inv = _mm256_blendv_ps(inv, _mm256_loadu_ps(inverse_gain_g2 + i), is_g2);
+        }
+        __m256 photons = _mm256_round_ps(_mm256_mul_ps(_mm256_sub_ps(adc, ped), inv),
+                                         _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        photons = _mm256_min_ps(_mm256_max_ps(photons, zero), max);
+        __m256i counts = _mm256_cvtps_epi32(photons);
+        if (switched) {
+            counts = _mm256_blendv_epi8(
+              counts, invalid, _mm256_cmpeq_epi32(gain_bits, invalid_bits));
+        }
+        // Everything is in [0, 0xFFFF], so unsigned saturation is exact
+        __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(counts),
+                                          _mm256_extracti128_si256(counts, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), packed);
+    }
+    convert_scalar_range(
+      raw, out, i, num_pixels, pedestal, inverse_gain, num_pixels, max_value);
+}
+#endif
+}  // namespace
+
+JungfrauCalibration::JungfrauCalibration(size_t num_pixels,
+                                         std::span<const float> pedestal,
+                                         std::span<const float> gain,
+                                         pixel_t max_value)
+    : _num_pixels(num_pixels),
+      _max_value(max_value),
+      _pedestal(pedestal.begin(), pedestal.end()),
+      _inverse_gain(gain.size()) {
+    if (pedestal.size() != num_gains * num_pixels
+        || gain.size() != num_gains * num_pixels) {
+        throw std::invalid_argument(
+          format("Jungfrau calibration must have {} planes of {} pixels",
+                 num_gains,
+                 num_pixels));
+    }
+    for (size_t i = 0; i < gain.size(); ++i) {
+        // Zero out anything that would otherwise make NaNs, since NaN
+        // comparisons don't agree between the scalar and SIMD paths
+        if (gain[i] == 0 || !std::isfinite(gain[i]) || !std::isfinite(pedestal[i])) {
+            _pedestal[i] = 0;
+            _inverse_gain[i] = 0;
+        } else {
+            _inverse_gain[i] = 1.0f / gain[i];
+        }
+    }
+}
+
+bool JungfrauCalibration::has_avx2() {
+#if defined(__x86_64__)
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+void JungfrauCalibration::convert(std::span<const uint16_t> raw,
+                                  std::span<pixel_t> out) const {
+    if (raw.size() < _num_pixels || out.size() < _num_pixels) {
+        throw std::invalid_argument("Jungfrau frame smaller than calibration");
+    }
+#if defined(__x86_64__)
+    if (has_avx2()) {
+        convert_avx2(raw.data(),
+                     out.data(),
+                     _num_pixels,
+                     _pedestal.data(),
+                     _inverse_gain.data(),
+                     _max_value);
+        return;
+    }
+#endif
+    convert_scalar(raw, out);
+}
+
+void JungfrauCalibration::convert_scalar(std::span<const uint16_t> raw,
+                                         std::span<pixel_t> out) const {
+    if (raw.size() < _num_pixels || out.size() < _num_pixels) {
+        throw std::invalid_argument("Jungfrau frame smaller than calibration");
+    }
+    convert_scalar_range(raw.data(),
+                         out.data(),
+                         0,
+                         _num_pixels,
+                         _pedestal.data(),
+                         _inverse_gain.data(),
+                         _num_pixels,
+                         _max_value);
+}
+#pragma endregion Pedestal and Gain Conversion
+
+namespace {
+/// Read a whole binary file of T, checking that it has exactly count values
+template <typename T>
+auto read_binary_file(const std::filesystem::path &path, size_t count)
+  -> std::vector<T> {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error(format("Could not open {}", path.string()));
+    }
+    auto data = std::vector<T>(count);
+    file.read(reinterpret_cast<char *>(data.data()), count * sizeof(T));
+    if (file.gcount() != static_cast<std::streamsize>(count * sizeof(T))
+        || file.peek() != std::ifstream::traits_type::eof()) {
+        throw std::runtime_error(format(
+          "{} does not hold {} values of {} bytes", path.string(), count, sizeof(T)));
+    }
+    return data;
+}
+}  // namespace
+
+JungfrauRead::JungfrauRead(const std::string &descriptor_path) {
+    std::ifstream descriptor_file(descriptor_path);
+    if (!descriptor_file) {
+        throw std::runtime_error(format("Could not open {}", descriptor_path));
+    }
+    json data = json::parse(descriptor_file);
+    auto base = std::filesystem::path(descriptor_path).parent_path();
+
+    _image_shape = data["image_size"].template get<std::array<size_t, 2>>();
+    size_t num_pixels = _image_shape[0] * _image_shape[1];
+    _frame_bytes = num_pixels * sizeof(uint16_t);
+    _frame_header_bytes = data.value("frame_header_bytes", size_t{0});
+    pixel_t saturation = data.value("saturation_value", pixel_t{0xFFFE});
+    _trusted_range = {0, saturation};
+
+    auto pedestal = read_binary_file<float>(
+      base / data["pedestal"].template get<std::string>(),
+      JungfrauCalibration::num_gains * num_pixels);
+    auto gain =
+      read_binary_file<float>(base / data["gain"].template get<std::string>(),
+                              JungfrauCalibration::num_gains * num_pixels);
+    _calibration.emplace(num_pixels, pedestal, gain, saturation);
+
+    // Our mask is nonzero for good pixels. Pixels that can't be calibrated
+    // in every gain stage aren't good.
+    _mask.assign(num_pixels, 1);
+    if (data.contains("mask")) {
+        auto bad = read_binary_file<uint8_t>(
+          base / data["mask"].template get<std::string>(), num_pixels);
+        std::transform(bad.begin(), bad.end(), _mask.begin(), [](auto v) {
+            return !v;
+        });
+    }
+    for (size_t i = 0; i < gain.size(); ++i) {
+        if (gain[i] == 0 || !std::isfinite(gain[i]) || !std::isfinite(pedestal[i])) {
+            _mask[i % num_pixels] = 0;
+        }
+    }
+
+    if (data.contains("wavelength")) {
+        _wavelength = data["wavelength"].template get<float>();
+    }
+    if (data.contains("detector_distance")) {
+        _detector_distance = data["detector_distance"].template get<float>();
+    }
+    if (data.contains("pixel_size")) {
+        _pixel_size = data["pixel_size"].template get<std::array<float, 2>>();
+    }
+    if (data.contains("beam_center")) {
+        _beam_center = data["beam_center"].template get<std::array<float, 2>>();
+    }
+
+    auto frames_path = base / data["frames"].template get<std::string>();
+    _frames_fd = open(frames_path.c_str(), O_RDONLY);
+    if (_frames_fd < 0) {
+        throw std::runtime_error(
+          format("Could not open {}: {}", frames_path.string(), std::strerror(errno)));
+    }
+    if (data.contains("nimages")) {
+        _num_images = data["nimages"].template get<size_t>();
+    } else {
+        struct stat info;
+        fstat(_frames_fd, &info);
+        _num_images = info.st_size / (_frame_header_bytes + _frame_bytes);
+    }
+}
+
+JungfrauRead::~JungfrauRead() {
+    if (_frames_fd >= 0) {
+        close(_frames_fd);
+    }
+}
+
+bool JungfrauRead::is_image_available(size_t index) {
+    // The receiver may still be writing later frames, so check each time
+    struct stat info;
+    return index < _num_images && fstat(_frames_fd, &info) == 0
+           && static_cast<size_t>(info.st_size) >= frame_offset(index) + _frame_bytes;
+}
+
+std::span<uint8_t> JungfrauRead::get_raw_chunk(size_t index,
+                                               std::span<uint8_t> destination) {
+    if (destination.size() < _frame_bytes) {
+        throw std::runtime_error("Not enough room to store raw Jungfrau frame");
+    }
+    size_t offset = frame_offset(index);
+    size_t done = 0;
+    while (done < _frame_bytes) {
+        ssize_t count = pread(
+          _frames_fd, destination.data() + done, _frame_bytes - done, offset + done);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            throw std::runtime_error(format("Could not read Jungfrau frame {}", index));
+        }
+        done += count;
+    }
+    return {destination.data(), _frame_bytes};
+}
+
+template <>
+bool is_ready_for_read<JungfrauRead>(const std::string &path) {
+    return std::filesystem::exists(path);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "h5read.h"
+
+/**
+ * @brief Per-pixel calibration for converting raw Jungfrau frames.
+ *
+ * Each raw Jungfrau pixel is 16 bits: the top two bits give the gain stage
+ * the pixel switched to (00 for G0, 01 for G1, 11 for G2) and the low 14
+ * bits are the ADC value. Converting to photons subtracts the pedestal for
+ * that gain stage and divides by its gain.
+ */
+class JungfrauCalibration {
+  public:
+    static constexpr size_t num_gains = 3;
+    /// What pixels with an invalid gain encoding convert to
+    static constexpr pixel_t invalid_value = 0xFFFF;
+
+    /**
+     * @param num_pixels    Number of pixels in a frame
+     * @param pedestal      Pedestal for each gain stage, in ADU, as
+     *                      num_gains planes of num_pixels
+     * @param gain          Gain for each gain stage, in ADU per photon, in
+     *                      the same layout. Pixels with a gain of zero, or
+     *                      with non-finite calibration, convert to zero.
+     * @param max_value     Highest photon count to convert to. Anything
+     *                      above is clamped.
+     */
+    JungfrauCalibration(size_t num_pixels,
+                        std::span<const float> pedestal,
+                        std::span<const float> gain,
+                        pixel_t max_value = 0xFFFE);
+
+    /// Convert a raw frame to photon counts, using AVX2 if the CPU has it
+    void convert(std::span<const uint16_t> raw, std::span<pixel_t> out) const;
+    /// Convert a raw frame without vectorisation. Gives identical results.
+    void convert_scalar(std::span<const uint16_t> raw, std::span<pixel_t> out) const;
+
+    /// Whether convert will use the AVX2 kernel on this machine
+    static bool has_avx2();
+
+    size_t num_pixels() const {
+        return _num_pixels;
+    }
+
+  private:
+    size_t _num_pixels;
+    float _max_value;
+    /// Pedestal planes, one for each gain stage
+    std::vector<float> _pedestal;
+    /// Reciprocal gain planes, so that conversion is a multiply
+    std::vector<float> _inverse_gain;
+};
+
+/**
+ * @brief Reads raw Jungfrau frames from a file, with their calibration.
+ *
+ * The dataset is described by a JSON file:
+ *
+ *     {
+ *       "frames": "run_000.raw",       // Raw uint16 frames, back to back
+ *       "frame_header_bytes": 0,       // Bytes before each frame's pixels
+ *       "image_size": [slow, fast],
+ *       "pedestal": "pedestal.raw",    // float32 [3][slow][fast], ADU
+ *       "gain": "gain.raw",            // float32 [3][slow][fast], ADU/photon
+ *       "mask": "mask.raw",            // Optional uint8, nonzero for bad pixels
+ *       "nimages": 1000,               // Optional, else taken from file size
+ *       "wavelength": 1.0,             // Optional, Å
+ *       "detector_distance": 0.1,      // Optional, m
+ *       "pixel_size": [7.5e-5, 7.5e-5],// Optional, (y, x) m
+ *       "beam_center": [y, x],         // Optional, px
+ *       "saturation_value": 65534      // Optional, photons
+ *     }
+ *
+ * Paths are relative to the JSON file. Raw chunks are the frames' pixels
+ * as written; they are converted with calibration().
+ */
+class JungfrauRead : public Reader {
+  public:
+    JungfrauRead(const std::string &descriptor_path);
+    ~JungfrauRead();
+
+    bool is_image_available(size_t index);
+
+    std::span<uint8_t> get_raw_chunk(size_t index, std::span<uint8_t> destination);
+
+    virtual auto get_raw_chunk_compression() -> ChunkCompression {
+        return Reader::ChunkCompression::JUNGFRAU_RAW;
+    }
+
+    const JungfrauCalibration &calibration() const {
+        return *_calibration;
+    }
+
+    size_t get_number_of_images() const {
+        return _num_images;
+    }
+    std::array<size_t, 2> image_shape() const {
+        return _image_shape;
+    };
+    std::optional<std::span<const uint8_t>> get_mask() const {
+        return {{_mask.data(), _mask.size()}};
+    }
+    virtual std::array<image_t_type, 2> get_trusted_range() const {
+        return _trusted_range;
+    }
+    std::optional<float> get_wavelength() const {
+        return _wavelength;
+    }
+    virtual std::optional<std::array<float, 2>> get_pixel_size() const {
+        return _pixel_size;
+    }
+    virtual std::optional<std::array<float, 2>> get_beam_center() const {
+        return _beam_center;
+    }
+    virtual std::optional<float> get_detector_distance() const {
+        return _detector_distance;
+    }
+
+  private:
+    /// Offset of an image's pixels in the frame file
+    size_t frame_offset(size_t index) const {
+        return index * (_frame_header_bytes + _frame_bytes) + _frame_header_bytes;
+    }
+
+    int _frames_fd = -1;
+    size_t _frame_header_bytes = 0;
+    size_t _frame_bytes;
+    size_t _num_images;
+    std::array<size_t, 2> _image_shape;
+    std::vector<uint8_t> _mask;
+    std::optional<JungfrauCalibration> _calibration;
+    std::array<image_t_type, 2> _trusted_range;
+    std::optional<float> _wavelength;
+    std::optional<std::array<float, 2>> _beam_center;
+    std::optional<std::array<float, 2>> _pixel_size;
+    std::optional<float> _detector_distance;
+};
+
+template <>
+bool is_ready_for_read<JungfrauRead>(const std::string &path);
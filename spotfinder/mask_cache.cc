@@ -0,0 +1,230 @@
+#include "mask_cache.hpp"
+
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+using namespace fmt;
+
+namespace {
+constexpr std::array<char, 8> cache_magic = {'F', 'F', 'S', 'M', 'A', 'S', 'K', '\0'};
+constexpr uint32_t cache_version = 1;
+/// Masks start on a cache line, after the header and key
+constexpr size_t mask_alignment = 64;
+
+/// Start of every cache file
+struct CacheHeader {
+    std::array<char, 8> magic;
+    uint32_t version;
+    uint32_t key_size;
+    uint64_t width;
+    uint64_t height;
+    uint64_t mask_offset;
+};
+
+/// 64-bit FNV-1a. Stable between builds, unlike std::hash.
+uint64_t fnv1a(const std::string &data) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 0x100000001b3;
+    }
+    return hash;
+}
+}  // namespace
+
+MaskCache::Entry::Entry(Entry &&other)
+    : _mapping(other._mapping),
+      _mapping_size(other._mapping_size),
+      _mask(other._mask) {
+    other._mapping = nullptr;
+}
+
+auto MaskCache::Entry::operator=(Entry &&other) -> Entry & {
+    std::swap(_mapping, other._mapping);
+    std::swap(_mapping_size, other._mapping_size);
+    std::swap(_mask, other._mask);
+    return *this;
+}
+
+MaskCache::Entry::~Entry() {
+    if (_mapping) {
+        munmap(_mapping, _mapping_size);
+    }
+}
+
+auto MaskCache::default_directory() -> std::optional<std::filesystem::path> {
+    if (const char *directory = std::getenv("FFS_MASK_CACHE")) {
+        if (std::strlen(directory) == 0) {
+            return std::nullopt;
+        }
+        return directory;
+    }
+    std::filesystem::path base;
+    if (const char *xdg_cache = std::getenv("XDG_CACHE_HOME");
+        xdg_cache && *xdg_cache) {
+        base = xdg_cache;
+    } else if (const char *home = std::getenv("HOME"); home && *home) {
+        base = std::filesystem::path(home) / ".cache";
+    } else {
+        return std::nullopt;
+    }
+    return base / "fast-feedback-spotfinder" / "masks";
+}
+
+auto MaskCache::content_hash(std::span<const uint8_t> data) -> uint64_t {
+    // MurmurHash3-style mixing of a word at a time, so that hashing a full
+    // detector's mask takes a few milliseconds
+    auto mix = [](uint64_t value) {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccd;
+        value ^= value >> 33;
+        value *= 0xc4ceb9fe1a85ec53;
+        return value ^ (value >> 33);
+    };
+    uint64_t hash = data.size();
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + i, sizeof(word));
+        word = std::rotl(word * 0x87c37b91114253d5, 31) * 0x4cf5ad432745937f;
+        hash = std::rotl(hash ^ word, 27) * 5 + 0x52dce729;
+    }
+    uint64_t tail = 0;
+    if (i < data.size()) {
+        std::memcpy(&tail, data.data() + i, data.size() - i);
+    }
+    return mix(hash ^ mix(tail));
+}
+
+auto MaskCache::path_for(const std::string &key) const -> std::filesystem::path {
+    return _directory / format("{:016x}.mask", fnv1a(key));
+}
+
+auto MaskCache::load(const std::string &key, size_t width, size_t height) const
+  -> std::optional<Entry> {
+    int fd = open(path_for(key).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0
+        || static_cast<size_t>(info.st_size) < sizeof(CacheHeader)) {
+        close(fd);
+        return std::nullopt;
+    }
+    size_t size = info.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // Mark as used, for eviction. Not being able to is harmless.
+    futimens(fd, nullptr);
+    // The mapping keeps the file alive
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return std::nullopt;
+    }
+
+    auto bytes = static_cast<const uint8_t *>(mapping);
+    CacheHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+    if (header.magic != cache_magic || header.version != cache_version
+        || header.width != width || header.height != height
+        || sizeof(header) + header.key_size > size
+        || header.mask_offset + width * height > size
+        || std::string_view(reinterpret_cast<const char *>(bytes + sizeof(header)),
+                            header.key_size)
+             != key) {
+        munmap(mapping, size);
+        return std::nullopt;
+    }
+    return Entry(mapping, size, {bytes + header.mask_offset, width * height});
+}
+
+void MaskCache::store(const std::string &key,
+                      std::span<const uint8_t> mask,
+                      size_t width,
+                      size_t height) const {
+    auto path = path_for(key);
+    auto temporary_path = path;
+    temporary_path += format(".{}.tmp", getpid());
+
+    CacheHeader header{
+      .magic = cache_magic,
+      .version = cache_version,
+      .key_size = static_cast<uint32_t>(key.size()),
+      .width = width,
+      .height = height,
+      .mask_offset = (sizeof(CacheHeader) + key.size() + mask_alignment - 1)
+                     / mask_alignment * mask_alignment,
+    };
+    auto padding =
+      std::string(header.mask_offset - sizeof(CacheHeader) - key.size(), '\0');
+
+    std::error_code error;
+    std::filesystem::create_directories(_directory, error);
+    {
+        std::ofstream file(temporary_path, std::ios::binary);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(key.data(), key.size());
+        file.write(padding.data(), padding.size());
+        file.write(reinterpret_cast<const char *>(mask.data()), mask.size());
+        file.close();
+        if (!file) {
+            print("Warning: Could not write mask cache {}\n", temporary_path.string());
+            std::filesystem::remove(temporary_path, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary_path, path, error);
+    if (error) {
+        print("Warning: Could not write mask cache {}: {}\n",
+              path.string(),
+              error.message());
+        std::filesystem::remove(temporary_path, error);
+        return;
+    }
+    evict();
+}
+
+void MaskCache::evict() const {
+    struct CachedFile {
+        std::filesystem::file_time_type last_used;
+        size_t size;
+        std::filesystem::path path;
+    };
+    auto files = std::vector<CachedFile>{};
+    size_t total_size = 0;
+    std::error_code error;
+    for (auto &entry : std::filesystem::directory_iterator(_directory, error)) {
+        if (entry.path().extension() != ".mask") {
+            continue;
+        }
+        auto last_used = entry.last_write_time(error);
+        auto size = entry.file_size(error);
+        // Another spotfinder might have removed it
+        if (error) {
+            continue;
+        }
+        files.push_back({last_used, size, entry.path()});
+        total_size += size;
+    }
+    std::ranges::sort(files, {}, &CachedFile::last_used);
+    for (auto &file : files) {
+        if (total_size <= _max_size) {
+            break;
+        }
+        // Anything still mapped by a spotfinder stays readable by it
+        std::filesystem::remove(file.path, error);
+        total_size -= file.size;
+    }
+}
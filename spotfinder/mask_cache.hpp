@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+
+/**
+ * @brief On-disk cache of final detector masks.
+ *
+ * Making the mask means applying any resolution limits to the reader's
+ * mask. The result only depends on the contents of the reader's mask, the
+ * detector and the geometry, so it is stored under a hash of those, and
+ * mapped straight back into memory the next time it is needed.
+ *
+ * Entries are written to a temporary file and renamed into place, so
+ * concurrent spotfinders sharing a cache never see a partial mask. Once
+ * the cache is over its size limit, the least recently used entries are
+ * removed.
+ */
+class MaskCache {
+  public:
+    /// A cached mask, mapped read-only from its file
+    class Entry {
+      public:
+        Entry(void *mapping, size_t mapping_size, std::span<const uint8_t> mask)
+            : _mapping(mapping), _mapping_size(mapping_size), _mask(mask) {}
+        Entry(Entry &&other);
+        Entry &operator=(Entry &&other);
+        Entry(const Entry &) = delete;
+        Entry &operator=(const Entry &) = delete;
+        ~Entry();
+
+        /// The mask, row-major, nonzero for good pixels
+        std::span<const uint8_t> mask() const {
+            return _mask;
+        }
+
+      private:
+        void *_mapping;
+        size_t _mapping_size;
+        std::span<const uint8_t> _mask;
+    };
+
+    /// Room for a few dozen full-size masks of the largest detectors
+    static constexpr size_t default_max_size = 1024ul * 1024 * 1024;
+
+    explicit MaskCache(std::filesystem::path directory,
+                       size_t max_size = default_max_size)
+        : _directory(std::move(directory)), _max_size(max_size) {}
+
+    /**
+     * @brief Where to keep the cache, if anywhere.
+     *
+     * $FFS_MASK_CACHE if set, where an empty value turns caching off.
+     * Otherwise a directory under $XDG_CACHE_HOME, or ~/.cache.
+     */
+    static auto default_directory() -> std::optional<std::filesystem::path>;
+
+    /// Hash a mask's contents, for its key
+    static auto content_hash(std::span<const uint8_t> data) -> uint64_t;
+
+    /**
+     * @brief Look up a mask.
+     *
+     * @param key   Everything the mask depends on. The full key is stored
+     *              with the mask and checked, so hash collisions are misses.
+     * @returns The mask, or nullopt if it isn't cached (or is unreadable)
+     */
+    auto load(const std::string &key, size_t width, size_t height) const
+      -> std::optional<Entry>;
+
+    /**
+     * @brief Add a mask to the cache.
+     *
+     * Failing to write is only reported, since the mask can always be
+     * made again. Makes room by removing the least recently used masks.
+     */
+    void store(const std::string &key,
+               std::span<const uint8_t> mask,
+               size_t width,
+               size_t height) const;
+
+    auto path_for(const std::string &key) const -> std::filesystem::path;
+
+  private:
+    /// Remove the least recently used masks until the cache fits
+    void evict() const;
+
+    std::filesystem::path _directory;
+    size_t _max_size;
+};
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A fixed-size queue between pipeline stages, for any number of
+ *        producers and consumers.
+ *
+ * Pushing and popping is lock-free, using a ring of cells that each carry
+ * a sequence number saying whose turn it is to use them: 2 × pos for the
+ * push at pos, and 2 × pos + 1 for the pop. Counting in twos keeps the
+ * turns apart even with a single cell. Only a push to a full queue, or a
+ * pop from an empty one, blocks. That blocking is what gives backpressure:
+ * a stage that gets ahead waits for the next one.
+ *
+ * Closing the queue stops any more pushes. Pops drain what's left, then
+ * return nullopt. Close once every producer has finished, or to abandon
+ * whatever is still queued.
+ */
+template <typename T>
+class BoundedQueue {
+  public:
+    explicit BoundedQueue(size_t capacity)
+        : _capacity(capacity), _cells(std::make_unique<Cell[]>(capacity)) {
+        for (size_t i = 0; i < capacity; ++i) {
+            _cells[i].sequence.store(2 * i, std::memory_order_relaxed);
+        }
+    }
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    auto capacity() const -> size_t {
+        return _capacity;
+    }
+
+    /// Push without blocking. Returns false if the queue is full or closed.
+    bool try_push(T &value) {
+        if (_closed.load(std::memory_order_acquire)) {
+            return false;
+        }
+        size_t pos = _push_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &_cells[pos % _capacity];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff =
+              static_cast<intptr_t>(sequence) - static_cast<intptr_t>(2 * pos);
+            if (diff == 0) {
+                if (_push_pos.compare_exchange_weak(
+                      pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The cell still holds a value from a lap ago
+                return false;
+            } else {
+                pos = _push_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(2 * pos + 1, std::memory_order_release);
+        _pushes.fetch_add(1, std::memory_order_release);
+        _pushes.notify_all();
+        return true;
+    }
+
+    /// Pop without blocking. Returns nullopt if the queue is empty.
+    auto try_pop() -> std::optional<T> {
+        size_t pos = _pop_pos.load(std::memory_order_relaxed);
+        Cell *cell;
+        while (true) {
+            cell = &_cells[pos % _capacity];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            auto diff =
+              static_cast<intptr_t>(sequence) - static_cast<intptr_t>(2 * pos + 1);
+            if (diff == 0) {
+                if (_pop_pos.compare_exchange_weak(
+                      pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return std::nullopt;
+            } else {
+                pos = _pop_pos.load(std::memory_order_relaxed);
+            }
+        }
+        std::optional<T> value{std::move(cell->value)};
+        // Hand the cell on to the push a whole lap later
+        cell->sequence.store(2 * (pos + _capacity), std::memory_order_release);
+        _pops.fetch_add(1, std::memory_order_release);
+        _pops.notify_all();
+        return value;
+    }
+
+    /// Push, waiting for space if the queue is full. Returns false if closed.
+    bool push(T value) {
+        while (true) {
+            auto pops = _pops.load(std::memory_order_acquire);
+            if (try_push(value)) {
+                return true;
+            }
+            if (_closed.load(std::memory_order_acquire)) {
+                return false;
+            }
+            // Anything popped since we looked will have changed the count
+            _pops.wait(pops, std::memory_order_acquire);
+        }
+    }
+
+    /// Pop, waiting for a value if the queue is empty. Returns nullopt once
+    /// the queue is closed and empty.
+    auto pop() -> std::optional<T> {
+        while (true) {
+            auto pushes = _pushes.load(std::memory_order_acquire);
+            if (auto value = try_pop()) {
+                return value;
+            }
+            if (_closed.load(std::memory_order_acquire)) {
+                // A push may have landed between the pop and the check
+                return try_pop();
+            }
+            _pushes.wait(pushes, std::memory_order_acquire);
+        }
+    }
+
+    /// Stop any more pushes, and wake everything waiting on the queue
+    void close() {
+        _closed.store(true, std::memory_order_release);
+        _pushes.fetch_add(1, std::memory_order_release);
+        _pops.fetch_add(1, std::memory_order_release);
+        _pushes.notify_all();
+        _pops.notify_all();
+    }
+
+    auto is_closed() const -> bool {
+        return _closed.load(std::memory_order_acquire);
+    }
+
+  private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    const size_t _capacity;
+    std::unique_ptr<Cell[]> _cells;
+    // Pushers and poppers each get a cache line to themselves
+    alignas(64) std::atomic<size_t> _push_pos{0};
+    alignas(64) std::atomic<size_t> _pop_pos{0};
+    // Bumped on every push, pop and close, for blocked callers to wait on.
+    // 32-bit so that waiting on them is a plain futex.
+    alignas(64) std::atomic<uint32_t> _pushes{0};
+    std::atomic<uint32_t> _pops{0};
+    std::atomic<bool> _closed{false};
+};
+
+/**
+ * @brief A set of stages, each a pool of threads, normally joined by
+ *        BoundedQueues.
+ *
+ * Each stage is sized separately. When every thread in a stage has
+ * returned, the stage's finished callback runs; this is where it closes
+ * the queue it feeds, so that the next stage drains it and finishes in turn.
+ */
+class Pipeline {
+  public:
+    /// on_thread_start(stage, thread_index) is called in each new thread,
+    /// before it starts work, e.g. to set its CPU affinity
+    explicit Pipeline(
+      std::function<void(const std::string &, size_t)> on_thread_start = {})
+        : _on_thread_start(std::move(on_thread_start)) {}
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+    ~Pipeline() {
+        join();
+    }
+
+    /// Start num_threads threads each running body(thread_index), and call
+    /// finished() after the last of them returns.
+    void add_stage(std::string name,
+                   size_t num_threads,
+                   std::function<void(size_t)> body,
+                   std::function<void()> finished = {}) {
+        auto &stage = *_stages.emplace_back(std::make_unique<Stage>(
+          std::move(name), num_threads, std::move(body), std::move(finished)));
+        if (num_threads == 0) {
+            if (stage.finished) {
+                stage.finished();
+            }
+            return;
+        }
+        for (size_t i = 0; i < num_threads; ++i) {
+            _threads.emplace_back([this, &stage, i]() {
+                // Shows up in top -H and debuggers. Linux limits it to 15 chars.
+                auto thread_name = (stage.name + "-" + std::to_string(i)).substr(0, 15);
+                pthread_setname_np(pthread_self(), thread_name.c_str());
+                if (_on_thread_start) {
+                    _on_thread_start(stage.name, i);
+                }
+                stage.body(i);
+                if (stage.running.fetch_sub(1) == 1 && stage.finished) {
+                    stage.finished();
+                }
+            });
+        }
+    }
+
+    /// Wait for every stage to finish
+    void join() {
+        for (auto &thread : _threads) {
+            if (thread.joinable()) {
+                thread.join();
+            }
+        }
+    }
+
+  private:
+    struct Stage {
+        Stage(std::string name,
+              size_t num_threads,
+              std::function<void(size_t)> body,
+              std::function<void()> finished)
+            : name(std::move(name)),
+              running(num_threads),
+              body(std::move(body)),
+              finished(std::move(finished)) {}
+
+        const std::string name;
+        std::atomic<size_t> running;
+        std::function<void(size_t)> body;
+        std::function<void()> finished;
+    };
+
+    std::function<void(const std::string &, size_t)> _on_thread_start;
+    std::vector<std::unique_ptr<Stage>> _stages;
+    std::vector<std::jthread> _threads;
+};
+
+/**
+ * @brief Puts items finished out of order back into sequence.
+ *
+ * Items are added with their sequence number as they finish. Whenever the
+ * next item in sequence arrives, it and everything held contiguously after
+ * it are released straight away. At most window items are held back; past
+ * that, the earliest is released anyway and the gap before it is given up
+ * on, so one lost or very slow item can't hold everything else up. An item
+ * from a gap that was given up on is released as soon as it arrives.
+ *
+ * An item can be replaced by adding another with the same sequence number,
+ * e.g. a placeholder by the real result. While the first is held, the
+ * second takes its place; once it's been released, the second follows it
+ * straight away.
+ *
+ * Not thread-safe; meant for a single output thread.
+ */
+template <typename T>
+class ReorderBuffer {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    /// How long released items were held back, in ms
+    struct Stats {
+        size_t released = 0;
+        /// Items released before something earlier in the sequence
+        size_t out_of_order = 0;
+        double total_wait = 0;
+        double max_wait = 0;
+    };
+
+    explicit ReorderBuffer(size_t window, size_t first = 0)
+        : _window(window), _next(first) {}
+
+    /// Add the item with this sequence number, and pass everything that
+    /// can now be released to emit(item), in order
+    template <typename F>
+    void add(size_t index, T item, F &&emit) {
+        insert(index, std::move(item), emit, false);
+    }
+
+    /// Add an item replacing one already added with this sequence number
+    template <typename F>
+    void replace(size_t index, T item, F &&emit) {
+        insert(index, std::move(item), emit, true);
+    }
+
+    /// Release everything still held, in order, regardless of gaps
+    template <typename F>
+    void flush(F &&emit) {
+        auto now = clock::now();
+        for (auto &[index, held] : _held) {
+            release(std::move(held.item), held.added, now, emit);
+            _next = index + 1;
+        }
+        _held.clear();
+    }
+
+    auto stats() const -> const Stats & {
+        return _stats;
+    }
+
+  private:
+    struct Held {
+        T item;
+        clock::time_point added;
+    };
+
+    template <typename F>
+    void insert(size_t index, T item, F &emit, bool replacing) {
+        auto now = clock::now();
+        if (index < _next) {
+            // Arriving after its gap was given up on, or after the item it
+            // replaces was released
+            if (!replacing) {
+                _stats.out_of_order += 1;
+            }
+            release(std::move(item), now, now, emit);
+            return;
+        }
+        _held.insert_or_assign(index, Held{std::move(item), now});
+        while (!_held.empty()) {
+            auto earliest = _held.begin();
+            if (earliest->first != _next) {
+                if (_held.size() <= _window) {
+                    break;
+                }
+                // The window is full, so stop waiting for the gap
+                _stats.out_of_order += 1;
+            }
+            _next = earliest->first + 1;
+            release(std::move(earliest->second.item),
+                    earliest->second.added,
+                    now,
+                    emit);
+            _held.erase(earliest);
+        }
+    }
+
+    template <typename F>
+    void release(T item, clock::time_point added, clock::time_point now, F &emit) {
+        double wait = std::chrono::duration<double, std::milli>(now - added).count();
+        _stats.released += 1;
+        _stats.total_wait += wait;
+        _stats.max_wait = std::max(_stats.max_wait, wait);
+        emit(std::move(item));
+    }
+
+    const size_t _window;
+    /// The sequence number due next
+    size_t _next;
+    std::map<size_t, Held> _held;
+    Stats _stats;
+};
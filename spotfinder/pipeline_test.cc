@@ -0,0 +1,362 @@
+/**
+ * Tests of the pipeline's building blocks, which don't need a GPU.
+ *
+ * Each test prints what failed; the program fails if any did.
+ */
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <chrono>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "image_scheduler.hpp"
+#include "pipeline.hpp"
+
+using namespace fmt;
+
+namespace {
+int failures = 0;
+
+void check(bool passed, const char *expression, int line) {
+    if (!passed) {
+        print("pipeline_test.cc:{}: CHECK({}) failed\n", line, expression);
+        ++failures;
+    }
+}
+#define CHECK(...) check((__VA_ARGS__), #__VA_ARGS__, __LINE__)
+
+using Strings = std::vector<std::string>;
+using Images = std::vector<size_t>;
+using Policy = ImageScheduler::Policy;
+using Sampling = ImageScheduler::Sampling;
+
+/// Claim until the scheduler runs out, with the first arrived images there
+auto claim_all(ImageScheduler &scheduler, size_t arrived)
+  -> std::vector<ImageScheduler::Claim> {
+    auto claims = std::vector<ImageScheduler::Claim>{};
+    auto is_available = [&](size_t image) { return image < arrived; };
+    while (auto claim = scheduler.claim(false, is_available)) {
+        claims.push_back(std::move(*claim));
+    }
+    return claims;
+}
+
+/// Every image claimed, in the order they were handed out
+auto claimed_images(const std::vector<ImageScheduler::Claim> &claims) -> Images {
+    auto images = Images{};
+    for (auto &claim : claims) {
+        for (size_t image = claim.first; image < claim.first + claim.count; ++image) {
+            images.push_back(image);
+        }
+    }
+    return images;
+}
+
+/// Whether every image up to num_images is in images exactly once
+bool each_once(Images images, size_t num_images) {
+    std::sort(images.begin(), images.end());
+    auto expected = Images(num_images);
+    for (size_t i = 0; i < num_images; ++i) {
+        expected[i] = i;
+    }
+    return images == expected;
+}
+
+/// A ReorderBuffer<std::string>, and what it has released so far
+struct Reorder {
+    explicit Reorder(size_t window) : buffer(window) {}
+
+    auto emit() {
+        return [this](std::string item) { released.push_back(std::move(item)); };
+    }
+    void add(size_t index, std::string item) {
+        buffer.add(index, std::move(item), emit());
+    }
+    void replace(size_t index, std::string item) {
+        buffer.replace(index, std::move(item), emit());
+    }
+
+    ReorderBuffer<std::string> buffer;
+    Strings released;
+};
+
+void test_reorder_replace_held() {
+    // A placeholder for image 1, held behind the gap at 0
+    auto reorder = Reorder(4);
+    reorder.add(1, "skipped 1");
+    reorder.replace(1, "result 1");
+    CHECK(reorder.released.empty());
+    reorder.add(0, "result 0");
+    CHECK(reorder.released == Strings{"result 0", "result 1"});
+    CHECK(reorder.buffer.stats().out_of_order == 0);
+}
+
+void test_reorder_replace_released() {
+    auto reorder = Reorder(4);
+    reorder.add(0, "skipped 0");
+    reorder.replace(0, "result 0");
+    CHECK(reorder.released == Strings{"skipped 0", "result 0"});
+    CHECK(reorder.buffer.stats().out_of_order == 0);
+}
+
+void test_reorder_window_overflow() {
+    auto reorder = Reorder(2);
+    reorder.add(1, "1");
+    reorder.add(2, "2");
+    CHECK(reorder.released.empty());
+    // A third item held behind the gap is one too many, so the gap is given
+    // up on
+    reorder.add(3, "3");
+    CHECK(reorder.released == Strings{"1", "2", "3"});
+    CHECK(reorder.buffer.stats().out_of_order == 1);
+    // What was in the gap goes straight out when it turns up
+    reorder.add(0, "0");
+    CHECK(reorder.released == Strings{"1", "2", "3", "0"});
+    CHECK(reorder.buffer.stats().out_of_order == 2);
+    reorder.add(4, "4");
+    CHECK(reorder.released.back() == "4");
+    CHECK(reorder.buffer.stats().released == 5);
+}
+
+void test_scheduler_in_order() {
+    auto scheduler = ImageScheduler(Policy::in_order, 10, 3);
+    bool checked_arrivals = false;
+    auto is_available = [&](size_t) {
+        checked_arrivals = true;
+        return true;
+    };
+    // Each batch as {first, count}
+    using Batches = std::vector<std::pair<size_t, size_t>>;
+    auto claims = Batches{};
+    while (auto claim = scheduler.claim(false, is_available)) {
+        CHECK(!claim->newest && !claim->backfill && claim->skipped.empty());
+        claims.emplace_back(claim->first, claim->count);
+    }
+    CHECK(claims == Batches{{0, 3}, {3, 3}, {6, 3}, {9, 1}});
+    // In order, without a latency target, there's nothing to wait for
+    CHECK(!checked_arrivals);
+    CHECK(scheduler.next_in_order() == 10);
+}
+
+void test_scheduler_latest_first() {
+    auto scheduler = ImageScheduler(Policy::latest_first, 10, 2);
+    auto is_available = [](size_t image) { return image < 5; };
+    // Skips ahead to the newest images arrived
+    auto claim = scheduler.claim(false, is_available);
+    CHECK(claim && claim->first == 3 && claim->count == 2 && claim->newest);
+    // A background lane only fills in behind
+    claim = scheduler.claim(true, is_available);
+    CHECK(claim && claim->first == 0 && claim->count == 2 && !claim->newest);
+    // With nothing newer arrived, the rest is filled in oldest first
+    claim = scheduler.claim(false, is_available);
+    CHECK(claim && claim->first == 2 && claim->count == 1 && !claim->newest);
+    auto stats = scheduler.stats();
+    CHECK(stats.newest == 2);
+    CHECK(stats.filled_in == 3);
+    auto rest = claim_all(scheduler, 10);
+    auto images = claimed_images(rest);
+    images.insert(images.end(), {3, 4, 0, 1, 2});
+    CHECK(each_once(images, 10));
+    CHECK(scheduler.stats().skipped == 0 && scheduler.stats().backfilled == 0);
+}
+
+/// Overload a scheduler: claim two batches, then finish two images slowly
+/// enough that the rest of those arrived would take far longer than the
+/// target
+auto overload(ImageScheduler &scheduler, size_t arrived) -> Images {
+    auto is_available = [&](size_t image) { return image < arrived; };
+    auto claims = std::vector<ImageScheduler::Claim>{};
+    for (int i = 0; i < 2; ++i) {
+        auto claim = scheduler.claim(false, is_available);
+        CHECK(claim && claim->skipped.empty());
+        claims.push_back(std::move(*claim));
+    }
+    scheduler.finished();
+    std::this_thread::sleep_for(std::chrono::milliseconds(120));
+    scheduler.finished();
+    return claimed_images(claims);
+}
+
+void check_sampling(Sampling sampling) {
+    const size_t num_images = 200;
+    auto scheduler = ImageScheduler(
+      Policy::in_order,
+      num_images,
+      4,
+      ImageScheduler::LatencyTarget{std::chrono::milliseconds(500), sampling});
+    auto images = overload(scheduler, num_images);
+    size_t next = scheduler.next_in_order();
+    auto claims = claim_all(scheduler, num_images);
+    CHECK(!claims.empty());
+    if (claims.empty()) {
+        return;
+    }
+
+    // While overloaded, each claim keeps one image out of a run, skipping the
+    // rest, and the runs follow on from each other
+    auto &sample = claims.front();
+    CHECK(sample.count == 1 && !sample.backfill);
+    CHECK(!sample.skipped.empty() && sample.skipped.front() == next);
+    size_t run = sample.skipped.size() + 1;
+    CHECK(sample.first >= next && sample.first < next + run);
+    CHECK(std::find(sample.skipped.begin(), sample.skipped.end(), sample.first)
+          == sample.skipped.end());
+    if (sampling == Sampling::stride) {
+        CHECK(sample.first == next + run - 1);
+    }
+
+    // Once nothing is left to sample, what was skipped is backfilled, in
+    // order, in batches
+    auto skipped = Images{};
+    auto backfilled = Images{};
+    bool backfilling = false;
+    for (auto &claim : claims) {
+        skipped.insert(skipped.end(), claim.skipped.begin(), claim.skipped.end());
+        if (claim.backfill) {
+            backfilling = true;
+            CHECK(claim.count <= 4);
+            for (size_t i = 0; i < claim.count; ++i) {
+                backfilled.push_back(claim.first + i);
+            }
+        } else {
+            // Nothing new is sampled after backfilling starts
+            CHECK(!backfilling);
+        }
+    }
+    CHECK(!skipped.empty());
+    CHECK(std::is_sorted(backfilled.begin(), backfilled.end()));
+    std::sort(skipped.begin(), skipped.end());
+    CHECK(backfilled == skipped);
+    auto rest = claimed_images(claims);
+    images.insert(images.end(), rest.begin(), rest.end());
+    CHECK(each_once(images, num_images));
+    auto stats = scheduler.stats();
+    CHECK(stats.skipped == skipped.size() && stats.backfilled == skipped.size());
+}
+
+void test_scheduler_sampling_stride() {
+    check_sampling(Sampling::stride);
+}
+
+void test_scheduler_sampling_stratified() {
+    check_sampling(Sampling::stratified);
+}
+
+void test_scheduler_sampling_without_backfill() {
+    const size_t num_images = 100;
+    auto target = ImageScheduler::LatencyTarget{std::chrono::milliseconds(500)};
+    target.backfill = false;
+    auto scheduler = ImageScheduler(Policy::in_order, num_images, 4, target);
+    auto images = overload(scheduler, num_images);
+    auto claims = claim_all(scheduler, num_images);
+    // Skipped images are given up on, rather than handed out afterwards
+    auto skipped = Images{};
+    for (auto &claim : claims) {
+        CHECK(!claim.backfill);
+        skipped.insert(skipped.end(), claim.skipped.begin(), claim.skipped.end());
+    }
+    CHECK(!skipped.empty());
+    auto rest = claimed_images(claims);
+    images.insert(images.end(), rest.begin(), rest.end());
+    images.insert(images.end(), skipped.begin(), skipped.end());
+    CHECK(each_once(images, num_images));
+    auto stats = scheduler.stats();
+    CHECK(stats.skipped == skipped.size() && stats.backfilled == 0);
+}
+
+void test_scheduler_backfill_when_caught_up() {
+    // Skipped images are backfilled as soon as nothing newer is waiting,
+    // even if the scan isn't over
+    const size_t num_images = 100;
+    auto scheduler = ImageScheduler(
+      Policy::in_order,
+      num_images,
+      4,
+      ImageScheduler::LatencyTarget{std::chrono::milliseconds(500)});
+    size_t arrived = 40;
+    size_t claimed = overload(scheduler, arrived).size();
+    auto is_available = [&](size_t image) { return image < arrived; };
+    auto sample = scheduler.claim(false, is_available);
+    CHECK(sample && !sample->skipped.empty());
+    if (!sample) {
+        return;
+    }
+    claimed += sample->count;
+    // Catch up with what's arrived
+    while (scheduler.next_in_order() < arrived) {
+        auto claim = scheduler.claim(false, is_available);
+        CHECK(claim && !claim->backfill);
+        claimed += claim ? claim->count : 0;
+    }
+    // Every result is in, so nothing is left in flight to predict a delay
+    // from. Two were already finished while overloading.
+    for (size_t i = 2; i < claimed; ++i) {
+        scheduler.finished();
+    }
+    auto backfill = scheduler.claim(false, is_available);
+    CHECK(backfill && backfill->backfill
+          && backfill->first == sample->skipped.front());
+}
+
+void test_queue_close_then_drain() {
+    auto queue = BoundedQueue<int>(4);
+    CHECK(queue.push(1) && queue.push(2) && queue.push(3));
+    queue.close();
+    CHECK(queue.is_closed());
+    CHECK(!queue.push(4));
+    int value = 5;
+    CHECK(!queue.try_push(value));
+    // What was queued before closing is still popped, in order
+    CHECK(queue.pop() == 1);
+    CHECK(queue.try_pop() == 2);
+    CHECK(queue.pop() == 3);
+    CHECK(queue.pop() == std::nullopt);
+    CHECK(queue.try_pop() == std::nullopt);
+}
+
+void test_queue_close_wakes_waiters() {
+    auto empty = BoundedQueue<int>(1);
+    auto full = BoundedQueue<int>(1);
+    CHECK(full.push(1));
+    std::optional<int> popped = 0;
+    bool pushed = true;
+    {
+        auto consumer = std::jthread([&]() { popped = empty.pop(); });
+        auto producer = std::jthread([&]() { pushed = full.push(2); });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        empty.close();
+        full.close();
+    }
+    CHECK(popped == std::nullopt);
+    CHECK(!pushed);
+    // The value queued before closing is still there to drain
+    CHECK(full.pop() == 1);
+    CHECK(full.pop() == std::nullopt);
+}
+}  // namespace
+
+int main() {
+    auto tests = std::vector<std::pair<const char *, void (*)()>>{
+      {"reorder_replace_held", test_reorder_replace_held},
+      {"reorder_replace_released", test_reorder_replace_released},
+      {"reorder_window_overflow", test_reorder_window_overflow},
+      {"scheduler_in_order", test_scheduler_in_order},
+      {"scheduler_latest_first", test_scheduler_latest_first},
+      {"scheduler_sampling_stride", test_scheduler_sampling_stride},
+      {"scheduler_sampling_stratified", test_scheduler_sampling_stratified},
+      {"scheduler_sampling_without_backfill", test_scheduler_sampling_without_backfill},
+      {"scheduler_backfill_when_caught_up", test_scheduler_backfill_when_caught_up},
+      {"queue_close_then_drain", test_queue_close_then_drain},
+      {"queue_close_wakes_waiters", test_queue_close_wakes_waiters},
+    };
+    for (auto &[name, test] : tests) {
+        int failures_before = failures;
+        test();
+        print("{}: {}\n", name, failures == failures_before ? "ok" : "FAILED");
+    }
+    return failures ? 1 : 0;
+}
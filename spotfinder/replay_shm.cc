@@ -0,0 +1,229 @@
+/**
+ * @file replay_shm.cc
+ * @brief Replay a dataset into a directory, as the Eiger /dev/shm writer does.
+ *
+ * Images are taken from an existing NeXus file via raw chunk reads, or are
+ * generated, and written in the layout that SHMRead reads at a fixed frame
+ * rate. This lets the live-processing path, and how it copes with falling
+ * behind, be tested without a detector.
+ *
+ * If the output is unix:PATH, images are instead published over a Unix
+ * socket at PATH, for StreamRead.
+ *
+ * All of the source images are read into memory before replay starts, so
+ * that the write rate is not limited by the source.
+ */
+#include <fmt/core.h>
+#include <fmt/os.h>
+
+#include <algorithm>
+#include <argparse/argparse.hpp>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "h5read.h"
+#include "shmwrite.hpp"
+#include "streamwrite.hpp"
+#include "synthetic.hpp"
+#include "synthetic_arguments.hpp"
+#include "version.hpp"
+
+using namespace fmt;
+
+int main(int argc, char **argv) {
+    auto parser = argparse::ArgumentParser("replay_shm", FFS_VERSION);
+    parser.add_argument("output")
+      .help("SHM directory to write into, usually somewhere in /dev/shm, or "
+            "unix:PATH to publish a stream on a socket")
+      .metavar("DIR");
+    auto &source = parser.add_mutually_exclusive_group(true);
+    source.add_argument("-i", "--input")
+      .help("NeXus file to replay")
+      .metavar("FILE.nxs");
+    source.add_argument("--sample")
+      .help("Replay synthetic images instead of a file")
+      .default_value(false)
+      .implicit_value(true);
+    parser.add_argument("-r", "--rate")
+      .help("Frame rate to write images at (Hz)")
+      .metavar("HZ")
+      .default_value<float>(500)
+      .scan<'f', float>();
+    parser.add_argument("--images")
+      .help("Number of images to write. If more than the source has, it repeats.")
+      .metavar("NUM")
+      .scan<'u', size_t>();
+    parser.add_argument("--partial-delay")
+      .help("Pause halfway through writing each image for this long (µs), leaving "
+            "a partially written file visible")
+      .metavar("US")
+      .default_value<uint32_t>(0)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--start-delay")
+      .help("Time to wait between writing the headers and the first image (s)")
+      .metavar("S")
+      .default_value<float>(0)
+      .scan<'f', float>();
+    parser.add_argument("--timestamps")
+      .help("Write the scheduled and actual time of each image to a CSV file")
+      .metavar("FILE.csv");
+    parser.add_argument("-f", "--force")
+      .help("Replace any dataset already in the output directory")
+      .default_value(false)
+      .implicit_value(true);
+    add_synthetic_arguments(parser);
+    parser.parse_args(argc, argv);
+
+    auto output_arg = parser.get<std::string>("output");
+    bool streaming = output_arg.starts_with(stream_url_prefix);
+    auto output = std::filesystem::path(
+      streaming ? output_arg.substr(stream_url_prefix.size()) : output_arg);
+    float rate = parser.get<float>("rate");
+    if (rate <= 0) {
+        print("Error: Frame rate must be > 0\n");
+        return 1;
+    }
+    auto partial_delay =
+      std::chrono::microseconds(parser.get<uint32_t>("partial-delay"));
+    if (streaming && partial_delay.count() > 0) {
+        print("Error: --partial-delay only applies to SHM output\n");
+        return 1;
+    }
+
+    // Don't let a reader pick up images left over from an earlier run
+    if (!streaming && std::filesystem::exists(output / "start_1")) {
+        if (!parser.get<bool>("force")) {
+            print("Error: {} already has a dataset. Use --force to clear it.\n",
+                  output.string());
+            return 1;
+        }
+        for (auto &entry : std::filesystem::directory_iterator(output)) {
+            auto name = entry.path().filename().string();
+            if (name.starts_with("start_") || name.starts_with("image_")) {
+                std::filesystem::remove(entry.path());
+            }
+        }
+    }
+
+#pragma region Load source
+    std::unique_ptr<Reader> reader;
+    if (parser.get<bool>("sample")) {
+        size_t unique_images = parser.get<size_t>("unique-images");
+        auto params = get_synthetic_parameters(parser, unique_images);
+        print("Generating {} unique images\n", unique_images);
+        reader = std::make_unique<SyntheticRead>(params);
+    } else {
+        reader = std::make_unique<H5Read>(parser.get<std::string>("input"));
+    }
+    if (reader->get_raw_chunk_compression()
+        != Reader::ChunkCompression::BITSHUFFLE_LZ4) {
+        print("Error: SHM images must be bitshuffle-LZ4 compressed\n");
+        return 1;
+    }
+    size_t num_images = parser.is_used("images") ? parser.get<size_t>("images")
+                                                 : reader->get_number_of_images();
+
+    if (num_images > 0 && reader->get_number_of_images() == 0) {
+        print("Error: No images to replay\n");
+        return 1;
+    }
+
+    auto [slow, fast] = reader->image_shape();
+    auto buffer = std::vector<uint8_t>(slow * fast * sizeof(pixel_t) * 2);
+    auto chunks = std::vector<std::vector<uint8_t>>(
+      std::min(num_images, reader->get_number_of_images()));
+    print("Reading {} source images\n", chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        auto chunk = reader->get_raw_chunk(i, buffer);
+        chunks[i].assign(chunk.begin(), chunk.end());
+    }
+#pragma endregion Load source
+
+    std::optional<StreamPublisher> publisher;
+    if (streaming) {
+        publisher.emplace(output);
+        print("Waiting for a reader to connect to {}\n", output_arg);
+        publisher->accept();
+        publisher->send_series_start(*reader, num_images);
+    } else {
+        std::filesystem::create_directories(output);
+        write_shm_headers(output, *reader, num_images);
+    }
+    std::this_thread::sleep_for(
+      std::chrono::duration<float>(parser.get<float>("start-delay")));
+
+#pragma region Replay
+    print("Writing {} images to {} at {} Hz\n", num_images, output_arg, rate);
+    auto interval = std::chrono::duration<double>(1.0 / rate);
+    // Timestamps are only written out afterwards, to keep I/O out of the loop
+    auto scheduled = std::vector<std::chrono::system_clock::time_point>(num_images);
+    auto written = std::vector<std::chrono::system_clock::time_point>(num_images);
+    size_t late_images = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto start_system = std::chrono::system_clock::now();
+    for (size_t i = 0; i < num_images; ++i) {
+        auto offset =
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * i);
+        auto now = std::chrono::steady_clock::now();
+        if (now < start + offset) {
+            std::this_thread::sleep_until(start + offset);
+        } else if (now - (start + offset) > interval) {
+            // More than a whole frame behind schedule
+            ++late_images;
+        }
+        try {
+            if (publisher) {
+                publisher->send_image(i, chunks[i % chunks.size()]);
+            } else {
+                write_shm_image(output, i, chunks[i % chunks.size()], partial_delay);
+            }
+        } catch (std::exception &e) {
+            print("Error: Writing image {}: {}\n", i, e.what());
+            return 1;
+        }
+        scheduled[i] =
+          start_system
+          + std::chrono::duration_cast<std::chrono::system_clock::duration>(offset);
+        written[i] = std::chrono::system_clock::now();
+    }
+    auto elapsed =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (publisher) {
+        try {
+            publisher->send_series_end();
+        } catch (std::exception &e) {
+            // The reader has every image, so may reasonably have gone
+            print("Warning: Could not send end of series: {}\n", e.what());
+        }
+    }
+#pragma endregion Replay
+
+    print("Wrote {} images in {:.2f} s ({:.1f} Hz)\n",
+          num_images,
+          elapsed,
+          num_images / elapsed);
+    if (late_images) {
+        print("{} images were more than one frame behind schedule\n", late_images);
+    }
+
+    if (parser.is_used("timestamps")) {
+        auto out = fmt::output_file(parser.get<std::string>("timestamps"));
+        out.print("image,scheduled_ns,written_ns\n");
+        for (size_t i = 0; i < num_images; ++i) {
+            out.print("{},{},{}\n",
+                      i,
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        scheduled[i].time_since_epoch())
+                        .count(),
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        written[i].time_since_epoch())
+                        .count());
+        }
+    }
+    return 0;
+}
@@ -2,7 +2,9 @@
 
 #include "shmread.hpp"
 
+#include <fcntl.h>
 #include <fmt/core.h>
+#include <unistd.h>
 
 #include <filesystem>
 #include <iostream>
@@ -47,14 +49,18 @@ SHMRead::SHMRead(const std::string &path) : _base_path(path) {
     _beam_center = {data["beam_center_y"].template get<float>(),
                     data["beam_center_x"].template get<float>()};
 
-    // Read the mask
-    std::vector<int32_t> raw_mask;
-    raw_mask.resize(_image_shape[0] * _image_shape[1]);
+    // The mask is only read when asked for, but check it now
     auto mask_filename = format("{}/start_5", _base_path);
     if (std::filesystem::file_size(mask_filename)
-        != raw_mask.size() * sizeof(decltype(raw_mask)::value_type)) {
+        != _image_shape[0] * _image_shape[1] * sizeof(int32_t)) {
         throw std::runtime_error("Error: Mask file does not match expected size");
     }
+}
+
+void SHMRead::read_mask() const {
+    std::vector<int32_t> raw_mask;
+    raw_mask.resize(_image_shape[0] * _image_shape[1]);
+    auto mask_filename = format("{}/start_5", _base_path);
     std::ifstream f_mask(mask_filename, std::ios::in | std::ios::binary);
     f_mask.read(reinterpret_cast<char *>(raw_mask.data()),
                 raw_mask.size() * sizeof(decltype(raw_mask)::value_type));
@@ -63,7 +69,6 @@ SHMRead::SHMRead(const std::string &path) : _base_path(path) {
     for (auto &v : raw_mask) {
         _mask.push_back(!v);
     }
-    // return {destination.data(), static_cast<size_t>(f.gcount())};
 }
 
 bool SHMRead::is_image_available(size_t index) {
@@ -78,6 +83,33 @@ std::span<uint8_t> SHMRead::get_raw_chunk(size_t index,
     return {destination.data(), static_cast<size_t>(f.gcount())};
 }
 
+auto SHMRead::get_raw_chunks(size_t first,
+                             std::span<const std::span<uint8_t>> destinations)
+  -> std::vector<std::span<uint8_t>> {
+    // Opening is enough to tell if an image is there, so skip checking first
+    std::vector<std::span<uint8_t>> chunks;
+    for (size_t i = 0; i < destinations.size(); ++i) {
+        int fd = open(format("{}/image_{:06d}_2", _base_path, first + i).c_str(),
+                      O_RDONLY);
+        if (fd < 0) {
+            break;
+        }
+        auto destination = destinations[i];
+        size_t bytes_read = 0;
+        while (bytes_read < destination.size()) {
+            ssize_t bytes = read(
+              fd, destination.data() + bytes_read, destination.size() - bytes_read);
+            if (bytes <= 0) {
+                break;
+            }
+            bytes_read += bytes;
+        }
+        close(fd);
+        chunks.push_back({destination.data(), bytes_read});
+    }
+    return chunks;
+}
+
 template <>
 bool is_ready_for_read<SHMRead>(const std::string &path) {
     // We need headers.1, and headers.5, to read the metadata
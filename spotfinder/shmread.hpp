@@ -3,6 +3,7 @@
 #include <cuda_runtime.h>
 #include <fmt/core.h>
 
+#include <mutex>
 #include <vector>
 
 #include "h5read.h"
@@ -12,19 +13,26 @@ class SHMRead : public Reader {
     size_t _num_images;
     std::array<size_t, 2> _image_shape;
     const std::string _base_path;
-    std::vector<uint8_t> _mask;
+    /// Read on first use, since a cached copy of the final mask might be
+    /// used instead
+    mutable std::vector<uint8_t> _mask;
+    mutable std::once_flag _mask_read;
     std::array<image_t_type, 2> _trusted_range;
     std::optional<float> _wavelength;
     std::array<float, 2> _beam_center;
     std::array<float, 2> _pixel_size;
     float _detector_distance;
 
+    void read_mask() const;
+
   public:
     SHMRead(const std::string &path);
 
     bool is_image_available(size_t index);
 
     std::span<uint8_t> get_raw_chunk(size_t index, std::span<uint8_t> destination);
+    auto get_raw_chunks(size_t first, std::span<const std::span<uint8_t>> destinations)
+      -> std::vector<std::span<uint8_t>>;
 
     virtual auto get_raw_chunk_compression() -> ChunkCompression {
         return Reader::ChunkCompression::BITSHUFFLE_LZ4;
@@ -37,6 +45,7 @@ class SHMRead : public Reader {
         return _image_shape;
     };
     std::optional<std::span<const uint8_t>> get_mask() const {
+        std::call_once(_mask_read, [this] { read_mask(); });
         return {{_mask.data(), _mask.size()}};
     }
     virtual std::array<image_t_type, 2> get_trusted_range() const {
@@ -54,6 +63,10 @@ class SHMRead : public Reader {
     virtual std::optional<float> get_detector_distance() const {
         return _detector_distance;
     }
+    /// The mask is read from start_5
+    std::optional<std::string> get_mask_source() const {
+        return file_fingerprint(_base_path + "/start_5");
+    }
 };
 
 template <>
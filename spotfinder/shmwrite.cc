@@ -0,0 +1,82 @@
+#include "shmwrite.hpp"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <fstream>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+
+auto make_shm_series_header(const Reader &reader, size_t num_images)
+  -> std::string {
+    auto [slow, fast] = reader.image_shape();
+    auto pixel_size = reader.get_pixel_size().value_or(std::array{-1.0f, -1.0f});
+    auto beam_center = reader.get_beam_center().value_or(std::array{-1.0f, -1.0f});
+    json header = {
+      {"nimages", num_images},
+      {"ntrigger", 1},
+      {"x_pixels_in_detector", fast},
+      {"y_pixels_in_detector", slow},
+      {"bit_depth_image", 16},
+      {"countrate_correction_count_cutoff", reader.get_trusted_range()[1]},
+      // SHM distances are in mm
+      {"detector_distance", reader.get_detector_distance().value_or(0) * 1000},
+      {"y_pixel_size", pixel_size[0]},
+      {"x_pixel_size", pixel_size[1]},
+      {"beam_center_y", beam_center[0]},
+      {"beam_center_x", beam_center[1]},
+    };
+    if (auto wavelength = reader.get_wavelength()) {
+        header["wavelength"] = *wavelength;
+    }
+    return header.dump(2);
+}
+
+auto make_shm_mask(const Reader &reader) -> std::vector<int32_t> {
+    auto [slow, fast] = reader.image_shape();
+    auto mask = std::vector<int32_t>(slow * fast, 0);
+    if (auto reader_mask = reader.get_mask()) {
+        std::transform(reader_mask->begin(),
+                       reader_mask->end(),
+                       mask.begin(),
+                       [](auto v) { return v ? 0 : 1; });
+    }
+    return mask;
+}
+
+void write_shm_headers(const std::filesystem::path &path,
+                       const Reader &reader,
+                       size_t num_images) {
+    auto mask = make_shm_mask(reader);
+    std::ofstream(path / "start_5", std::ios::binary)
+      .write(reinterpret_cast<const char *>(mask.data()),
+             mask.size() * sizeof(decltype(mask)::value_type));
+    std::ofstream(path / "start_1") << make_shm_series_header(reader, num_images);
+    std::ofstream(path / "start_4") << "{}";
+}
+
+void write_shm_image(const std::filesystem::path &path,
+                     size_t index,
+                     std::span<const uint8_t> chunk,
+                     std::chrono::microseconds partial_delay) {
+    auto filename = path / fmt::format("image_{:06d}_2", index);
+    std::ofstream f(filename, std::ios::binary);
+    auto data = reinterpret_cast<const char *>(chunk.data());
+    if (partial_delay.count() > 0) {
+        size_t half = chunk.size() / 2;
+        f.write(data, half);
+        f.flush();
+        std::this_thread::sleep_for(partial_delay);
+        f.write(data + half, chunk.size() - half);
+    } else {
+        f.write(data, chunk.size());
+    }
+    if (!f) {
+        throw std::runtime_error(
+          fmt::format("Failed to write image {}", filename.string()));
+    }
+}
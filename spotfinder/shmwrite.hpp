@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "h5read.h"
+
+/// The series header JSON, as written to start_1, describing a dataset
+auto make_shm_series_header(const Reader &reader, size_t num_images) -> std::string;
+
+/// The mask as written to start_5, which is nonzero for bad pixels
+auto make_shm_mask(const Reader &reader) -> std::vector<int32_t>;
+
+/**
+ * @brief Write the header files that SHMRead needs to open a dataset.
+ *
+ * start_4 is written last, as readers take it to mean the rest of the
+ * headers are complete.
+ *
+ * @param path          The SHM directory
+ * @param reader        Source for the metadata and mask
+ * @param num_images    Number of images that will be written
+ */
+void write_shm_headers(const std::filesystem::path &path,
+                       const Reader &reader,
+                       size_t num_images);
+
+/**
+ * @brief Write a single image file into an SHM directory.
+ *
+ * @param path          The SHM directory
+ * @param index         Image index
+ * @param chunk         The raw chunk, including the bitshuffle header
+ * @param partial_delay If nonzero, write the first half of the file, then
+ *                      wait this long before writing the rest. This leaves
+ *                      a partially written file where readers can see it.
+ */
+void write_shm_image(const std::filesystem::path &path,
+                     size_t index,
+                     std::span<const uint8_t> chunk,
+                     std::chrono::microseconds partial_delay = {});
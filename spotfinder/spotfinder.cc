@@ -10,27 +10,43 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
-#include <barrier>
-#include <boost/graph/adjacency_list.hpp>
-#include <boost/graph/connected_components.hpp>
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <csignal>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <optional>
 #include <ranges>
+#include <stdexcept>
 #include <stop_token>
 #include <thread>
 #include <utility>
+#include <vector>
 
 #include "cbfread.hpp"
 #include "common.hpp"
+#include "connected_components.hpp"
 #include "cuda_common.hpp"
+#include "decompression.hpp"
+#include "fused_dispersion.hpp"
 #include "h5read.h"
+#include "image_scheduler.hpp"
+#include "job_server.hpp"
+#include "jungfrauread.hpp"
 #include "kernels/masking.cuh"
+#include "mask_cache.hpp"
+#include "pipeline.hpp"
 #include "shmread.hpp"
+#include "stage_stats.hpp"
+#include "stackread.hpp"
 #include "standalone.h"
+#include "streamread.hpp"
+#include "synthetic.hpp"
+#include "topology.hpp"
+#include "trace.hpp"
 #include "version.hpp"
 
 using namespace fmt;
@@ -63,33 +79,111 @@ bool are_close(float a, float b, float tolerance) {
     return std::fabs(a - b) < tolerance;
 }
 
-struct Reflection {
-    int l, t, r, b;
-    int num_pixels = 0;
+/// Time since start, in ms, to sit alongside the CUDA event timings
+auto milliseconds_since(std::chrono::high_resolution_clock::time_point start)
+  -> float {
+    return std::chrono::duration<float, std::milli>(
+             std::chrono::high_resolution_clock::now() - start)
+      .count();
+}
+
+/**
+ * @brief An image on its way through the pipeline, with the buffers it is
+ *        processed in and the results so far.
+ */
+struct Frame {
+    Frame(int width, int height)
+        : raw_buffer(static_cast<size_t>(width) * height * sizeof(pixel_t)),
+          host_image(make_cuda_pinned_malloc<pixel_t>(width * height)),
+          host_results(make_cuda_pinned_malloc<uint8_t>(width * height)) {}
+
+    /// Index of the image, counting from zero
+    size_t image_num = 0;
+    /// Skipped earlier to meet --latency-slo, and read afterwards
+    bool backfill = false;
+    /// The raw chunk as read. Usually this is in raw_buffer, but some
+    /// readers hand out their own memory instead.
+    std::span<uint8_t> chunk;
+    std::vector<uint8_t> raw_buffer;
+    std::shared_ptr<pixel_t[]> host_image;
+    std::shared_ptr<uint8_t[]> host_results;
+    /// The decompressed pixels: host_image, unless usable where they were read
+    const pixel_t *image_data = nullptr;
+
+    // Timings, in ms, for the per-image report
+    float copy_time = 0;
+    float kernel_time = 0;
+    float post_copy_time = 0;
+    float post_time = 0;
+
+    /// When the frame passed through each stage, for --stats
+    FrameTimestamps times;
+
+    size_t num_strong_pixels = 0;
+    size_t num_strong_pixels_filtered = 0;
+    std::vector<Reflection> boxes;
+    /// Which post-processing thread found the reflections
+    size_t post_thread = 0;
+};
+
+/// A compute thread's CUDA stream, device buffers and timing events
+struct ComputeBuffers {
+    ComputeBuffers(int width, int height, size_t mask_pitch)
+        : device_image(width, height),
+          device_results(make_cuda_malloc<uint8_t[]>(mask_pitch * height),
+                         width,
+                         height,
+                         mask_pitch) {}
+
+    CudaStream stream;
+    PitchedMalloc<pixel_t> device_image;
+    PitchedMalloc<uint8_t> device_results;
+    CudaEvent start, copy, post, postcopy;
 };
 
-/// Copy the mask from a reader into a pitched GPU area
-template <typename T>
-auto upload_mask(T &reader) -> PitchedMalloc<uint8_t> {
-    size_t height = reader.image_shape()[0];
-    size_t width = reader.image_shape()[1];
+/**
+ * @brief Everything that can be kept from one run to the next.
+ *
+ * A single run throws this away at exit, but with --serve, it stays
+ * warm between jobs, so a job on the same detector as the one before
+ * starts without allocating or uploading anything.
+ */
+struct WarmState {
+    Topology topology = Topology::detect();
+    std::unique_ptr<ThreadPool> task_pool;
+    /// Frames, all of frame_shape (height, width)
+    std::vector<std::unique_ptr<Frame>> frames;
+    std::array<int, 2> frame_shape{};
+    /// One per compute thread, all of compute_shape (height, width, mask pitch)
+    std::vector<std::unique_ptr<ComputeBuffers>> compute_buffers;
+    std::array<size_t, 3> compute_shape{};
+    /// Final device masks, by mask cache key
+    std::map<std::string, PitchedMalloc<uint8_t>> masks;
+    /// Whether this is a --serve daemon, where results go to a client's
+    /// connection that the job server looks after
+    bool serving = false;
+};
 
+/// Copy a mask into a pitched GPU area. Without a mask, every pixel is valid.
+auto upload_mask(std::optional<std::span<const uint8_t>> host_mask,
+                 size_t width,
+                 size_t height) -> PitchedMalloc<uint8_t> {
     auto [dev_mask, device_mask_pitch] =
       make_cuda_pitched_malloc<uint8_t>(width, height);
 
     size_t valid_pixels = 0;
     CudaEvent start, end;
-    if (reader.get_mask()) {
+    if (host_mask) {
         // Count how many valid Mpx in this mask
         for (size_t i = 0; i < width * height; ++i) {
-            if (reader.get_mask().value()[i]) {
+            if (host_mask.value()[i]) {
                 valid_pixels += 1;
             }
         }
         start.record();
         cudaMemcpy2DAsync(dev_mask.get(),
                           device_mask_pitch,
-                          reader.get_mask()->data(),
+                          host_mask->data(),
                           width,
                           width,
                           height,
@@ -176,8 +270,8 @@ void wait_for_ready_for_read(const std::string &path,
             std::cout << std::flush;
 
             if (wait_time > timeout) {
-                print("\nError: Waited too long for read availability\n");
-                std::exit(1);
+                print("\n");
+                throw std::runtime_error("Waited too long for read availability");
             }
             std::this_thread::sleep_for(80ms);
         }
@@ -219,14 +313,18 @@ struct DispersionAlgorithm {
 class PipeHandler {
   private:
     int pipe_fd;     // File descriptor for the pipe
+    bool owns_pipe;  // Whether to close the pipe when done
     std::mutex mtx;  // Mutex for synchronization
 
   public:
     /**
      * @brief Constructor to initialize the PipeHandler object.
      * @param pipe_fd The file descriptor for the pipe.
+     * @param owns_pipe Close the pipe when done. Otherwise it belongs to
+     *                  someone else, such as the --serve job server.
      */
-    PipeHandler(int pipe_fd) : pipe_fd(pipe_fd) {
+    PipeHandler(int pipe_fd, bool owns_pipe = true)
+        : pipe_fd(pipe_fd), owns_pipe(owns_pipe) {
         // Constructor to initialize the pipe handler
         print("PipeHandler initialized with pipe_fd: {}\n", pipe_fd);
     }
@@ -235,7 +333,9 @@ class PipeHandler {
      * @brief Destructor to close the pipe.
      */
     ~PipeHandler() {
-        close(pipe_fd);
+        if (owns_pipe) {
+            close(pipe_fd);
+        }
     }
 
     /**
@@ -265,16 +365,80 @@ class PipeHandler {
     }
 };
 
-int main(int argc, char **argv) {
+/// Find spots in one dataset, as described by the command line arguments
+int run_spotfinder(const std::vector<std::string> &arguments, WarmState &warm) {
 #pragma region Argument Parsing
     // Parse arguments and get our H5Reader
     auto parser = CUDAArgumentParser(FFS_VERSION);
     parser.add_h5read_arguments();
     parser.add_argument("-n", "--threads")
-      .help("Number of parallel reader threads")
+      .help("Number of threads in each CPU stage not given a size of its own")
+      .default_value<uint32_t>(1)
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--read-threads")
+      .help("Number of threads waiting for and reading images (default: 1)")
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--decompress-workers")
+      .help("Number of threads decompressing images (default: --threads)")
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--compute-threads")
+      .help("Number of threads, each with a CUDA stream, running the GPU kernels "
+            "(default: --threads, up to 2)")
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--post-threads")
+      .help("Number of threads finding reflections in the kernel results "
+            "(default: --threads)")
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--queue-depth")
+      .help("Number of images that can wait between one stage and the next "
+            "(default: 4)")
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--pipeline-depth")
+      .help("Number of images in flight at once, each with its own set of "
+            "buffers (default: enough for every stage's threads, at least 16)")
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--task-threads")
+      .help("Number of helper threads, shared by every stage, that split up the "
+            "work on each image (default: --decompress-threads - 1)")
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--numa")
+      .help("Pin each thread to a CPU near the data it works on, and allocate "
+            "image buffers on the GPU's NUMA node")
+      .default_value(false)
+      .implicit_value(true);
+    parser.add_argument("--io-node")
+      .help("With --numa, the NUMA node that images arrive on, e.g. the network "
+            "card's (default: the input disk's node, else the GPU's)")
+      .metavar("NODE")
+      .scan<'i', int>();
+    parser.add_argument("--decompress-threads")
+      .help("Number of threads to decompress each bitshuffle-LZ4 image with. The "
+            "same as --task-threads one less than this.")
+      .default_value<uint32_t>(1)
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--batch")
+      .help("Number of consecutive images each thread reads at once")
       .default_value<uint32_t>(1)
       .metavar("NUM")
       .scan<'u', uint32_t>();
+    parser.add_argument("--readahead")
+      .help("Number of images past those being read to ask the OS to fetch early")
+      .default_value<uint32_t>(16)
+      .metavar("NUM")
+      .scan<'u', uint32_t>();
+    parser.add_argument("--cpu")
+      .help("Threshold on the CPU, fused with decompression, instead of the GPU")
+      .default_value(false)
+      .implicit_value(true);
     parser.add_argument("--validate")
       .help("Run DIALS standalone validation")
       .default_value(false)
@@ -302,11 +466,44 @@ int main(int argc, char **argv) {
       .metavar("S")
       .default_value<float>(30)
       .scan<'f', float>();
+    parser.add_argument("--refresh-interval")
+      .help("How often to check HDF5 files for new images, in milliseconds")
+      .metavar("MS")
+      .default_value<uint32_t>(20)
+      .scan<'u', uint32_t>();
     parser.add_argument("-fd", "--pipe_fd")
       .help("File descriptor for the pipe to output data through")
       .metavar("FD")
       .default_value<int>(-1)
       .scan<'i', int>();
+    parser.add_argument("--ordered")
+      .help("Send results through the pipe in image order, rather than as finished")
+      .default_value(false)
+      .implicit_value(true);
+    parser.add_argument("--reorder-window")
+      .help("With --ordered, the most results to hold back waiting for an earlier "
+            "image")
+      .metavar("NUM")
+      .default_value<uint32_t>(64)
+      .scan<'u', uint32_t>();
+    parser.add_argument("--latest-first")
+      .help("When falling behind, read the newest images that have arrived first, "
+            "and fill in the ones skipped afterwards. With more than one read "
+            "thread, the first only fills in.")
+      .default_value(false)
+      .implicit_value(true);
+    parser.add_argument("--latency-slo")
+      .help("Target time, in ms, from an image arriving to its result. When "
+            "falling too far behind to meet it, skip images, sending a "
+            "\"skipped\" result for each, and go back for them once caught up "
+            "(unless reading a stream, which can't keep them).")
+      .metavar("MS")
+      .scan<'f', float>();
+    parser.add_argument("--slo-sampling")
+      .help("Which image to keep out of each run skipped for --latency-slo: "
+            "\"stride\", the newest, or \"stratified\", one picked at random")
+      .metavar("MODE")
+      .default_value<std::string>("stride");
     parser.add_argument("-a", "--algorithm")
       .help("Dispersion algorithm to use")
       .metavar("ALGO")
@@ -326,11 +523,64 @@ int main(int argc, char **argv) {
       .metavar("λ")
       .scan<'f', float>();
     parser.add_argument("--detector").help("Detector geometry JSON").metavar("JSON");
+    parser.add_argument("--raw-shape")
+      .help("Read the input as raw uint16 images of this shape")
+      .metavar("SLOWxFAST");
+    parser.add_argument("--stats")
+      .help("Write the latency of each pipeline stage, as histograms, to this JSON "
+            "file at exit")
+      .metavar("FILE");
+    parser.add_argument("--stats-interval")
+      .help("With --stats, also rewrite the file this often while running")
+      .metavar("SECONDS")
+      .scan<'f', float>();
+    parser.add_argument("--trace")
+      .help("Record what every thread is doing, and write it to this file as a "
+            "Chrome trace, for viewing in Perfetto")
+      .metavar("FILE");
+    parser.add_argument("--serve")
+      .help("Run as a daemon, taking jobs as lines of JSON from this Unix socket. "
+            "Every other argument applies to each job.")
+      .metavar("SOCKET");
+    parser.add_argument("--no-mask-cache")
+      .help("Always build the mask from the source, rather than using or adding to "
+            "the cache in $FFS_MASK_CACHE")
+      .default_value(false)
+      .implicit_value(true);
 
-    auto args = parser.parse_args(argc, argv);
+    auto argv = std::vector<char *>{};
+    for (auto &argument : arguments) {
+        argv.push_back(const_cast<char *>(argument.c_str()));
+    }
+    // A job with bad arguments mustn't take the daemon down with it
+    if (warm.serving) {
+        parser.throw_on_error();
+    }
+    auto args = parser.parse_args(argv.size(), argv.data());
     bool do_validate = parser.get<bool>("validate");
     bool do_writeout = parser.get<bool>("writeout");
+    bool use_cpu_dispersion = parser.get<bool>("cpu");
     int pipe_fd = parser.get<int>("pipe_fd");
+    bool ordered_output = parser.get<bool>("ordered");
+    bool use_numa = parser.get<bool>("numa");
+    bool latest_first = parser.get<bool>("latest-first");
+    if (latest_first && ordered_output) {
+        print("Error: --latest-first can't be used with --ordered\n");
+        return 1;
+    }
+    std::optional<ImageScheduler::LatencyTarget> latency_target;
+    if (parser.is_used("latency-slo")) {
+        auto sampling = parser.get<std::string>("slo-sampling");
+        if (sampling != "stride" && sampling != "stratified") {
+            print("Error: --slo-sampling must be stride or stratified\n");
+            return 1;
+        }
+        latency_target = ImageScheduler::LatencyTarget{
+          std::chrono::duration<float, std::milli>(parser.get<float>("latency-slo")),
+          sampling == "stride" ? ImageScheduler::Sampling::stride
+                               : ImageScheduler::Sampling::stratified};
+    }
+    uint32_t reorder_window = parser.get<uint32_t>("reorder-window");
     float wait_timeout = parser.get<float>("timeout");
 
     float dmin = parser.get<float>("dmin");
@@ -338,48 +588,140 @@ int main(int argc, char **argv) {
 
     DispersionAlgorithm dispersion_algorithm(parser.get<std::string>("algorithm"));
     print("Algorithm: {}\n", styled(dispersion_algorithm.algorithm_str, fmt_green));
+    if (use_cpu_dispersion
+        && dispersion_algorithm.algorithm
+             != DispersionAlgorithm::Algorithm::DISPERSION) {
+        print("Error: --cpu only supports the dispersion algorithm\n");
+        return 1;
+    }
 
     uint32_t num_cpu_threads = parser.get<uint32_t>("threads");
     if (num_cpu_threads < 1) {
         print("Error: Thread count must be >= 1\n");
-        std::exit(1);
+        return 1;
     }
     uint32_t min_spot_size = parser.get<uint32_t>("min-spot-size");
+    uint32_t num_decompress_threads = parser.get<uint32_t>("decompress-threads");
+    if (num_decompress_threads < 1) {
+        print("Error: Decompression thread count must be >= 1\n");
+        return 1;
+    }
+    uint32_t num_task_threads = parser.is_used("task-threads")
+                                  ? parser.get<uint32_t>("task-threads")
+                                  : num_decompress_threads - 1;
+    // Each pipeline stage is sized separately, defaulting to --threads
+    auto stage_threads = [&](const std::string &name, uint32_t default_threads) {
+        uint32_t threads =
+          parser.is_used(name) ? parser.get<uint32_t>(name) : default_threads;
+        if (threads < 1) {
+            throw std::invalid_argument(format("--{} must be >= 1", name));
+        }
+        return threads;
+    };
+    uint32_t num_read_threads = stage_threads("read-threads", 1);
+    uint32_t num_decompress_workers =
+      stage_threads("decompress-workers", num_cpu_threads);
+    // A couple of streams are enough to overlap copies with kernels
+    uint32_t num_compute_threads =
+      stage_threads("compute-threads", std::min<uint32_t>(num_cpu_threads, 2));
+    uint32_t num_post_threads = stage_threads("post-threads", num_cpu_threads);
+    uint32_t queue_depth = stage_threads("queue-depth", 4);
+    uint32_t readahead = parser.get<uint32_t>("readahead");
+    uint32_t batch_size = parser.get<uint32_t>("batch");
+    if (batch_size < 1) {
+        print("Error: Batch size must be >= 1\n");
+        return 1;
+    }
+    // Every reader can hold a whole batch of frames while it waits for the
+    // images to arrive, so there must be enough for all of them at once
+    size_t min_pipeline_depth = num_read_threads * batch_size;
+    // By default, enough for every thread in every stage to be working on
+    // an image at once, so that a large --threads isn't left waiting for
+    // frames
+    size_t busy_pipeline_depth = min_pipeline_depth + num_decompress_workers
+                                 + num_compute_threads + num_post_threads + 1;
+    size_t pipeline_depth = parser.is_used("pipeline-depth")
+                              ? parser.get<uint32_t>("pipeline-depth")
+                              : std::max<size_t>(16, busy_pipeline_depth);
+    if (pipeline_depth < min_pipeline_depth) {
+        print("Error: --pipeline-depth must be >= --read-threads × --batch ({})\n",
+              min_pipeline_depth);
+        return 1;
+    }
 
     std::unique_ptr<Reader> reader_ptr;
 
+    bool is_stream = args.file.starts_with(stream_url_prefix);
+    if (latency_target && is_stream) {
+        // A stream's images are dropped once skipped, to free their buffers
+        latency_target->backfill = false;
+    }
+
     // Wait for read-readiness
     // Firstly: That the path exists at all
-    if (!std::filesystem::exists(args.file)) {
+    if (!args.file.empty() && !is_stream && !std::filesystem::exists(args.file)) {
         wait_for_ready_for_read(
           args.file,
           [](const std::string &s) { return std::filesystem::exists(s); },
           wait_timeout);
     }
-    if (std::filesystem::is_directory(args.file)) {
+    if (args.file.empty()) {
+        // --sample: Serve generated images, so that no data is needed
+        reader_ptr = std::make_unique<SyntheticRead>();
+    } else if (is_stream) {
+        auto socket_path = args.file.substr(stream_url_prefix.size());
+        wait_for_ready_for_read(
+          socket_path, is_ready_for_read<StreamRead>, wait_timeout);
+        // A buffer for each frame in flight. Frames only hold theirs until
+        // decompressed, so most are free for images arriving ahead of them.
+        reader_ptr = std::make_unique<StreamRead>(socket_path, pipeline_depth);
+    } else if (std::filesystem::is_directory(args.file)) {
         wait_for_ready_for_read(args.file, is_ready_for_read<SHMRead>, wait_timeout);
         reader_ptr = std::make_unique<SHMRead>(args.file);
+    } else if (args.file.ends_with(".json")) {
+        wait_for_ready_for_read(
+          args.file, is_ready_for_read<JungfrauRead>, wait_timeout);
+        reader_ptr = std::make_unique<JungfrauRead>(args.file);
+    } else if (args.file.ends_with(".npy")) {
+        wait_for_ready_for_read(args.file, is_ready_for_read<StackRead>, wait_timeout);
+        reader_ptr = std::make_unique<StackRead>(args.file);
+    } else if (parser.is_used("raw-shape")) {
+        wait_for_ready_for_read(args.file, is_ready_for_read<StackRead>, wait_timeout);
+        reader_ptr = std::make_unique<StackRead>(
+          args.file, parse_image_shape(parser.get<std::string>("raw-shape")));
     } else if (args.file.ends_with(".cbf")) {
         if (!parser.is_used("images")) {
             print("Error: CBF reading must specify --images\n");
-            std::exit(1);
+            return 1;
         }
         reader_ptr = std::make_unique<CBFRead>(args.file,
                                                parser.get<uint32_t>("images"),
                                                parser.get<uint32_t>("start-index"));
     } else {
         wait_for_ready_for_read(args.file, is_ready_for_read<H5Read>, wait_timeout);
-        reader_ptr = args.file.empty() ? std::make_unique<H5Read>()
-                                       : std::make_unique<H5Read>(args.file);
+        reader_ptr = std::make_unique<H5Read>(args.file);
     }
     // Bind this as a reference
     Reader &reader = *reader_ptr;
+    // Raw Jungfrau frames need converting with their reader's calibration
+    const JungfrauCalibration *jungfrau_calibration = nullptr;
+    if (auto jungfrau = dynamic_cast<JungfrauRead *>(reader_ptr.get())) {
+        jungfrau_calibration = &jungfrau->calibration();
+    }
 
     auto reader_mutex = std::mutex{};
 
     uint32_t num_images = parser.is_used("images") ? parser.get<uint32_t>("images")
                                                    : reader.get_number_of_images();
 
+    if (auto h5_reader = dynamic_cast<H5Read *>(reader_ptr.get())) {
+        // One thread follows the file as it's written, instead of every
+        // worker polling it, until every image we'll read is there
+        h5_reader->watch(
+          std::chrono::milliseconds(parser.get<uint32_t>("refresh-interval")),
+          num_images + parser.get<uint32_t>("start-index"));
+    }
+
     int height = reader.image_shape()[0];
     int width = reader.image_shape()[1];
     auto trusted_px_max = reader.get_trusted_range()[1];
@@ -442,19 +784,19 @@ int main(int argc, char **argv) {
             print(
               "Error: No beam center available from file. Please pass detector "
               "metadata with --distance.\n");
-            std::exit(1);
+            return 1;
         }
         if (!pixel_size) {
             print(
               "Error: No pixel size available from file. Please pass detector metadata "
               "with --distance.\n");
-            std::exit(1);
+            return 1;
         }
         if (!distance) {
             print(
               "Error: No detector distance available from file. Please pass metadata "
               "with --distance.\n");
-            std::exit(1);
+            return 1;
         }
         detector =
           detector_geometry(distance.value(), beam_center.value(), pixel_size.value());
@@ -475,7 +817,7 @@ int main(int argc, char **argv) {
             print(
               "Error: No wavelength provided. Please pass wavelength using: "
               "--wavelength\n");
-            std::exit(1);
+            return 1;
         }
         wavelength = wavelength_opt.value();
         printf("Got wavelength from file: %f Å\n", wavelength);
@@ -511,9 +853,60 @@ int main(int argc, char **argv) {
           blocks_dims.y,
           blocks_dims.z,
           num_blocks);
-    print("Running with {} CPU threads\n", num_cpu_threads);
 
-    auto mask = upload_mask(reader);
+    // The final mask only depends on where the reader's mask comes from,
+    // the detector and the geometry. Readers that can say where cheaply
+    // are keyed by that, so that a mask made earlier is found without
+    // reading theirs; the rest by their mask's contents.
+    auto mask_source = reader.get_mask_source();
+    auto mask_key = std::string{};
+    if (mask_source) {
+        mask_key = format("source={:016x}",
+                          MaskCache::content_hash(
+                            {reinterpret_cast<const uint8_t *>(mask_source->data()),
+                             mask_source->size()}));
+    } else if (auto source_mask = reader.get_mask()) {
+        mask_key = format("mask={:016x}", MaskCache::content_hash(*source_mask));
+    } else {
+        mask_key = "mask=none";
+    }
+    mask_key += format(";shape={}x{}", height, width);
+    bool resolution_filtering = dmin > 0 || dmax > 0;
+    if (resolution_filtering) {
+        mask_key += format(
+          ";wavelength={};pixel_size={},{};beam_center={},{};distance={};"
+          "dmin={};dmax={}",
+          wavelength,
+          detector.pixel_size_y,
+          detector.pixel_size_x,
+          detector.beam_center_y,
+          detector.beam_center_x,
+          detector.distance,
+          dmin,
+          dmax);
+    }
+    // A mask made by an earlier job is still on the GPU
+    auto warm_mask = warm.masks.find(mask_key);
+    bool mask_is_warm = warm_mask != warm.masks.end();
+    // Without resolution limits, the final mask is the reader's, so there's
+    // nothing worth keeping on disk
+    std::optional<MaskCache> mask_cache;
+    std::optional<MaskCache::Entry> cached_mask;
+    auto mask_cache_directory = MaskCache::default_directory();
+    if (!mask_is_warm && resolution_filtering && mask_source && mask_cache_directory
+        && !parser.get<bool>("no-mask-cache")) {
+        mask_cache.emplace(*mask_cache_directory);
+        cached_mask = mask_cache->load(mask_key, width, height);
+        if (cached_mask) {
+            print("Using cached mask {}\n", mask_cache->path_for(mask_key).string());
+        }
+    }
+
+    auto mask = mask_is_warm ? warm_mask->second
+                             : upload_mask(cached_mask ? cached_mask->mask()
+                                                       : reader.get_mask(),
+                                           width,
+                                           height);
 
     // Create a mask image for debugging
     if (do_writeout) {
@@ -538,8 +931,8 @@ int main(int argc, char **argv) {
     }
 
 #pragma region Resolution Filtering
-    // If set, apply resolution filtering
-    if (dmin > 0 || dmax > 0) {
+    // If set, apply resolution filtering. A cached mask already has it.
+    if (!cached_mask && !mask_is_warm && (dmin > 0 || dmax > 0)) {
         apply_resolution_filtering(
           mask, width, height, wavelength, detector, dmin, dmax);
         if (do_writeout) {
@@ -573,166 +966,659 @@ int main(int argc, char **argv) {
     }
 #pragma endregion Resolution Filtering
 
-    auto all_images_start_time = std::chrono::high_resolution_clock::now();
+    if (mask_cache && !cached_mask) {
+        auto final_mask = std::vector<uint8_t>(width * height);
+        CUDA_CHECK(cudaMemcpy2D(final_mask.data(),
+                                width,
+                                mask.get(),
+                                mask.pitch_bytes(),
+                                width,
+                                height,
+                                cudaMemcpyDeviceToHost));
+        mask_cache->store(mask_key, final_mask, width, height);
+    }
+    if (!mask_is_warm) {
+        // Masks are small, but don't keep them for every detector ever seen
+        if (warm.masks.size() >= 8) {
+            warm.masks.clear();
+        }
+        warm.masks.emplace(mask_key, mask);
+    }
 
-    auto next_image = std::atomic<int>(0);
-    auto completed_images = std::atomic<int>(0);
+    // The CPU thresholding needs the final mask on the host
+    auto host_mask = std::vector<uint8_t>{};
+    if (use_cpu_dispersion) {
+        host_mask.resize(width * height);
+        CUDA_CHECK(cudaMemcpy2D(host_mask.data(),
+                                width,
+                                mask.get(),
+                                mask.pitch_bytes(),
+                                width,
+                                height,
+                                cudaMemcpyDeviceToHost));
+        print("Thresholding on the CPU\n");
+    }
 
-    auto cpu_sync = std::barrier{num_cpu_threads};
+    auto scheduler = ImageScheduler(latest_first
+                                      ? ImageScheduler::Policy::latest_first
+                                      : ImageScheduler::Policy::in_order,
+                                    num_images,
+                                    batch_size,
+                                    latency_target);
+    // Images before this have been prefetched. Guarded by reader_mutex.
+    size_t prefetched_until = 0;
+    auto completed_images = std::atomic<int>(0);
 
     auto png_write_mutex = std::mutex{};
 
+    // Wall-clock time that any reader spent waiting for images to appear.
+    // Several readers can wait at once, so overlapping waits only count once.
     double time_waiting_for_images = 0.0;
+    auto waiting_mutex = std::mutex{};
+    int readers_waiting = 0;
+    auto waiting_since = std::chrono::steady_clock::time_point{};
+    auto start_waiting = [&]() {
+        std::scoped_lock lock(waiting_mutex);
+        if (readers_waiting++ == 0) {
+            waiting_since = std::chrono::steady_clock::now();
+        }
+    };
+    auto stop_waiting = [&]() {
+        std::scoped_lock lock(waiting_mutex);
+        if (--readers_waiting == 0) {
+            time_waiting_for_images +=
+              std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                            - waiting_since)
+                .count();
+        }
+    };
+
+    // Per-stage latencies, recorded as each frame is output
+    auto stage_stats = StageStats();
+    std::optional<std::filesystem::path> stats_path;
+    if (parser.is_used("stats")) {
+        stats_path = parser.get<std::string>("stats");
+    }
 
     // Create a PipeHandler object if the pipe file descriptor is provided
     std::unique_ptr<PipeHandler> pipeHandler = nullptr;
     if (pipe_fd != -1) {
-        pipeHandler = std::make_unique<PipeHandler>(pipe_fd);
+        pipeHandler = std::make_unique<PipeHandler>(pipe_fd, !warm.serving);
+    }
+    // With --ordered, results are held here until every earlier image's
+    // results have been sent
+    std::optional<ReorderBuffer<json>> reorder_buffer;
+    if (ordered_output) {
+        reorder_buffer.emplace(reorder_window);
     }
+    auto send_result = [&](const json &json_data) {
+        // Send the JSON data through the pipe
+        pipeHandler->sendData(json_data);
+    };
+    // Results come from the output thread, and "skipped" results for
+    // --latency-slo from the readers. A backfilled image's result replaces
+    // its "skipped" one.
+    auto result_mutex = std::mutex{};
+    auto emit_result = [&](size_t image_num, json json_data, bool backfill = false) {
+        std::scoped_lock lock(result_mutex);
+        if (reorder_buffer && backfill) {
+            reorder_buffer->replace(image_num, std::move(json_data), send_result);
+        } else if (reorder_buffer) {
+            reorder_buffer->add(image_num, std::move(json_data), send_result);
+        } else {
+            send_result(json_data);
+        }
+    };
 
-    // Spawn the reader threads
-    std::vector<std::jthread> threads;
-    for (int thread_id = 0; thread_id < num_cpu_threads; ++thread_id) {
-        threads.emplace_back([&, thread_id]() {
-            auto stop_token = global_stop.get_token();
-            CudaStream stream;
-
-            auto host_image = make_cuda_pinned_malloc<pixel_t>(width * height);
-            auto host_results = make_cuda_pinned_malloc<uint8_t>(width * height);
-            auto device_image = PitchedMalloc<pixel_t>(width, height);
-            auto device_results =
-              PitchedMalloc<uint8_t>(make_cuda_malloc<uint8_t[]>(mask.pitch * height),
-                                     width,
-                                     height,
-                                     mask.pitch);
-
-            // Buffer for reading compressed chunk data in
-            auto raw_chunk_buffer =
-              std::vector<uint8_t>(width * height * sizeof(pixel_t));
-
-            // Allocate buffers for DIALS-style extraction
-            auto px_coords = std::vector<int2>();
-            auto px_values = std::vector<pixel_t>();
-            auto px_kvals = std::vector<size_t>();
-
-            // Let all threads do setup tasks before reading starts
-            cpu_sync.arrive_and_wait();
-            CudaEvent start, copy, post, postcopy, end;
-
-            // Get the time the lastimage was received to avoid waiting for too long
-            auto last_image_received = std::chrono::high_resolution_clock::now();
-
-            while (!stop_token.stop_requested()) {
-                auto image_num = next_image.fetch_add(1);
-                if (image_num >= num_images) {
-                    break;
+#pragma region NUMA Placement
+    // With --numa, every thread gets a CPU of its own. Readers sit near
+    // where images arrive, and the rest near the GPU, which is where the
+    // frame buffers they share are allocated.
+    auto &topology = warm.topology;
+    auto layout = ThreadLayout(topology);
+    std::optional<int> gpu_node, io_node;
+    if (use_numa) {
+        char bus_id[32];
+        if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), args.device_index)
+            == cudaSuccess) {
+            gpu_node = Topology::node_of_pci_device(bus_id);
+        }
+        if (parser.is_used("io-node")) {
+            io_node = parser.get<int>("io-node");
+        } else if (!is_stream && !args.file.empty()) {
+            io_node = Topology::node_of_path(args.file);
+        }
+        if (!io_node) {
+            io_node = gpu_node;
+        }
+        // Compute threads are first choice for the GPU's node, since they
+        // drive every copy to and from it
+        if (!use_cpu_dispersion) {
+            layout.assign("compute", num_compute_threads, gpu_node);
+        }
+        layout.assign("read", num_read_threads, io_node);
+        layout.assign("decompress", num_decompress_workers, gpu_node);
+        layout.assign("post", num_post_threads, gpu_node);
+        layout.assign("output", 1, gpu_node);
+        layout.assign("task", num_task_threads, std::nullopt);
+
+        auto describe_node = [](std::optional<int> node) {
+            return node ? format("{}", *node) : std::string("unknown");
+        };
+        print("NUMA: {} nodes, GPU on node {}, input on node {}\n{}",
+              topology.nodes().size(),
+              describe_node(gpu_node),
+              describe_node(io_node),
+              layout.describe());
+    }
+#pragma endregion NUMA Placement
+
+    // Helpers that every stage hands the work within an image to: blocks
+    // to decompress, bands of rows to label, and images to write out and
+    // validate. Idle helpers steal from busy ones. Without any, the work
+    // all happens in the stage's own thread.
+    // Helpers are pinned as they start, so a warm pool keeps its layout.
+    if (!warm.task_pool || warm.task_pool->size() != num_task_threads) {
+        warm.task_pool.reset();
+        warm.task_pool = std::make_unique<ThreadPool>(
+          num_task_threads, [layout, use_numa](size_t index) {
+              if (use_numa) {
+                  layout.pin("task", index);
+              }
+          });
+    }
+    ThreadPool &task_pool = *warm.task_pool;
+
+    if (do_validate) {
+        // Validation compares against the reader's own mask, which might
+        // not have been read yet. Don't let the image threads race to it.
+        reader.get_mask();
+    }
+    const size_t image_pixels = static_cast<size_t>(width) * height;
+
+    // Every image in flight has a Frame, which holds all of its host
+    // buffers. There are as many as the pipeline depth, rather than one per
+    // thread. Each stage leases one from the stage before, and once output
+    // it goes back to be read into again.
+    size_t num_frames = pipeline_depth;
+    auto &frames = warm.frames;
+    auto free_frames = BoundedQueue<Frame *>(num_frames);
+    if (frames.size() != num_frames || warm.frame_shape != std::array{height, width}) {
+        auto allocation_start = std::chrono::high_resolution_clock::now();
+        frames.clear();
+        warm.frame_shape = {height, width};
+        auto allocate_frames = [&]() {
+            // The CUDA device is chosen per thread
+            cudaSetDevice(args.device_index);
+            for (size_t i = 0; i < num_frames; ++i) {
+                frames.push_back(std::make_unique<Frame>(width, height));
+            }
+        };
+        // Pages land on the node of the thread that first touches them
+        if (gpu_node) {
+            run_on_node(topology.node(*gpu_node), allocate_frames);
+        } else {
+            allocate_frames();
+        }
+        if (io_node && io_node != gpu_node) {
+            // Readers fill the raw buffers, so they're better off near them
+            run_on_node(topology.node(*io_node), [&]() {
+                for (auto &frame : frames) {
+                    frame->raw_buffer = std::vector<uint8_t>(frame->raw_buffer.size());
                 }
-                auto offset_image_num = image_num + parser.get<uint32_t>("start-index");
-                {
-                    // TODO:
-                    //  - Counting time like this does not work efficiently
-                    //    because it might not be the "next" image that
-                    //    gets the lock.
-
-                    // Lock so we don't duplicate wait count, and also
-                    // because we don't know if the HDF5 function is threadsafe
-                    std::scoped_lock lock(reader_mutex);
-                    auto swmr_wait_start_time =
-                      std::chrono::high_resolution_clock::now();
-
-                    // Check that our image is available and wait if not
-                    while (!reader.is_image_available(offset_image_num)
-                           && !stop_token.stop_requested()) {
-                        auto current_time = std::chrono::high_resolution_clock::now();
-                        auto elapsed_wait_time =
-                          std::chrono::duration_cast<std::chrono::duration<double>>(
-                            current_time - last_image_received)
-                            .count();
-
-                        if (elapsed_wait_time > wait_timeout) {
-                            print("Timeout waiting for image {}\n", offset_image_num);
-                            global_stop.request_stop();
-                            break;
-                        }
-
-                        // Sleep for a bit to avoid busy-waiting
-                        std::this_thread::sleep_for(100ms);
-                    }
+            });
+        }
+        print("Allocated {} frames ({:.2f} GB pinned) in {:.0f} ms\n",
+              num_frames,
+              num_frames * image_pixels * (sizeof(pixel_t) + sizeof(uint8_t)) / 1e9,
+              milliseconds_since(allocation_start));
+    }
+    for (auto &frame : frames) {
+        free_frames.push(frame.get());
+    }
 
-                    if (stop_token.stop_requested()) {
-                        break;
-                    }
+    // Each compute thread has its own stream and device buffers, so that
+    // one image's copies can overlap with another's kernel
+    auto compute_shape = std::array<size_t, 3>{
+      static_cast<size_t>(height), static_cast<size_t>(width), mask.pitch};
+    if (!use_cpu_dispersion
+        && (warm.compute_buffers.size() != num_compute_threads
+            || warm.compute_shape != compute_shape)) {
+        warm.compute_buffers.clear();
+        warm.compute_shape = compute_shape;
+        for (size_t i = 0; i < num_compute_threads; ++i) {
+            warm.compute_buffers.push_back(
+              std::make_unique<ComputeBuffers>(width, height, mask.pitch));
+        }
+    }
+    // The queues between stages. With --cpu, thresholding happens during
+    // decompression, so decompressed frames go straight to post-processing.
+    auto read_queue = BoundedQueue<Frame *>(queue_depth);
+    auto decompressed_queue = BoundedQueue<Frame *>(queue_depth);
+    auto computed_queue = BoundedQueue<Frame *>(queue_depth);
+    auto output_queue = BoundedQueue<Frame *>(queue_depth);
+    auto &decompress_output = use_cpu_dispersion ? computed_queue : decompressed_queue;
+
+    // On interruption, abandon everything still in flight. This run's stop
+    // is separate from the process's, so that a daemon can carry on with
+    // the next job.
+    auto run_stop = std::stop_source{};
+    std::stop_callback forward_interrupt(global_stop.get_token(),
+                                         [&]() { run_stop.request_stop(); });
+    auto stop_token = run_stop.get_token();
+    std::stop_callback close_queues(stop_token, [&]() {
+        for (auto queue : {&free_frames,
+                           &read_queue,
+                           &decompressed_queue,
+                           &computed_queue,
+                           &output_queue}) {
+            queue->close();
+        }
+    });
+    // On a timeout, only stop reading. Images already read still go through
+    // the rest of the pipeline, and their results are sent.
+    auto read_stop = std::stop_source{};
+    std::stop_callback forward_stop(stop_token, [&]() { read_stop.request_stop(); });
+    auto read_token = read_stop.get_token();
 
-                    // If the image is available, update the last image received time
-                    last_image_received = std::chrono::high_resolution_clock::now();
+    print(
+      "Pipeline threads: {} read, {} decompress, {} compute, {} post, {} shared "
+      "task; {} frames in flight\n",
+      num_read_threads,
+      num_decompress_workers,
+      use_cpu_dispersion ? 0 : num_compute_threads,
+      num_post_threads,
+      task_pool.size(),
+      num_frames);
 
-                    time_waiting_for_images +=
-                      std::chrono::duration_cast<std::chrono::duration<double>>(
-                        std::chrono::high_resolution_clock::now()
-                        - swmr_wait_start_time)
-                        .count();
-                }
-                // Sized buffer for the actual data read from file
-                std::span<uint8_t> buffer;
-                // Fetch the image data from the reader
-                while (true) {
-                    {
-                        std::scoped_lock lock(reader_mutex);
-                        buffer =
-                          reader.get_raw_chunk(offset_image_num, raw_chunk_buffer);
-                    }
-                    // /dev/shm we might not have an atomic write
-                    if (buffer.size() == 0) {
-                        print(fmt::runtime(
-                          "\033[1mRace Condition?!?? Got buffer size 0 for image "
-                          "{image_num}. "
-                          "Sleeping.\033[0m\n"));
-                        std::this_thread::sleep_for(100ms);
-                        continue;
-                    }
-                    break;
-                }
+    auto all_images_start_time = std::chrono::high_resolution_clock::now();
+    if (parser.is_used("trace")) {
+        start_tracing();
+    }
+
+    // With --stats-interval, keep the statistics file up to date as we go
+    std::jthread stats_writer;
+    if (stats_path && parser.is_used("stats-interval")) {
+        auto interval =
+          std::chrono::duration<float>(parser.get<float>("stats-interval"));
+        stats_writer = std::jthread([&, interval](std::stop_token stop) {
+            auto mutex = std::mutex{};
+            auto wake = std::condition_variable_any{};
+            std::unique_lock lock(mutex);
+            while (!wake.wait_for(lock, stop, interval, [] { return false; })
+                   && !stop.stop_requested()) {
+                stage_stats.write(*stats_path);
+            }
+        });
+    }
+
+    Pipeline pipeline([&](const std::string &stage, size_t index) {
+        if (use_numa) {
+            layout.pin(stage, index);
+        }
+    });
+
+#pragma region Reading
+    // Claim batches of images, wait for them to arrive, and read their raw
+    // chunks
+    pipeline.add_stage(
+      "read",
+      num_read_threads,
+      [&](size_t reader_index) {
+          // Get the time the lastimage was received to avoid waiting for too long
+          auto last_image_received = std::chrono::high_resolution_clock::now();
+          auto batch_frames = std::vector<Frame *>{};
+          auto raw_chunk_destinations = std::vector<std::span<uint8_t>>{};
+
+          // Latest first, one reader is kept for filling in skipped images
+          bool background = latest_first && num_read_threads > 1 && reader_index == 0;
+
+          while (!read_token.stop_requested()) {
+              // Take frames before claiming images, so that latest first
+              // picks the newest images at the moment they can be read
+              TraceSpan wait_for_frames("wait for frames");
+              while (batch_frames.size() < batch_size) {
+                  auto frame = free_frames.pop();
+                  if (!frame) {
+                      return;
+                  }
+                  batch_frames.push_back(*frame);
+              }
+              wait_for_frames.end();
+              if (read_token.stop_requested()) {
+                  return;
+              }
+              // The scheduler isn't locked while checking for images, as
+              // readers ask it where to prefetch to with reader_mutex held
+              auto claim = scheduler.claim(background, [&](size_t image) {
+                  std::scoped_lock lock(reader_mutex);
+                  return reader.is_image_available(
+                    image + parser.get<uint32_t>("start-index"));
+              });
+              if (!claim) {
+                  for (auto frame : batch_frames) {
+                      free_frames.push(frame);
+                  }
+                  return;
+              }
+              if (pipeHandler) {
+                  for (size_t image : claim->skipped) {
+                      emit_result(image,
+                                  {{"file", args.file},
+                                   {"file-number", image},
+                                   {"skipped", true}});
+                  }
+              }
+              if (latency_target && !latency_target->backfill) {
+                  for (size_t image : claim->skipped) {
+                      reader.release_chunk(image + parser.get<uint32_t>("start-index"));
+                  }
+              }
+              size_t first_image = claim->first;
+              size_t batch_images = claim->count;
+              auto offset_first_image =
+                first_image + parser.get<uint32_t>("start-index");
+              raw_chunk_destinations.clear();
+              for (size_t i = 0; i < batch_images; ++i) {
+                  batch_frames[i]->times = {};
+                  batch_frames[i]->backfill = claim->backfill;
+                  raw_chunk_destinations.emplace_back(batch_frames[i]->raw_buffer);
+              }
+
+              size_t batch_read = 0;
+              while (batch_read < batch_images) {
+                  bool incomplete_write = false;
+                  size_t batch_pushed = batch_read;
+                  {
+                      // Lock because we don't know if the HDF5 function is
+                      // threadsafe. Readers with a watcher are waited on
+                      // without the lock.
+                      std::unique_lock lock(reader_mutex, std::defer_lock);
+                      if (!reader.has_image_watcher()) {
+                          TraceSpan span("reader lock");
+                          lock.lock();
+                      }
+                      auto wait_start = FrameTimestamps::clock::now();
+                      size_t waiting_for = offset_first_image + batch_read;
+
+                      // Check that our next image is available and wait if not
+                      auto image_arrived = [&]() {
+                          if (reader.has_image_watcher()) {
+                              return reader.wait_for_image(waiting_for, 100ms);
+                          }
+                          if (reader.is_image_available(waiting_for)) {
+                              return true;
+                          }
+                          // Sleep for a bit to avoid busy-waiting
+                          std::this_thread::sleep_for(100ms);
+                          return false;
+                      };
+                      start_waiting();
+                      while (!image_arrived() && !read_token.stop_requested()) {
+                          auto current_time = std::chrono::high_resolution_clock::now();
+                          auto elapsed_wait_time =
+                            std::chrono::duration_cast<std::chrono::duration<double>>(
+                              current_time - last_image_received)
+                              .count();
+
+                          if (elapsed_wait_time > wait_timeout) {
+                              print("Timeout waiting for image {}\n", waiting_for);
+                              read_stop.request_stop();
+                              break;
+                          }
+                      }
+
+                      stop_waiting();
+                      auto available = FrameTimestamps::clock::now();
+                      if (read_token.stop_requested()) {
+                          return;
+                      }
+                      if (!lock.owns_lock()) {
+                          TraceSpan span("reader lock");
+                          lock.lock();
+                      }
+
+                      // The image is available, so reset the timeout
+                      last_image_received = std::chrono::high_resolution_clock::now();
+
+                      // Fetch as much of the rest of the batch as is there
+                      auto read_start = FrameTimestamps::clock::now();
+                      auto chunks = reader.get_raw_chunks(
+                        waiting_for,
+                        std::span{raw_chunk_destinations}.subspan(
+                          batch_read, batch_images - batch_read));
+                      auto read_end = FrameTimestamps::clock::now();
+                      size_t first_read = first_image + batch_read;
+                      record_trace_span(
+                        "wait for image", wait_start, available, first_read);
+                      record_trace_span("read", read_start, read_end, first_read);
+                      size_t chunks_read = 0;
+                      for (auto &chunk : chunks) {
+                          // /dev/shm we might not have an atomic write
+                          if (chunk.size() == 0) {
+                              print(
+                                "\033[1mRace Condition?!?? Got buffer size 0 for "
+                                "image {}. Sleeping.\033[0m\n",
+                                offset_first_image + batch_read);
+                              incomplete_write = true;
+                              break;
+                          }
+                          Frame &frame = *batch_frames[batch_read];
+                          frame.image_num = first_image + batch_read;
+                          frame.chunk = chunk;
+                          // Later images in the batch were already there
+                          // by the time the first one was
+                          frame.times.wait_start = wait_start;
+                          frame.times.available = available;
+                          frame.times.read_start = read_start;
+                          frame.times.read_end = read_end;
+                          ++batch_read;
+                          ++chunks_read;
+                      }
+                      // Keep the page cache to what's still to be read
+                      reader.release(waiting_for, chunks_read);
+                      if (readahead > 0) {
+                          // Fetch ahead of the images handed out so far
+                          size_t readahead_end = scheduler.next_in_order()
+                                                 + parser.get<uint32_t>("start-index")
+                                                 + readahead;
+                          size_t readahead_start =
+                            std::max(prefetched_until, waiting_for + chunks_read);
+                          if (readahead_start < readahead_end) {
+                              TraceSpan span("prefetch");
+                              reader.prefetch(readahead_start,
+                                              readahead_end - readahead_start);
+                              prefetched_until = readahead_end;
+                          }
+                      }
+                  }
+                  // Hand on what was read, outside the lock, in case the
+                  // decompression workers are behind and we have to wait
+                  for (; batch_pushed < batch_read; ++batch_pushed) {
+                      if (!read_queue.push(batch_frames[batch_pushed])) {
+                          return;
+                      }
+                  }
+                  if (incomplete_write) {
+                      std::this_thread::sleep_for(100ms);
+                  }
+              }
+              // Any frames left over are kept for the next batch
+              batch_frames.erase(batch_frames.begin(),
+                                 batch_frames.begin() + batch_images);
+          }
+      },
+      [&]() { read_queue.close(); });
+#pragma endregion Reading
 
 #pragma region Decompression
-                // Decompress this data, outside of the mutex.
-                // We do this here rather than in the reader, because we
-                // anticipate that we will want to eventually offload
-                // the decompression
-                switch (reader.get_raw_chunk_compression()) {
-                case Reader::ChunkCompression::BITSHUFFLE_LZ4:
-                    bshuf_decompress_lz4(
-                      buffer.data() + 12, host_image.get(), width * height, 2, 0);
-                    break;
-                case Reader::ChunkCompression::BYTE_OFFSET_32:
-                    // decompress_byte_offset<pixel_t>(buffer,
-                    //                                 {host_image.get(), width * height});
-                    decompress_byte_offset<pixel_t>(
-                      buffer,
-                      {host_image.get(),
-                       static_cast<std::span<short unsigned int>::size_type>(
-                         width * height)});
-                    // std::copy(buffer.begin(), buffer.end(), host_image.get());
-                    // std::exit(1);
-                    break;
-                }
-                start.record(stream);
-                // Copy the image to GPU
-                CUDA_CHECK(cudaMemcpy2DAsync(device_image.get(),
-                                             device_image.pitch_bytes(),
-                                             host_image.get(),
-                                             width * sizeof(pixel_t),
-                                             width * sizeof(pixel_t),
-                                             height,
-                                             cudaMemcpyHostToDevice,
-                                             stream));
-                copy.record(stream);
+    // Decompress this data, outside of the reader mutex.
+    // We do this here rather than in the reader, because we
+    // anticipate that we will want to eventually offload
+    // the decompression
+    // When thresholding on the CPU, that happens as part of
+    // decompression, so there is no separate copy or kernel.
+    pipeline.add_stage(
+      "decompress",
+      num_decompress_workers,
+      [&](size_t) {
+          std::optional<FusedDispersion> cpu_dispersion;
+          if (use_cpu_dispersion) {
+              cpu_dispersion.emplace(width, height, host_mask, trusted_px_max);
+          }
+          while (!stop_token.stop_requested()) {
+              auto next = read_queue.pop();
+              if (!next) {
+                  return;
+              }
+              Frame &frame = **next;
+              auto offset_image_num =
+                frame.image_num + parser.get<uint32_t>("start-index");
+              std::span<uint8_t> buffer = frame.chunk;
+              pixel_t *host_image = frame.host_image.get();
+              uint8_t *host_results = frame.host_results.get();
+              auto decompress_start = std::chrono::high_resolution_clock::now();
+              frame.times.decompress_start = FrameTimestamps::clock::now();
+
+              // The full image is only needed for inspecting the results
+              auto cpu_image_out = do_writeout || do_validate
+                                     ? std::span<pixel_t>{host_image, image_pixels}
+                                     : std::span<pixel_t>{};
+              // Where the pixels end up, for copying to the GPU
+              frame.image_data = host_image;
+              switch (reader.get_raw_chunk_compression()) {
+              case Reader::ChunkCompression::BITSHUFFLE_LZ4:
+                  if (cpu_dispersion) {
+                      if (!cpu_dispersion->process_bitshuffle_lz4(
+                            buffer, {host_results, image_pixels}, cpu_image_out)) {
+                          print("Error: Failed to decompress image {}\n",
+                                offset_image_num);
+                      }
+                  } else if (task_pool.size() > 0) {
+                      auto result = bshuf_decompress_lz4_parallel(
+                        task_pool,
+                        buffer,
+                        {reinterpret_cast<uint8_t *>(host_image),
+                         width * height * sizeof(pixel_t)},
+                        sizeof(pixel_t));
+                      if (result < 0) {
+                          print("Error: Failed to decompress image {}\n",
+                                offset_image_num);
+                      }
+                  } else {
+                      bshuf_decompress_lz4(
+                        buffer.data() + 12, host_image, width * height, 2, 0);
+                  }
+                  break;
+              case Reader::ChunkCompression::BYTE_OFFSET_32:
+                  decompress_byte_offset<pixel_t>(buffer, {host_image, image_pixels});
+                  if (cpu_dispersion) {
+                      cpu_dispersion->process_image({host_image, image_pixels},
+                                                    {host_results, image_pixels});
+                  }
+                  break;
+              case Reader::ChunkCompression::JUNGFRAU_RAW:
+                  // Straight from raw frame to photon counts in the input buffer
+                  jungfrau_calibration->convert(
+                    {reinterpret_cast<const uint16_t *>(buffer.data()),
+                     buffer.size() / sizeof(uint16_t)},
+                    {host_image, image_pixels});
+                  if (cpu_dispersion) {
+                      cpu_dispersion->process_image({host_image, image_pixels},
+                                                    {host_results, image_pixels});
+                  }
+                  break;
+              case Reader::ChunkCompression::NONE:
+                  // Use the pixels where the reader has them. They're only
+                  // copied if the whole image is inspected afterwards.
+                  frame.image_data = reinterpret_cast<const pixel_t *>(buffer.data());
+                  if (!cpu_image_out.empty()) {
+                      std::copy(frame.image_data,
+                                frame.image_data + image_pixels,
+                                cpu_image_out.begin());
+                  }
+                  if (cpu_dispersion) {
+                      cpu_dispersion->process_image({frame.image_data, image_pixels},
+                                                    {host_results, image_pixels});
+                  }
+                  break;
+              }
+              if (cpu_dispersion) {
+                  // There's no copy, so thresholding is all the kernel time
+                  frame.copy_time = 0;
+                  frame.kernel_time = milliseconds_since(decompress_start);
+                  frame.post_copy_time = 0;
+              }
+              // Unless the pixels are still being used where they were read,
+              // the reader can have its memory back
+              if (frame.image_data == host_image) {
+                  reader.release_chunk(offset_image_num);
+              }
+              frame.times.decompress_end = FrameTimestamps::clock::now();
+              record_trace_span("decompress",
+                                frame.times.decompress_start,
+                                frame.times.decompress_end,
+                                frame.image_num);
+              if (!decompress_output.push(&frame)) {
+                  return;
+              }
+          }
+      },
+      [&]() { decompress_output.close(); });
 #pragma endregion Decompression
 
 #pragma region Spotfinding
-                // When done, launch the spotfind kernel
-                switch (dispersion_algorithm.algorithm) {
-                case DispersionAlgorithm::Algorithm::DISPERSION:
-                    call_do_spotfinding_dispersion(blocks_dims,
+    if (!use_cpu_dispersion) {
+        pipeline.add_stage(
+          "compute",
+          num_compute_threads,
+          [&](size_t index) {
+              // The CUDA device is chosen per thread
+              cudaSetDevice(args.device_index);
+              auto &buffers = *warm.compute_buffers[index];
+              auto &stream = buffers.stream;
+              auto &device_image = buffers.device_image;
+              auto &device_results = buffers.device_results;
+              auto &start = buffers.start;
+              auto &copy = buffers.copy;
+              auto &post = buffers.post;
+              auto &postcopy = buffers.postcopy;
+
+              while (!stop_token.stop_requested()) {
+                  auto next = decompressed_queue.pop();
+                  if (!next) {
+                      return;
+                  }
+                  Frame &frame = **next;
+                  frame.times.compute_start = FrameTimestamps::clock::now();
+                  start.record(stream);
+                  // Copy the image to GPU
+                  CUDA_CHECK(cudaMemcpy2DAsync(device_image.get(),
+                                               device_image.pitch_bytes(),
+                                               frame.image_data,
+                                               width * sizeof(pixel_t),
+                                               width * sizeof(pixel_t),
+                                               height,
+                                               cudaMemcpyHostToDevice,
+                                               stream));
+                  copy.record(stream);
+
+                  // When done, launch the spotfind kernel
+                  switch (dispersion_algorithm.algorithm) {
+                  case DispersionAlgorithm::Algorithm::DISPERSION:
+                      call_do_spotfinding_dispersion(blocks_dims,
+                                                     gpu_thread_block_size,
+                                                     0,
+                                                     stream,
+                                                     device_image,
+                                                     mask,
+                                                     width,
+                                                     height,
+                                                     trusted_px_max,
+                                                     &device_results);
+                      break;
+                  case DispersionAlgorithm::Algorithm::DISPERSION_EXTENDED:
+                      call_do_spotfinding_extended(blocks_dims,
                                                    gpu_thread_block_size,
                                                    0,
                                                    stream,
@@ -741,295 +1627,307 @@ int main(int argc, char **argv) {
                                                    width,
                                                    height,
                                                    trusted_px_max,
-                                                   &device_results);
-                    break;
-                case DispersionAlgorithm::Algorithm::DISPERSION_EXTENDED:
-                    call_do_spotfinding_extended(blocks_dims,
-                                                 gpu_thread_block_size,
-                                                 0,
-                                                 stream,
-                                                 device_image,
-                                                 mask,
-                                                 width,
-                                                 height,
-                                                 trusted_px_max,
-                                                 &device_results,
-                                                 do_writeout);
-                    break;
-                }
-                post.record(stream);
-
-                // Copy the results buffer back to the CPU
-                CUDA_CHECK(cudaMemcpy2DAsync(host_results.get(),
-                                             width * sizeof(uint8_t),
-                                             device_results.get(),
-                                             device_results.pitch_bytes(),
-                                             width * sizeof(uint8_t),
-                                             height,
-                                             cudaMemcpyDeviceToHost,
-                                             stream));
-                postcopy.record(stream);
-                // Now, wait for stream to finish
-                CUDA_CHECK(cudaStreamSynchronize(stream));
+                                                   &device_results,
+                                                   do_writeout);
+                      break;
+                  }
+                  post.record(stream);
+
+                  // Copy the results buffer back to the CPU
+                  CUDA_CHECK(cudaMemcpy2DAsync(frame.host_results.get(),
+                                               width * sizeof(uint8_t),
+                                               device_results.get(),
+                                               device_results.pitch_bytes(),
+                                               width * sizeof(uint8_t),
+                                               height,
+                                               cudaMemcpyDeviceToHost,
+                                               stream));
+                  postcopy.record(stream);
+                  // Now, wait for stream to finish
+                  CUDA_CHECK(cudaStreamSynchronize(stream));
+
+                  frame.copy_time = copy.elapsed_time(start);
+                  frame.kernel_time = post.elapsed_time(start);
+                  frame.post_copy_time = postcopy.elapsed_time(post);
+                  frame.times.compute_end = FrameTimestamps::clock::now();
+                  record_trace_span("compute",
+                                    frame.times.compute_start,
+                                    frame.times.compute_end,
+                                    frame.image_num);
+                  if (!computed_queue.push(&frame)) {
+                      return;
+                  }
+              }
+          },
+          [&]() { computed_queue.close(); });
+    }
 #pragma endregion Spotfinding
 
 #pragma region Connected Components
-                // Manually reproduce what the DIALS connected components does
-                // Start with the behaviour of the PixelList class:
-                size_t num_strong_pixels = 0;
-                size_t num_strong_pixels_filtered = 0;
-                px_values.clear();
-                px_coords.clear();
-                px_kvals.clear();
-
-                for (int y = 0, k = 0; y < height; ++y) {
-                    for (int x = 0; x < width; ++x, ++k) {
-                        if (host_results[k]) {
-                            px_coords.emplace_back(x, y);
-                            px_values.push_back(host_image[k]);
-                            px_kvals.push_back(k);
-                            ++num_strong_pixels;
-                        }
-                    }
-                }
-
-                auto graph =
-                  boost::adjacency_list<boost::vecS, boost::vecS, boost::undirectedS>{
-                    px_values.size()};
-
-                // Index for next pixel to search when looking for pixels
-                // below the current one. This will only ever increase, because
-                // we are guaranteed to always look for one after the last found
-                // pixel.
-                int idx_pixel_below = 1;
-
-                for (int i = 0; i < static_cast<int>(px_coords.size()) - 1; ++i) {
-                    auto coord = px_coords[i];
-                    auto coord_right = int2{coord.x + 1, coord.y};
-                    auto k = px_kvals[i];
-
-                    if (px_coords[i + 1] == coord_right) {
-                        // Since we generate strong pixels coordinates horizontally,
-                        // if there is a pixel to the right then it is guaranteed
-                        // to be the next one in the list. Connect these.
-                        boost::add_edge(i, i + 1, graph);
-                    }
-                    // Now, check the pixel directly below this one. We need to scan
-                    // to find it, because _if_ there is a matching strong pixel,
-                    // then we don't know how far ahead it is in the coordinates array
-                    if (coord.y < height - 1) {
-                        auto coord_below = int2{coord.x, coord.y + 1};
-                        auto k_below = k + width;
-                        // int idx = i + 1;
-                        while (idx_pixel_below < px_coords.size() - 1
-                               && px_kvals[idx_pixel_below] < k_below) {
-                            ++idx_pixel_below;
-                        }
-                        // Either we've got the pixel below, past that - or the
-                        // last pixel in the coordinate set.
-                        if (px_coords[idx_pixel_below] == coord_below) {
-                            boost::add_edge(i, idx_pixel_below, graph);
-                        }
-                    }
-                }
-                auto labels = std::vector<int>(boost::num_vertices(graph));
-                auto num_labels = boost::connected_components(graph, labels.data());
-
-                auto boxes = std::vector<Reflection>(num_labels, {width, height, 0, 0});
-
-                assert(labels.size() == px_coords.size());
-                for (int i = 0; i < labels.size(); ++i) {
-                    auto label = labels[i];
-                    auto coord = px_coords[i];
-                    Reflection &box = boxes[label];
-                    box.l = std::min(box.l, coord.x);
-                    box.r = std::max(box.r, coord.x);
-                    box.t = std::min(box.t, coord.y);
-                    box.b = std::max(box.b, coord.y);
-                    box.num_pixels += 1;
-                }
-
-                if (min_spot_size > 0) {
-                    std::vector<Reflection> filtered_boxes;
-                    for (auto &box : boxes) {
-                        if (box.num_pixels >= min_spot_size) {
-                            filtered_boxes.emplace_back(box);
-                            num_strong_pixels_filtered += box.num_pixels;
-                        }
-                    }
-                    boxes = std::move(filtered_boxes);
-
-                    // Print out shoebox details for debugging
-                    // for (auto &box : boxes) {
-                    //     // Print the shoebox details
-                    //     print("Shoebox: ({:3d}, {:3d}) - ({:3d}, {:3d})\n",
-                    //           box.l,
-                    //           box.t,
-                    //           box.r,
-                    //           box.b);
-                    // }
-                } else {
-                    num_strong_pixels_filtered = num_strong_pixels;
-                }
-                end.record(stream);
-                // Now, wait for stream to finish
-                CUDA_CHECK(cudaStreamSynchronize(stream));
-
-                if (do_writeout) {
-                    // Build an image buffer
-                    auto buffer =
-                      std::vector<std::array<uint8_t, 3>>(width * height, {0, 0, 0});
-                    constexpr std::array<uint8_t, 3> color_pixel{255, 0, 0};
-
-                    for (int y = 0, k = 0; y < height; ++y) {
-                        for (int x = 0; x < width; ++x, ++k) {
-                            uint8_t graysc_value = std::max(
-                              0.0f, 255.99f - static_cast<float>(host_image[k]) * 10);
-                            buffer[k] = {graysc_value, graysc_value, graysc_value};
-                        }
-                    }
-                    // Go over each shoebox and write a square
-                    // for (auto box : boxes) {
-                    for (int i = 0; i < boxes.size(); ++i) {
-                        auto &box = boxes[i];
-                        constexpr std::array<uint8_t, 3> color_shoebox{0, 0, 255};
-
-                        // edgeMin/edgeMax define how thick the border is
-                        constexpr int edgeMin = 5, edgeMax = 7;
-                        for (int edge = edgeMin; edge <= edgeMax; ++edge) {
-                            for (int x = box.l - edge; x <= box.r + edge; ++x) {
-                                buffer[width * (box.t - edge) + x] = color_shoebox;
-                                buffer[width * (box.b + edge) + x] = color_shoebox;
-                            }
-                            for (int y = box.t - edge; y <= box.b + edge; ++y) {
-                                buffer[width * y + box.l - edge] = color_shoebox;
-                                buffer[width * y + box.r + edge] = color_shoebox;
-                            }
-                        }
-                    }
-                    // Go over everything again, so that strong spots are visible over the boxes
-                    for (int y = 0, k = 0; y < height; ++y) {
-                        for (int x = 0; x < width; ++x, ++k) {
-                            if (host_results[k]) {
-                                buffer[k] = color_pixel;
-                            }
-                        }
-                    }
-                    lodepng::encode(format("image_{:05d}.png", image_num),
-                                    reinterpret_cast<uint8_t *>(buffer.data()),
-                                    width,
-                                    height,
-                                    LCT_RGB);
-                    // Also write a list of pixels out here
-                    auto out =
-                      fmt::output_file(fmt::format("pixels_{:05d}.txt", image_num));
-                    for (int y = 0, k = 0; y < height; ++y) {
-                        for (int x = 0; x < width; ++x, ++k) {
-                            if (host_results[k]) {
-                                out.print("{:4d}, {:4d}\n", x, y);
-                            }
-                        }
-                    }
-                }
-
-                // Check if pipeHandler was initialized
-                if (pipeHandler != nullptr) {
-                    // Create a JSON object to store the data
-                    json json_data = {{"num_strong_pixels", num_strong_pixels},
-                                      {"file", args.file},
-                                      {"file-number", image_num},
-                                      {"n_spots_total", boxes.size()}};
-                    // Send the JSON data through the pipe
-                    pipeHandler->sendData(json_data);
-                }
+    pipeline.add_stage(
+      "post",
+      num_post_threads,
+      [&](size_t thread_id) {
+          while (!stop_token.stop_requested()) {
+              auto next = computed_queue.pop();
+              if (!next) {
+                  return;
+              }
+              Frame &frame = **next;
+              auto image_num = static_cast<int>(frame.image_num);
+              const pixel_t *host_image = frame.host_image.get();
+              const uint8_t *host_results = frame.host_results.get();
+              auto post_start = std::chrono::high_resolution_clock::now();
+              frame.times.label_start = FrameTimestamps::clock::now();
+
+              // Reproduce what the DIALS connected components does, in
+              // bands of rows shared out over the task pool
+              auto boxes = find_reflections(
+                {host_results, image_pixels}, width, height, task_pool);
+              size_t num_strong_pixels = 0;
+              size_t num_strong_pixels_filtered = 0;
+              for (auto &box : boxes) {
+                  num_strong_pixels += box.num_pixels;
+              }
+
+              if (min_spot_size > 0) {
+                  std::vector<Reflection> filtered_boxes;
+                  for (auto &box : boxes) {
+                      if (box.num_pixels >= min_spot_size) {
+                          filtered_boxes.emplace_back(box);
+                          num_strong_pixels_filtered += box.num_pixels;
+                      }
+                  }
+                  boxes = std::move(filtered_boxes);
+
+                  // Print out shoebox details for debugging
+                  // for (auto &box : boxes) {
+                  //     // Print the shoebox details
+                  //     print("Shoebox: ({:3d}, {:3d}) - ({:3d}, {:3d})\n",
+                  //           box.l,
+                  //           box.t,
+                  //           box.r,
+                  //           box.b);
+                  // }
+              } else {
+                  num_strong_pixels_filtered = num_strong_pixels;
+              }
+              frame.post_time = milliseconds_since(post_start);
+              frame.times.label_end = FrameTimestamps::clock::now();
+              record_trace_span("label",
+                                frame.times.label_start,
+                                frame.times.label_end,
+                                frame.image_num);
+
+              if (do_writeout) {
+                  // Build an image buffer
+                  auto buffer =
+                    std::vector<std::array<uint8_t, 3>>(width * height, {0, 0, 0});
+                  constexpr std::array<uint8_t, 3> color_pixel{255, 0, 0};
+
+                  for (int y = 0, k = 0; y < height; ++y) {
+                      for (int x = 0; x < width; ++x, ++k) {
+                          uint8_t graysc_value = std::max(
+                            0.0f, 255.99f - static_cast<float>(host_image[k]) * 10);
+                          buffer[k] = {graysc_value, graysc_value, graysc_value};
+                      }
+                  }
+                  // Go over each shoebox and write a square
+                  // for (auto box : boxes) {
+                  for (int i = 0; i < boxes.size(); ++i) {
+                      auto &box = boxes[i];
+                      constexpr std::array<uint8_t, 3> color_shoebox{0, 0, 255};
+
+                      // edgeMin/edgeMax define how thick the border is
+                      constexpr int edgeMin = 5, edgeMax = 7;
+                      for (int edge = edgeMin; edge <= edgeMax; ++edge) {
+                          for (int x = box.l - edge; x <= box.r + edge; ++x) {
+                              buffer[width * (box.t - edge) + x] = color_shoebox;
+                              buffer[width * (box.b + edge) + x] = color_shoebox;
+                          }
+                          for (int y = box.t - edge; y <= box.b + edge; ++y) {
+                              buffer[width * y + box.l - edge] = color_shoebox;
+                              buffer[width * y + box.r + edge] = color_shoebox;
+                          }
+                      }
+                  }
+                  // Go over everything again, so that strong spots are visible
+                  // over the boxes, and keep a list of them
+                  auto strong_pixels = std::vector<int2>();
+                  for (int y = 0, k = 0; y < height; ++y) {
+                      for (int x = 0; x < width; ++x, ++k) {
+                          if (host_results[k]) {
+                              buffer[k] = color_pixel;
+                              strong_pixels.emplace_back(x, y);
+                          }
+                      }
+                  }
+                  // Encoding and writing only needs our copies, so can
+                  // happen while this frame is reused
+                  task_pool.submit([=, buffer = std::move(buffer)]() {
+                      TraceSpan span("write image", image_num);
+                      lodepng::encode(format("image_{:05d}.png", image_num),
+                                      reinterpret_cast<const uint8_t *>(buffer.data()),
+                                      width,
+                                      height,
+                                      LCT_RGB);
+                      // Also write a list of pixels out here
+                      auto out =
+                        fmt::output_file(fmt::format("pixels_{:05d}.txt", image_num));
+                      for (auto &pixel : strong_pixels) {
+                          out.print("{:4d}, {:4d}\n", pixel.x, pixel.y);
+                      }
+                  });
+              }
 #pragma endregion Connected Components
 
 #pragma region Validation
-                if (do_validate) {
-                    // Count the number of pixels
-                    size_t num_strong_pixels = 0;
-                    for (int y = 0; y < height; ++y) {
-                        for (int x = 0; x < width; ++x) {
-                            if (host_results[x + width * y]) {
-                                ++num_strong_pixels;
-                            }
-                        }
-                    }
-                    auto spotfinder = StandaloneSpotfinder(width, height);
-                    // Read the image into a vector
-                    auto converted_image = std::vector<double>{
-                      host_image.get(), host_image.get() + width * height};
-                    auto dials_strong = spotfinder.standard_dispersion(
-                      converted_image,
-                      reader.get_mask().value_or(std::span<uint8_t>{}));
-                    size_t mismatch_x = 0, mismatch_y = 0;
-                    bool validation_matches = compare_results(dials_strong.data(),
-                                                              width,
-                                                              host_results.get(),
-                                                              width,
-                                                              width,
-                                                              height,
-                                                              &mismatch_x,
-                                                              &mismatch_y);
-                    if (validation_matches) {
-                        print(
-                          "Thread {:2d}, Image {:4d}: Compared: \033[32mMatch {} "
-                          "px\033[0m\n",
-                          thread_id,
-                          image_num,
-                          num_strong_pixels);
-                    } else {
-                        print(
-                          "Thread {:2d}, Image {:4d}: Compared: "
-                          "\033[1;31mMismatch ({} px from kernel)\033[0m\n",
-                          thread_id,
-                          image_num,
-                          num_strong_pixels);
-                    }
+              if (do_validate) {
+                  // Read the image into a vector
+                  auto converted_image =
+                    std::vector<double>{host_image, host_image + width * height};
+                  auto results =
+                    std::vector<uint8_t>{host_results, host_results + width * height};
+                  // The slow DIALS spotfinding runs as a task of its own
+                  task_pool.submit([=,
+                                    &reader,
+                                    converted_image = std::move(converted_image),
+                                    results = std::move(results)]() {
+                      TraceSpan span("validate", image_num);
+                      // Count the number of pixels
+                      size_t num_strong_pixels = std::ranges::count_if(
+                        results, [](uint8_t strong) { return strong != 0; });
+                      auto spotfinder = StandaloneSpotfinder(width, height);
+                      auto dials_strong = spotfinder.standard_dispersion(
+                        converted_image,
+                        reader.get_mask().value_or(std::span<uint8_t>{}));
+                      size_t mismatch_x = 0, mismatch_y = 0;
+                      bool validation_matches = compare_results(dials_strong.data(),
+                                                                width,
+                                                                results.data(),
+                                                                width,
+                                                                width,
+                                                                height,
+                                                                &mismatch_x,
+                                                                &mismatch_y);
+                      if (validation_matches) {
+                          print(
+                            "Thread {:2d}, Image {:4d}: Compared: \033[32mMatch {} "
+                            "px\033[0m\n",
+                            thread_id,
+                            image_num,
+                            num_strong_pixels);
+                      } else {
+                          print(
+                            "Thread {:2d}, Image {:4d}: Compared: "
+                            "\033[1;31mMismatch ({} px from kernel)\033[0m\n",
+                            thread_id,
+                            image_num,
+                            num_strong_pixels);
+                      }
+                  });
+              }
+#pragma endregion Validation
+              frame.num_strong_pixels = num_strong_pixels;
+              frame.num_strong_pixels_filtered = num_strong_pixels_filtered;
+              frame.boxes = std::move(boxes);
+              frame.post_thread = thread_id;
+              if (!output_queue.push(&frame)) {
+                  return;
+              }
+          }
+      },
+      [&]() { output_queue.close(); });
+
+#pragma region Output
+    // One thread sends out results, then hands the frames back to be reused
+    pipeline.add_stage("output", 1, [&](size_t) {
+        while (!stop_token.stop_requested()) {
+            auto next = output_queue.pop();
+            if (!next) {
+                break;
+            }
+            Frame &frame = **next;
+            auto image_num = static_cast<int>(frame.image_num);
+            TraceSpan span("output", image_num);
+
+            // Check if pipeHandler was initialized
+            if (pipeHandler != nullptr) {
+                // Create a JSON object to store the data
+                json json_data = {{"num_strong_pixels", frame.num_strong_pixels},
+                                  {"file", args.file},
+                                  {"file-number", image_num},
+                                  {"n_spots_total", frame.boxes.size()}};
+                // Replaces the "skipped" result sent earlier
+                if (frame.backfill) {
+                    json_data["backfill"] = true;
+                }
+                emit_result(frame.image_num, std::move(json_data), frame.backfill);
+            }
 
+            if (!do_validate) {
+                if (num_cpu_threads == 1) {
+                    float total_time =
+                      frame.kernel_time + frame.post_copy_time + frame.post_time;
+                    print(
+                      "Thread {:2d} finished image {:4d}\n"
+                      "       Copy: {:5.1f} ms\n"
+                      "     Kernel: {:5.1f} ms\n"
+                      "  Post Copy: {:5.1f} ms\n"
+                      "       Post: {:5.1f} ms\n"
+                      "             ════════\n"
+                      "     Total:  {:5.1f} ms ({:.1f} GBps)\n"
+                      "    {} strong pixels\n"
+                      "    {} filtered reflections ({} pixels)\n",
+                      frame.post_thread,
+                      image_num,
+                      frame.copy_time,
+                      frame.kernel_time,
+                      frame.post_copy_time,
+                      frame.post_time,
+                      total_time,
+                      GBps<pixel_t>(total_time, width * height),
+                      bold(frame.num_strong_pixels),
+                      bold(frame.boxes.size()),
+                      bold(frame.num_strong_pixels_filtered));
                 } else {
-                    if (num_cpu_threads == 1) {
-                        print(
-                          "Thread {:2d} finished image {:4d}\n"
-                          "       Copy: {:5.1f} ms\n"
-                          "     Kernel: {:5.1f} ms\n"
-                          "  Post Copy: {:5.1f} ms\n"
-                          "       Post: {:5.1f} ms\n"
-                          "             ════════\n"
-                          "     Total:  {:5.1f} ms ({:.1f} GBps)\n"
-                          "    {} strong pixels\n"
-                          "    {} filtered reflections ({} pixels)\n",
-                          thread_id,
-                          image_num,
-                          copy.elapsed_time(start),
-                          post.elapsed_time(start),
-                          postcopy.elapsed_time(post),
-                          end.elapsed_time(postcopy),
-                          end.elapsed_time(start),
-                          GBps<pixel_t>(end.elapsed_time(start), width * height),
-                          bold(num_strong_pixels),
-                          bold(boxes.size()),
-                          bold(num_strong_pixels_filtered));
-                    } else {
-                        print(
-                          "Thread {:2d} finished image {:4d} with {:5d} strong pixels, "
-                          "{:4d} filtered reflections ({} pixels)\n",
-                          thread_id,
-                          image_num,
-                          num_strong_pixels,
-                          boxes.size(),
-                          num_strong_pixels_filtered);
-                    }
+                    print(
+                      "Thread {:2d} finished image {:4d} with {:5d} strong pixels, "
+                      "{:4d} filtered reflections ({} pixels)\n",
+                      frame.post_thread,
+                      image_num,
+                      frame.num_strong_pixels,
+                      frame.boxes.size(),
+                      frame.num_strong_pixels_filtered);
                 }
-#pragma endregion Validation
-                // auto image_num = next_image.fetch_add(1);
-                completed_images += 1;
             }
-        });
-    }
-    // For now, just wait on all threads to finish
-    for (auto &thread : threads) {
-        thread.join();
+            if (frame.image_data != frame.host_image.get()) {
+                // Finished with the pixels, which were used where they were read
+                reader.release_chunk(frame.image_num
+                                     + parser.get<uint32_t>("start-index"));
+            }
+            frame.times.emitted = FrameTimestamps::clock::now();
+            stage_stats.record(frame.times);
+            scheduler.finished();
+            completed_images += 1;
+            if (!free_frames.push(&frame)) {
+                break;
+            }
+        }
+        // Anything still held is waiting on images that never came
+        std::scoped_lock lock(result_mutex);
+        if (reorder_buffer) {
+            reorder_buffer->flush(send_result);
+        }
+    });
+#pragma endregion Output
+
+    pipeline.join();
+    // Writing out and validation can still be going on
+    task_pool.wait_idle();
+    if (stats_writer.joinable()) {
+        stats_writer.request_stop();
+        stats_writer.join();
     }
 
     float total_time =
@@ -1047,6 +1945,42 @@ int main(int argc, char **argv) {
       completed_images / total_time,
       width,
       height);
+    if (auto cache_stats = reader.get_cache_stats();
+        cache_stats && cache_stats->reads > 0) {
+        print("Chunks already in the page cache: {} / {} ({:.1f}%)\n",
+              cache_stats->hits,
+              cache_stats->reads,
+              100.0 * cache_stats->hits / cache_stats->reads);
+    }
+    auto scheduler_stats = scheduler.stats();
+    if (latest_first) {
+        print("Latest first: {} images read ahead of their turn, {} filled in after\n",
+              scheduler_stats.newest,
+              scheduler_stats.filled_in);
+    }
+    if (latency_target) {
+        print("Latency SLO: {} images skipped, {} of them read afterwards\n",
+              scheduler_stats.skipped,
+              scheduler_stats.backfilled);
+    }
+    if (reorder_buffer && reorder_buffer->stats().released > 0) {
+        auto &reorder_stats = reorder_buffer->stats();
+        print(
+          "Results held back to keep them in order: {:.1f} ms mean, {:.1f} ms max "
+          "({} sent out of order)\n",
+          reorder_stats.total_wait / reorder_stats.released,
+          reorder_stats.max_wait,
+          reorder_stats.out_of_order);
+    }
+    if (parser.is_used("trace")) {
+        auto trace_path = parser.get<std::string>("trace");
+        write_trace(trace_path);
+        print("Trace written to {}\n", trace_path);
+    }
+    if (stats_path) {
+        stage_stats.write(*stats_path);
+        print("Stage latencies written to {}\n", stats_path->string());
+    }
     if (time_waiting_for_images < 10) {
         print("Total time waiting for images to appear: {:.0f} ms\n",
               time_waiting_for_images * 1000);
@@ -1054,4 +1988,103 @@ int main(int argc, char **argv) {
         print("Total time waiting for images to appear: {:.2f} s\n",
               time_waiting_for_images);
     }
+    return 0;
+}
+
+/**
+ * @brief The arguments for a --serve job, from its description.
+ *
+ * Jobs give a "file", and optionally "images", "start_index",
+ * "detector" (the --detector JSON, as an object), "wavelength", "dmin",
+ * "dmax" and "algorithm".
+ */
+auto job_arguments(const json &job) -> std::vector<std::string> {
+    if (!job.contains("file") || !job["file"].is_string()) {
+        throw std::invalid_argument("Job has no \"file\"");
+    }
+    auto arguments = std::vector<std::string>{job["file"].get<std::string>()};
+    auto add = [&](const std::string &key, const std::string &flag, auto is_valid) {
+        if (!job.contains(key)) {
+            return;
+        }
+        if (!is_valid(job[key])) {
+            throw std::invalid_argument(format("Invalid job \"{}\"", key));
+        }
+        arguments.push_back(flag);
+        arguments.push_back(job[key].is_string() ? job[key].get<std::string>()
+                                                 : job[key].dump());
+    };
+    auto is_count = [](const json &value) { return value.is_number_unsigned(); };
+    auto is_number = [](const json &value) { return value.is_number(); };
+    auto is_object = [](const json &value) { return value.is_object(); };
+    auto is_string = [](const json &value) { return value.is_string(); };
+    add("images", "--images", is_count);
+    add("start_index", "--start-index", is_count);
+    add("detector", "--detector", is_object);
+    add("wavelength", "--wavelength", is_number);
+    add("dmin", "--dmin", is_number);
+    add("dmax", "--dmax", is_number);
+    add("algorithm", "--algorithm", is_string);
+    add("latency_slo", "--latency-slo", is_number);
+    return arguments;
+}
+
+/// Run jobs from the socket until interrupted, keeping everything warm
+/// between them
+int serve(const std::string &socket_path,
+          const std::vector<std::string> &base_arguments) {
+    std::signal(SIGINT, stop_processing);
+    // Results are written to clients' connections, which can close at any time
+    std::signal(SIGPIPE, SIG_IGN);
+    auto server = JobServer(socket_path);
+    auto warm = WarmState{};
+    warm.serving = true;
+    print("Serving jobs on {}\n", socket_path);
+
+    while (auto job = server.next_job(global_stop.get_token())) {
+        auto job_start = std::chrono::steady_clock::now();
+        json summary = {{"job_done", true}};
+        try {
+            auto arguments = base_arguments;
+            for (auto &argument : job_arguments(job->description)) {
+                arguments.push_back(argument);
+            }
+            // Results stream straight back to the client
+            arguments.push_back("--pipe_fd");
+            arguments.push_back(std::to_string(job->socket));
+            summary["status"] = run_spotfinder(arguments, warm);
+        } catch (std::exception &e) {
+            print("Error: {}\n", e.what());
+            summary["status"] = 1;
+            summary["error"] = e.what();
+        }
+        summary["elapsed_s"] =
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - job_start)
+            .count();
+        server.send(*job, summary);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    auto arguments = std::vector<std::string>(argv, argv + argc);
+    // A daemon has no file of its own to parse arguments for, so --serve
+    // is picked out first. The rest are the defaults for every job.
+    if (auto serve_flag = std::ranges::find(arguments, "--serve");
+        serve_flag != arguments.end()) {
+        if (serve_flag + 1 == arguments.end()) {
+            print("Error: --serve needs a socket path\n");
+            return 1;
+        }
+        auto socket_path = *(serve_flag + 1);
+        arguments.erase(serve_flag, serve_flag + 2);
+        return serve(socket_path, arguments);
+    }
+    auto warm = WarmState{};
+    try {
+        return run_spotfinder(arguments, warm);
+    } catch (std::exception &e) {
+        print("Error: {}\n", e.what());
+        return 1;
+    }
 }
@@ -0,0 +1,161 @@
+#include "stackread.hpp"
+
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+
+using namespace fmt;
+
+namespace {
+/// Find the value for a key in a .npy header's dictionary
+auto npy_header_value(std::string_view header, std::string_view key)
+  -> std::string_view {
+    auto key_start = header.find(format("'{}':", key));
+    if (key_start == std::string_view::npos) {
+        throw std::runtime_error(format("No '{}' in .npy header", key));
+    }
+    auto value = header.substr(key_start + key.size() + 3);
+    return value.substr(value.find_first_not_of(' '));
+}
+
+/// Parse a .npy header, giving the stack shape and where the data starts
+auto read_npy_header(const std::string &path)
+  -> std::pair<std::vector<size_t>, size_t> {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error(format("Could not open {}", path));
+    }
+    std::array<char, 12> preamble{};
+    file.read(preamble.data(), preamble.size());
+    if (!file || std::string_view(preamble.data(), 6) != "\x93NUMPY") {
+        throw std::runtime_error(format("{} is not a .npy file", path));
+    }
+    // Version 1 has a two byte little-endian header length, later versions four
+    auto bytes = reinterpret_cast<const uint8_t *>(preamble.data());
+    size_t header_length = bytes[8] | bytes[9] << 8;
+    size_t header_start = 10;
+    if (bytes[6] >= 2) {
+        header_length |= static_cast<size_t>(bytes[10]) << 16
+                         | static_cast<size_t>(bytes[11]) << 24;
+        header_start = 12;
+    }
+    auto header = std::string(header_length, '\0');
+    file.seekg(header_start);
+    file.read(header.data(), header_length);
+    if (!file) {
+        throw std::runtime_error(format("{} has a truncated .npy header", path));
+    }
+
+    auto descr = npy_header_value(header, "descr");
+    if (!descr.starts_with("'<u2'") && !descr.starts_with("'|u2'")) {
+        throw std::runtime_error(format(
+          "{} must hold little-endian uint16, not {}", path, descr.substr(0, 5)));
+    }
+    if (!npy_header_value(header, "fortran_order").starts_with("False")) {
+        throw std::runtime_error(format("{} must be in C order", path));
+    }
+    auto shape_value = npy_header_value(header, "shape");
+    auto shape_text = shape_value.substr(1, shape_value.find(')') - 1);
+    std::vector<size_t> shape;
+    while (!shape_text.empty()) {
+        auto comma = shape_text.find(',');
+        auto dimension = std::string(shape_text.substr(0, comma));
+        if (dimension.find_first_not_of(' ') != std::string::npos) {
+            shape.push_back(std::stoull(dimension));
+        }
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        shape_text.remove_prefix(comma + 1);
+    }
+    return {shape, header_start + header_length};
+}
+}  // namespace
+
+auto parse_image_shape(const std::string &shape) -> std::array<size_t, 2> {
+    auto separator = shape.find('x');
+    if (separator == std::string::npos) {
+        throw std::runtime_error(format("Image shape {} is not SLOWxFAST", shape));
+    }
+    return {std::stoull(shape.substr(0, separator)),
+            std::stoull(shape.substr(separator + 1))};
+}
+
+StackRead::StackRead(const std::string &path) {
+    auto [shape, data_offset] = read_npy_header(path);
+    if (shape.size() == 2) {
+        shape.insert(shape.begin(), 1);
+    }
+    if (shape.size() != 3) {
+        throw std::runtime_error(
+          format("{} must be a stack of 2D images, not {}D", path, shape.size()));
+    }
+    _image_shape = {shape[1], shape[2]};
+    map(path, data_offset);
+    _num_images = std::min(_num_images, shape[0]);
+}
+
+StackRead::StackRead(const std::string &path, std::array<size_t, 2> image_shape)
+    : _image_shape(image_shape) {
+    map(path, 0);
+}
+
+void StackRead::map(const std::string &path, size_t data_offset) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error(
+          format("Could not open {}: {}", path, std::strerror(errno)));
+    }
+    struct stat info;
+    fstat(fd, &info);
+    _mapping_size = info.st_size;
+    void *mapping = mmap(nullptr, _mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error(
+          format("Could not map {}: {}", path, std::strerror(errno)));
+    }
+    _mapping = static_cast<uint8_t *>(mapping);
+    // Images are read in order, so let the kernel read well ahead
+    madvise(_mapping, _mapping_size, MADV_SEQUENTIAL);
+
+    _data = _mapping + data_offset;
+    size_t image_bytes = _image_shape[0] * _image_shape[1] * sizeof(uint16_t);
+    _num_images =
+      _mapping_size > data_offset ? (_mapping_size - data_offset) / image_bytes : 0;
+    _mask.assign(_image_shape[0] * _image_shape[1], 1);
+}
+
+StackRead::~StackRead() {
+    if (_mapping) {
+        munmap(_mapping, _mapping_size);
+    }
+}
+
+std::span<uint8_t> StackRead::get_raw_chunk(size_t index,
+                                            std::span<uint8_t> /*destination*/) {
+    // The images are read straight from the mapping, which ends with the stack
+    if (index >= _num_images) {
+        throw std::out_of_range(
+          format("Image {} is past the end of the stack ({} images)",
+                 index,
+                 _num_images));
+    }
+    size_t image_bytes = _image_shape[0] * _image_shape[1] * sizeof(uint16_t);
+    return {_data + index * image_bytes, image_bytes};
+}
+
+template <>
+bool is_ready_for_read<StackRead>(const std::string &path) {
+    return std::filesystem::exists(path);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "h5read.h"
+
+/**
+ * @brief Reads an uncompressed stack of uint16 images, mapped into memory.
+ *
+ * The stack is either a NumPy .npy file, of shape (images, slow, fast) or
+ * a single (slow, fast) image, or a raw file of images back to back whose
+ * image shape is given. Raw chunks are the pixels themselves, returned in
+ * place from the mapping rather than copied, so nothing needs decompressing.
+ *
+ * There is no metadata, and every pixel is unmasked.
+ */
+class StackRead : public Reader {
+  public:
+    /// Open a .npy file, taking the shape from its header
+    StackRead(const std::string &path);
+    /// Open a raw file of uint16 images with the given (slow, fast) shape
+    StackRead(const std::string &path, std::array<size_t, 2> image_shape);
+    ~StackRead();
+
+    StackRead(const StackRead &) = delete;
+    StackRead &operator=(const StackRead &) = delete;
+
+    bool is_image_available(size_t index) {
+        return index < _num_images;
+    }
+
+    /// Returns the image inside the mapping. destination is never used.
+    std::span<uint8_t> get_raw_chunk(size_t index, std::span<uint8_t> destination);
+
+    virtual auto get_raw_chunk_compression() -> ChunkCompression {
+        return Reader::ChunkCompression::NONE;
+    }
+
+    size_t get_number_of_images() const {
+        return _num_images;
+    }
+    std::array<size_t, 2> image_shape() const {
+        return _image_shape;
+    };
+    std::optional<std::span<const uint8_t>> get_mask() const {
+        return {{_mask.data(), _mask.size()}};
+    }
+    /// 0xFFFF is left to mark bad pixels, as in Eiger data
+    virtual std::array<image_t_type, 2> get_trusted_range() const {
+        return {0, 0xFFFE};
+    }
+    std::optional<float> get_wavelength() const {
+        return std::nullopt;
+    }
+    virtual std::optional<std::array<float, 2>> get_pixel_size() const {
+        return std::nullopt;
+    }
+    virtual std::optional<std::array<float, 2>> get_beam_center() const {
+        return std::nullopt;
+    }
+    virtual std::optional<float> get_detector_distance() const {
+        return std::nullopt;
+    }
+
+  private:
+    /// Map the file, with the image data starting at data_offset
+    void map(const std::string &path, size_t data_offset);
+
+    uint8_t *_mapping = nullptr;
+    size_t _mapping_size = 0;
+    /// Start of the first image in the mapping
+    uint8_t *_data = nullptr;
+    size_t _num_images = 0;
+    std::array<size_t, 2> _image_shape;
+    std::vector<uint8_t> _mask;
+};
+
+/// Parse an image shape given as SLOWxFAST
+auto parse_image_shape(const std::string &shape) -> std::array<size_t, 2>;
+
+template <>
+bool is_ready_for_read<StackRead>(const std::string &path);
@@ -0,0 +1,157 @@
+#include "stage_stats.hpp"
+
+#include <fmt/core.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <fstream>
+#include <system_error>
+
+using namespace fmt;
+
+auto LatencyHistogram::bucket_of(uint64_t value) -> size_t {
+    value = std::min<uint64_t>(value, (uint64_t{1} << max_value_bits) - 1);
+    // Shift the value down to between 128 and 256, and count the shifts
+    int bits = std::bit_width(value);
+    int shift = std::max(0, bits - sub_bucket_bits - 1);
+    return shift * sub_bucket_count + (value >> shift);
+}
+
+auto LatencyHistogram::value_of(size_t bucket) -> double {
+    if (bucket < 2 * sub_bucket_count) {
+        return bucket;
+    }
+    size_t shift = bucket / sub_bucket_count - 1;
+    uint64_t lowest = (bucket - shift * sub_bucket_count) << shift;
+    return lowest + ((uint64_t{1} << shift) - 1) / 2.0;
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds latency) {
+    auto micros = static_cast<uint64_t>(std::max<int64_t>(
+      0, std::chrono::duration_cast<std::chrono::microseconds>(latency).count()));
+    _buckets[bucket_of(micros)].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _total.fetch_add(micros, std::memory_order_relaxed);
+    auto max = _max.load(std::memory_order_relaxed);
+    while (micros > max
+           && !_max.compare_exchange_weak(max, micros, std::memory_order_relaxed)) {
+    }
+}
+
+auto LatencyHistogram::percentile(double fraction) const -> double {
+    auto total = count();
+    if (total == 0) {
+        return 0;
+    }
+    auto target = std::max<uint64_t>(1, std::ceil(fraction * total));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < num_buckets; ++bucket) {
+        seen += _buckets[bucket].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            // Never report more than was actually seen
+            return std::min(value_of(bucket), max());
+        }
+    }
+    return max();
+}
+
+auto LatencyHistogram::max() const -> double {
+    return _max.load(std::memory_order_relaxed);
+}
+
+auto LatencyHistogram::mean() const -> double {
+    auto total = count();
+    return total == 0 ? 0.0
+                      : static_cast<double>(_total.load(std::memory_order_relaxed))
+                          / total;
+}
+
+auto LatencyHistogram::to_json() const -> nlohmann::ordered_json {
+    // Buckets as [value in µs, count] pairs, to rebuild the distribution
+    auto buckets = nlohmann::ordered_json::array();
+    for (size_t bucket = 0; bucket < num_buckets; ++bucket) {
+        if (auto n = _buckets[bucket].load(std::memory_order_relaxed)) {
+            buckets.push_back({value_of(bucket), n});
+        }
+    }
+    return {{"count", count()},
+            {"mean_ms", mean() / 1000},
+            {"p50_ms", percentile(0.5) / 1000},
+            {"p90_ms", percentile(0.9) / 1000},
+            {"p99_ms", percentile(0.99) / 1000},
+            {"p999_ms", percentile(0.999) / 1000},
+            {"max_ms", max() / 1000},
+            {"buckets_us", std::move(buckets)}};
+}
+
+StageStats::StageStats() : _start(FrameTimestamps::clock::now()) {
+    using T = FrameTimestamps;
+    _intervals = {
+      {"wait", &T::wait_start, &T::available},
+      {"read", &T::read_start, &T::read_end},
+      {"read_queue", &T::read_end, &T::decompress_start},
+      {"decompress", &T::decompress_start, &T::decompress_end},
+      {"compute_queue", &T::decompress_end, &T::compute_start},
+      {"compute", &T::compute_start, &T::compute_end},
+      {"post_queue", &T::compute_end, &T::label_start},
+      {"labelling", &T::label_start, &T::label_end},
+      {"emit", &T::label_end, &T::emitted},
+      // From the image being there, to its result being sent on
+      {"total", &T::available, &T::emitted},
+    };
+    for (size_t i = 0; i < _intervals.size(); ++i) {
+        _histograms.push_back(std::make_unique<LatencyHistogram>());
+    }
+}
+
+void StageStats::record(const FrameTimestamps &times) {
+    for (size_t i = 0; i < _intervals.size(); ++i) {
+        auto from = times.*_intervals[i].from;
+        auto to = times.*_intervals[i].to;
+        // Without a compute stage, post-processing follows decompression
+        if (from == FrameTimestamps::clock::time_point{}
+            && _intervals[i].from == &FrameTimestamps::compute_end) {
+            from = times.decompress_end;
+        }
+        if (from != FrameTimestamps::clock::time_point{}
+            && to != FrameTimestamps::clock::time_point{}) {
+            _histograms[i]->record(to - from);
+        }
+    }
+}
+
+auto StageStats::to_json() const -> nlohmann::ordered_json {
+    auto stages = nlohmann::ordered_json::object();
+    for (size_t i = 0; i < _intervals.size(); ++i) {
+        if (_histograms[i]->count() > 0) {
+            stages[_intervals[i].name] = _histograms[i]->to_json();
+        }
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(
+      FrameTimestamps::clock::now() - _start);
+    return {{"elapsed_s", elapsed.count()}, {"stages", std::move(stages)}};
+}
+
+void StageStats::write(const std::filesystem::path &path) const {
+    auto temporary_path = path;
+    temporary_path += format(".{}.tmp", getpid());
+    std::error_code error;
+    {
+        std::ofstream file(temporary_path);
+        file << to_json().dump(2) << "\n";
+        if (!file) {
+            print("Warning: Could not write stage statistics to {}\n", path.string());
+            std::filesystem::remove(temporary_path, error);
+            return;
+        }
+    }
+    std::filesystem::rename(temporary_path, path, error);
+    if (error) {
+        print("Warning: Could not write stage statistics to {}: {}\n",
+              path.string(),
+              error.message());
+        std::filesystem::remove(temporary_path, error);
+    }
+}
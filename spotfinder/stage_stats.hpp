@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+/**
+ * @brief When a frame reached each point of the pipeline.
+ *
+ * Stamped from a monotonic clock. Points a frame never passes, such as
+ * compute with --cpu, are left at zero.
+ */
+struct FrameTimestamps {
+    using clock = std::chrono::steady_clock;
+
+    /// The reader started waiting for the image to appear
+    clock::time_point wait_start;
+    /// The reader saw that the image was there
+    clock::time_point available;
+    clock::time_point read_start;
+    clock::time_point read_end;
+    clock::time_point decompress_start;
+    clock::time_point decompress_end;
+    clock::time_point compute_start;
+    clock::time_point compute_end;
+    clock::time_point label_start;
+    clock::time_point label_end;
+    /// The result was sent on
+    clock::time_point emitted;
+};
+
+/**
+ * @brief A latency histogram, in the style of HdrHistogram.
+ *
+ * Values are recorded in microseconds. Buckets are exact up to 256 µs,
+ * and above that every power of two is split into 128 linear buckets,
+ * so any value is known to within 1%. Recording is lock-free, and the
+ * histogram can be read while it is being recorded into.
+ */
+class LatencyHistogram {
+  public:
+    void record(std::chrono::nanoseconds latency);
+
+    auto count() const -> uint64_t {
+        return _count.load(std::memory_order_relaxed);
+    }
+    /// The value below which this fraction of samples fall, in µs
+    auto percentile(double fraction) const -> double;
+    auto max() const -> double;
+    auto mean() const -> double;
+
+    /// Summary statistics in ms, and the counts in every non-empty bucket
+    auto to_json() const -> nlohmann::ordered_json;
+
+  private:
+    static constexpr int sub_bucket_bits = 7;
+    static constexpr uint64_t sub_bucket_count = 1 << sub_bucket_bits;
+    /// Longer than this (about 13 days) is counted as this
+    static constexpr int max_value_bits = 40;
+    static constexpr size_t num_buckets =
+      (max_value_bits - sub_bucket_bits + 1) * sub_bucket_count;
+
+    static auto bucket_of(uint64_t value) -> size_t;
+    /// The middle of the range of values in a bucket
+    static auto value_of(size_t bucket) -> double;
+
+    std::array<std::atomic<uint64_t>, num_buckets> _buckets{};
+    std::atomic<uint64_t> _count{0};
+    std::atomic<uint64_t> _total{0};
+    std::atomic<uint64_t> _max{0};
+};
+
+/**
+ * @brief Latency histograms of every stage of the pipeline.
+ *
+ * Each frame's timestamps are recorded once it has been output, split
+ * into the time spent in each stage, and the time spent queued between
+ * them.
+ */
+class StageStats {
+  public:
+    StageStats();
+
+    void record(const FrameTimestamps &times);
+
+    auto to_json() const -> nlohmann::ordered_json;
+    /// Write the JSON to path, replacing it all at once so that readers
+    /// never see half of it
+    void write(const std::filesystem::path &path) const;
+
+  private:
+    struct Interval {
+        std::string name;
+        FrameTimestamps::clock::time_point FrameTimestamps::*from;
+        FrameTimestamps::clock::time_point FrameTimestamps::*to;
+    };
+
+    std::vector<Interval> _intervals;
+    std::vector<std::unique_ptr<LatencyHistogram>> _histograms;
+    FrameTimestamps::clock::time_point _start;
+};
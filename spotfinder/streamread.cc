@@ -0,0 +1,225 @@
+#include "streamread.hpp"
+
+#include <fmt/core.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+
+using json = nlohmann::json;
+using namespace fmt;
+
+namespace {
+/// Read exactly size bytes. Returns false if the stream ends first.
+bool read_exact(int socket, void *destination, size_t size) {
+    auto dest = static_cast<uint8_t *>(destination);
+    while (size > 0) {
+        ssize_t count = recv(socket, dest, size, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        dest += count;
+        size -= count;
+    }
+    return true;
+}
+}  // namespace
+
+StreamRead::StreamRead(const std::string &socket_path, size_t num_buffers) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error(format("Socket path too long: {}", socket_path));
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+    _socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_socket < 0
+        || connect(_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address))
+             < 0) {
+        auto error = std::strerror(errno);
+        if (_socket >= 0) {
+            close(_socket);
+        }
+        throw std::runtime_error(
+          format("Could not connect to stream {}: {}", socket_path, error));
+    }
+
+    // The series start tells us everything needed to size the buffers
+    StreamMessageHeader header;
+    if (!read_exact(_socket, &header, sizeof(header))
+        || header.magic != StreamMessageHeader::expected_magic
+        || header.type != StreamMessageHeader::Type::SERIES_START) {
+        close(_socket);
+        throw std::runtime_error("Stream did not start with a series header");
+    }
+    auto header_json = std::string(header.json_size, '\0');
+    if (!read_exact(_socket, header_json.data(), header_json.size())) {
+        close(_socket);
+        throw std::runtime_error("Stream closed while reading series header");
+    }
+    json data = json::parse(header_json);
+
+    _num_images =
+      data["nimages"].template get<size_t>() * data["ntrigger"].template get<size_t>();
+    _image_shape = {
+      data["y_pixels_in_detector"].template get<size_t>(),
+      data["x_pixels_in_detector"].template get<size_t>(),
+    };
+    if (data["bit_depth_image"].template get<int>() != 16) {
+        close(_socket);
+        throw std::runtime_error("Can only stream images with bit_depth_image=16");
+    }
+    _trusted_range = {
+      0, data["countrate_correction_count_cutoff"].template get<image_t_type>()};
+    if (data.contains("wavelength")) {
+        _wavelength = data["wavelength"].template get<float>();
+    }
+    _detector_distance = data["detector_distance"].template get<float>() / 1000;
+    _pixel_size = {data["y_pixel_size"].template get<float>(),
+                   data["x_pixel_size"].template get<float>()};
+    _beam_center = {data["beam_center_y"].template get<float>(),
+                    data["beam_center_x"].template get<float>()};
+
+    // The mask follows, in the same form as SHM start_5
+    size_t num_pixels = _image_shape[0] * _image_shape[1];
+    auto raw_mask = std::vector<int32_t>(num_pixels);
+    if (header.data_size != raw_mask.size() * sizeof(int32_t)
+        || !read_exact(_socket, raw_mask.data(), header.data_size)) {
+        close(_socket);
+        throw std::runtime_error("Stream mask does not match the image size");
+    }
+    _mask.resize(num_pixels);
+    std::transform(
+      raw_mask.begin(), raw_mask.end(), _mask.begin(), [](auto v) { return !v; });
+
+    // Compressed chunks can be very slightly larger than the raw data:
+    // LZ4 adds up to 1/255 per block, plus bitshuffle's block headers.
+    size_t raw_size = num_pixels * sizeof(pixel_t);
+    _buffer_size = raw_size + raw_size / 128 + 1024;
+    _buffer_data.resize(_buffer_size * num_buffers);
+    _free_buffers.reserve(num_buffers);
+    for (size_t i = 0; i < num_buffers; ++i) {
+        _free_buffers.push_back(i);
+    }
+    _received.resize(_num_images);
+
+    _receiver =
+      std::jthread([this](std::stop_token stop_token) { receive(stop_token); });
+}
+
+StreamRead::~StreamRead() {
+    _receiver.request_stop();
+    // Wake the receiver, if it is blocked waiting for the publisher
+    shutdown(_socket, SHUT_RDWR);
+    if (_receiver.joinable()) {
+        _receiver.join();
+    }
+    close(_socket);
+}
+
+void StreamRead::receive(std::stop_token stop_token) {
+    while (!stop_token.stop_requested()) {
+        StreamMessageHeader header;
+        if (!read_exact(_socket, &header, sizeof(header))) {
+            if (!stop_token.stop_requested()) {
+                print("Error: Stream closed before the end of the series\n");
+            }
+            return;
+        }
+        if (header.magic != StreamMessageHeader::expected_magic) {
+            print("Error: Lost sync with stream\n");
+            return;
+        }
+        if (header.type == StreamMessageHeader::Type::SERIES_END) {
+            return;
+        }
+        if (header.type != StreamMessageHeader::Type::IMAGE || header.json_size != 0
+            || header.frame >= _num_images || header.data_size > _buffer_size) {
+            print("Error: Unexpected stream message for image {}\n", header.frame);
+            return;
+        }
+
+        size_t buffer;
+        {
+            std::unique_lock lock(_mutex);
+            if (!_buffer_freed.wait(
+                  lock, stop_token, [this] { return !_free_buffers.empty(); })) {
+                return;
+            }
+            buffer = _free_buffers.back();
+            _free_buffers.pop_back();
+        }
+        // Receive straight into the buffer, without holding the lock
+        if (!read_exact(
+              _socket, _buffer_data.data() + buffer * _buffer_size, header.data_size)) {
+            print("Error: Stream closed partway through image {}\n", header.frame);
+            return;
+        }
+        std::scoped_lock lock(_mutex);
+        auto &received = _received[header.frame];
+        if (received.arrived) {
+            print("Error: Image {} streamed twice\n", header.frame);
+            return;
+        }
+        received.arrived = true;
+        if (received.released) {
+            // Skipped before it got here, so there's nothing to keep
+            _free_buffers.push_back(buffer);
+        } else {
+            received.buffer = buffer;
+            received.size = header.data_size;
+        }
+    }
+}
+
+bool StreamRead::is_image_available(size_t index) {
+    std::scoped_lock lock(_mutex);
+    return index < _received.size() && _received[index].arrived;
+}
+
+std::span<uint8_t> StreamRead::get_raw_chunk(size_t index,
+                                             std::span<uint8_t> /*destination*/) {
+    std::scoped_lock lock(_mutex);
+    if (index >= _received.size() || !_received[index].arrived) {
+        return {};
+    }
+    auto &received = _received[index];
+    if (!received.buffer) {
+        throw std::runtime_error(
+          format("Image {} was released before it was read", index));
+    }
+    // The receiver leaves the buffer alone until it's released
+    return {_buffer_data.data() + *received.buffer * _buffer_size, received.size};
+}
+
+void StreamRead::release_chunk(size_t index) {
+    {
+        std::scoped_lock lock(_mutex);
+        if (index >= _received.size()) {
+            return;
+        }
+        auto &received = _received[index];
+        received.released = true;
+        if (!received.buffer) {
+            return;
+        }
+        _free_buffers.push_back(*received.buffer);
+        received.buffer.reset();
+    }
+    _buffer_freed.notify_one();
+}
+
+template <>
+bool is_ready_for_read<StreamRead>(const std::string &path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode);
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "h5read.h"
+
+/**
+ * @brief Start of every message in a detector frame stream.
+ *
+ * Modelled on the Eiger stream interface: a series start message carrying
+ * the detector configuration (the same JSON as the SHM start_1 file) with
+ * the mask as its data, then one message per image with the raw chunk as
+ * its data, then a series end message. Image messages carry no JSON, so
+ * receiving them needs no parsing or allocation.
+ */
+struct StreamMessageHeader {
+    enum class Type : uint32_t { SERIES_START = 1, IMAGE = 2, SERIES_END = 3 };
+    static constexpr uint32_t expected_magic = 0x53534646;  // "FFSS"
+
+    uint32_t magic = expected_magic;
+    Type type;
+    uint64_t frame = 0;      ///< Image index, for image messages
+    uint64_t json_size = 0;  ///< Bytes of JSON following this header
+    uint64_t data_size = 0;  ///< Bytes of binary data following the JSON
+};
+
+/// Prefix marking a reader path as a stream socket, rather than a file
+constexpr std::string_view stream_url_prefix = "unix:";
+
+/**
+ * @brief Reads frames streamed over a local Unix socket.
+ *
+ * A background thread receives each frame straight into one of a fixed
+ * pool of buffers, allocated up front. Reading an image hands out its
+ * buffer as it is, without copying, and the buffer goes back to the pool
+ * on release_chunk(). Releasing an image that hasn't been read drops it,
+ * so it can't be read afterwards. If every buffer is in use, the receiver
+ * stops reading from the socket, which holds the publisher back.
+ */
+class StreamRead : public Reader {
+  public:
+    /**
+     * @param socket_path   Socket that the publisher is listening on
+     * @param num_buffers   Number of frames that can be held at once, from
+     *                      being received until released
+     */
+    StreamRead(const std::string &socket_path, size_t num_buffers = 16);
+    ~StreamRead();
+
+    bool is_image_available(size_t index);
+
+    std::span<uint8_t> get_raw_chunk(size_t index, std::span<uint8_t> destination);
+    void release_chunk(size_t index);
+
+    virtual auto get_raw_chunk_compression() -> ChunkCompression {
+        return Reader::ChunkCompression::BITSHUFFLE_LZ4;
+    }
+
+    size_t get_number_of_images() const {
+        return _num_images;
+    }
+    std::array<size_t, 2> image_shape() const {
+        return _image_shape;
+    };
+    std::optional<std::span<const uint8_t>> get_mask() const {
+        return {{_mask.data(), _mask.size()}};
+    }
+    virtual std::array<image_t_type, 2> get_trusted_range() const {
+        return _trusted_range;
+    }
+    std::optional<float> get_wavelength() const {
+        return _wavelength;
+    }
+    virtual std::optional<std::array<float, 2>> get_pixel_size() const {
+        return {_pixel_size};
+    }
+    virtual std::optional<std::array<float, 2>> get_beam_center() const {
+        return {_beam_center};
+    }
+    virtual std::optional<float> get_detector_distance() const {
+        return _detector_distance;
+    }
+
+  private:
+    /// What has happened to an image. Whether it has arrived is kept apart
+    /// from whether it still has a buffer, so that once available, an
+    /// image stays available.
+    struct Received {
+        bool arrived = false;
+        /// Released, before or after arriving
+        bool released = false;
+        /// The buffer holding the chunk, from arriving until released
+        std::optional<size_t> buffer;
+        size_t size = 0;
+    };
+
+    /// Runs on the receiver thread until the series ends or we are stopped
+    void receive(std::stop_token stop_token);
+
+    int _socket = -1;
+    size_t _num_images;
+    std::array<size_t, 2> _image_shape;
+    std::vector<uint8_t> _mask;
+    std::array<image_t_type, 2> _trusted_range;
+    std::optional<float> _wavelength;
+    std::array<float, 2> _beam_center;
+    std::array<float, 2> _pixel_size;
+    float _detector_distance;
+
+    /// Space for every buffer in the pool, each _buffer_size bytes
+    std::vector<uint8_t> _buffer_data;
+    size_t _buffer_size;
+
+    std::mutex _mutex;
+    std::condition_variable_any _buffer_freed;
+    std::vector<size_t> _free_buffers;
+    std::vector<Received> _received;
+
+    std::jthread _receiver;
+};
+
+template <>
+bool is_ready_for_read<StreamRead>(const std::string &path);
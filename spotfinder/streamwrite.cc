@@ -0,0 +1,109 @@
+#include "streamwrite.hpp"
+
+#include <fmt/core.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "shmwrite.hpp"
+
+using namespace fmt;
+
+StreamPublisher::StreamPublisher(const std::string &socket_path)
+    : _socket_path(socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error(format("Socket path too long: {}", socket_path));
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+    // A socket left behind by an earlier run would stop us binding
+    unlink(socket_path.c_str());
+    _listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_listen_socket < 0
+        || bind(_listen_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address))
+             < 0
+        || listen(_listen_socket, 1) < 0) {
+        throw std::runtime_error(
+          format("Could not listen on {}: {}", socket_path, std::strerror(errno)));
+    }
+}
+
+StreamPublisher::~StreamPublisher() {
+    if (_socket >= 0) {
+        close(_socket);
+    }
+    if (_listen_socket >= 0) {
+        close(_listen_socket);
+        unlink(_socket_path.c_str());
+    }
+}
+
+void StreamPublisher::accept() {
+    _socket = ::accept(_listen_socket, nullptr, nullptr);
+    if (_socket < 0) {
+        throw std::runtime_error(
+          format("Failed to accept reader connection: {}", std::strerror(errno)));
+    }
+}
+
+void StreamPublisher::send(StreamMessageHeader header,
+                           std::span<const uint8_t> json,
+                           std::span<const uint8_t> data) {
+    header.json_size = json.size();
+    header.data_size = data.size();
+    auto parts = std::array<iovec, 3>{
+      iovec{&header, sizeof(header)},
+      iovec{const_cast<uint8_t *>(json.data()), json.size()},
+      iovec{const_cast<uint8_t *>(data.data()), data.size()},
+    };
+    // Keep going until every part has been sent, picking up where any
+    // short write left off.
+    iovec *remaining = parts.data();
+    size_t remaining_count = parts.size();
+    while (remaining_count > 0) {
+        msghdr message{};
+        message.msg_iov = remaining;
+        message.msg_iovlen = remaining_count;
+        ssize_t sent = sendmsg(_socket, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            throw std::runtime_error(
+              format("Failed to send to reader: {}", std::strerror(errno)));
+        }
+        while (remaining_count > 0 && static_cast<size_t>(sent) >= remaining->iov_len) {
+            sent -= remaining->iov_len;
+            ++remaining;
+            --remaining_count;
+        }
+        if (remaining_count > 0) {
+            remaining->iov_base = static_cast<uint8_t *>(remaining->iov_base) + sent;
+            remaining->iov_len -= sent;
+        }
+    }
+}
+
+void StreamPublisher::send_series_start(const Reader &reader, size_t num_images) {
+    auto json = make_shm_series_header(reader, num_images);
+    auto mask = make_shm_mask(reader);
+    send({.type = StreamMessageHeader::Type::SERIES_START},
+         {reinterpret_cast<const uint8_t *>(json.data()), json.size()},
+         {reinterpret_cast<const uint8_t *>(mask.data()),
+          mask.size() * sizeof(decltype(mask)::value_type)});
+}
+
+void StreamPublisher::send_image(size_t index, std::span<const uint8_t> chunk) {
+    send({.type = StreamMessageHeader::Type::IMAGE, .frame = index}, {}, chunk);
+}
+
+void StreamPublisher::send_series_end() {
+    send({.type = StreamMessageHeader::Type::SERIES_END}, {}, {});
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "h5read.h"
+#include "streamread.hpp"
+
+/**
+ * @brief Publishes a series of frames to a StreamRead, over a Unix socket.
+ *
+ * Serves a single reader, which is what the spotfinder needs. Sends block
+ * once the reader's buffers are full.
+ */
+class StreamPublisher {
+  public:
+    /// Listen on socket_path, replacing anything already there
+    explicit StreamPublisher(const std::string &socket_path);
+    ~StreamPublisher();
+
+    /// Wait for a reader to connect
+    void accept();
+
+    /// Send the detector configuration and mask
+    void send_series_start(const Reader &reader, size_t num_images);
+    /// Send one image, as a raw chunk including the bitshuffle header
+    void send_image(size_t index, std::span<const uint8_t> chunk);
+    void send_series_end();
+
+  private:
+    void send(StreamMessageHeader header,
+              std::span<const uint8_t> json,
+              std::span<const uint8_t> data);
+
+    std::string _socket_path;
+    int _listen_socket = -1;
+    int _socket = -1;
+};
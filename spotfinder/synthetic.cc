@@ -0,0 +1,238 @@
+#include "synthetic.hpp"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <numbers>
+#include <stdexcept>
+#include <thread>
+
+#include "decompression.hpp"
+#include "eiger2xe.h"
+
+namespace {
+/// Hexagonal ice ring d-spacings, in Å, lowest resolution first
+constexpr std::array<float, 8> ice_ring_d_spacings = {
+  3.897f, 3.669f, 3.441f, 2.671f, 2.249f, 2.072f, 1.948f, 1.918f};
+/// Gaussian width of an ice ring, in pixels
+constexpr float ice_ring_sigma = 2.0f;
+/// What pixels in the gaps between modules read as
+constexpr pixel_t gap_value = 0xFFFF;
+/// Highest value a real pixel can read, so it is never confused with a gap
+constexpr uint32_t max_pixel_value = 0xFFFE;
+
+/// Small, fast random number generator. Plenty good enough for test data.
+class SplitMix64 {
+  public:
+    explicit SplitMix64(uint64_t seed) : _state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (_state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+    /// Uniformly distributed in [0, 1)
+    double uniform() {
+        return (next() >> 11) * 0x1.0p-53;
+    }
+    /// Standard normal distribution
+    double normal() {
+        double radius = std::sqrt(-2 * std::log1p(-uniform()));
+        return radius * std::cos(2 * std::numbers::pi * uniform());
+    }
+    double exponential(double mean) {
+        return -mean * std::log1p(-uniform());
+    }
+    uint32_t poisson(double mean) {
+        if (mean <= 0) {
+            return 0;
+        }
+        if (mean > 30) {
+            // Far enough out that the normal approximation is fine
+            return std::max(0.0, std::round(mean + std::sqrt(mean) * normal()));
+        }
+        // Walk the CDF. Cheap, since the mean is usually small.
+        double u = uniform();
+        double p = std::exp(-mean);
+        double cdf = p;
+        uint32_t k = 0;
+        while (u > cdf && p > 0) {
+            ++k;
+            p *= mean / k;
+            cdf += p;
+        }
+        return k;
+    }
+
+  private:
+    uint64_t _state;
+};
+}  // namespace
+
+auto SyntheticParameters::parse_detector(const std::string &name) -> Detector {
+    auto upper = name;
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+    if (upper == "4M") {
+        return Detector::E2XE_4M;
+    } else if (upper == "16M") {
+        return Detector::E2XE_16M;
+    }
+    throw std::invalid_argument(
+      fmt::format("Unknown detector '{}': expected 4M or 16M", name));
+}
+
+SyntheticImageGenerator::SyntheticImageGenerator(SyntheticParameters params)
+    : _params(params) {
+    if (params.unique_images == 0) {
+        throw std::invalid_argument("Must generate at least one unique image");
+    }
+    if (params.ice_rings < 0 || params.ice_rings > ice_ring_d_spacings.size()) {
+        throw std::invalid_argument(fmt::format(
+          "Can only generate 0-{} ice rings", ice_ring_d_spacings.size()));
+    }
+    if (params.detector == SyntheticParameters::Detector::E2XE_16M) {
+        _slow = E2XE_16M_SLOW;
+        _fast = E2XE_16M_FAST;
+    } else {
+        _slow = E2XE_4M_SLOW;
+        _fast = E2XE_4M_FAST;
+    }
+
+    // Mask out the gaps between modules
+    _mask.resize(_slow * _fast);
+    for (size_t y = 0, k = 0; y < _slow; ++y) {
+        bool row_gap = y % (E2XE_MOD_SLOW + E2XE_GAP_SLOW) >= E2XE_MOD_SLOW;
+        for (size_t x = 0; x < _fast; ++x, ++k) {
+            bool col_gap = x % (E2XE_MOD_FAST + E2XE_GAP_FAST) >= E2XE_MOD_FAST;
+            _mask[k] = !(row_gap || col_gap);
+        }
+    }
+
+    // Hot pixels stay in the same place for every image
+    auto rng = SplitMix64(params.seed);
+    while (_hot_pixels.size() < params.hot_pixels) {
+        size_t k = rng.next() % _mask.size();
+        if (_mask[k]) {
+            auto value = static_cast<pixel_t>(
+              params.trusted_max * (0.25 + 0.75 * rng.uniform()));
+            _hot_pixels.emplace_back(k, value);
+        }
+    }
+
+    for (int ring = 0; ring < params.ice_rings; ++ring) {
+        float two_theta =
+          2 * std::asin(params.wavelength / (2 * ice_ring_d_spacings[ring]));
+        _ice_ring_radii.push_back(params.distance * std::tan(two_theta)
+                                  / params.pixel_size);
+    }
+}
+
+void SyntheticImageGenerator::generate(size_t index,
+                                       std::span<pixel_t> image) const {
+    if (image.size() < _slow * _fast) {
+        throw std::invalid_argument("Image buffer too small for synthetic image");
+    }
+    // Different images should be uncorrelated, but still reproducible
+    auto rng = SplitMix64(SplitMix64(_params.seed).next() + index);
+
+    auto [beam_y, beam_x] = beam_center();
+    float max_radius = std::hypot(std::max(beam_y, _slow - beam_y),
+                                  std::max(beam_x, _fast - beam_x));
+
+#pragma region Background
+    for (size_t y = 0, k = 0; y < _slow; ++y) {
+        for (size_t x = 0; x < _fast; ++x, ++k) {
+            if (!_mask[k]) {
+                image[k] = gap_value;
+                continue;
+            }
+            float radius = std::hypot(y + 0.5f - beam_y, x + 0.5f - beam_x);
+            float mean = _params.background * (1 - 0.5f * radius / max_radius);
+            for (float ring_radius : _ice_ring_radii) {
+                float distance = radius - ring_radius;
+                if (std::fabs(distance) < 5 * ice_ring_sigma) {
+                    mean += _params.ice_ring_intensity
+                            * std::exp(-distance * distance
+                                       / (2 * ice_ring_sigma * ice_ring_sigma));
+                }
+            }
+            image[k] = std::min(rng.poisson(mean), max_pixel_value);
+        }
+    }
+#pragma endregion Background
+
+#pragma region Spots
+    // Since sums of Poisson variables are Poisson, spots can just be
+    // sampled separately and added on top of the background.
+    uint32_t num_spots = rng.poisson(_params.spots_per_image);
+    for (uint32_t spot = 0; spot < num_spots; ++spot) {
+        double spot_y = rng.uniform() * _slow;
+        double spot_x = rng.uniform() * _fast;
+        double sigma = _params.spot_sigma * (0.75 + 0.5 * rng.uniform());
+        double total = rng.exponential(_params.spot_intensity);
+        // Scale the profile so that it sums to the total
+        double scale = total / (2 * std::numbers::pi * sigma * sigma);
+
+        int extent = static_cast<int>(std::ceil(3 * sigma));
+        int center_y = static_cast<int>(spot_y);
+        int center_x = static_cast<int>(spot_x);
+        int y0 = std::max(0, center_y - extent);
+        int y1 = std::min(static_cast<int>(_slow) - 1, center_y + extent);
+        int x0 = std::max(0, center_x - extent);
+        int x1 = std::min(static_cast<int>(_fast) - 1, center_x + extent);
+        for (int y = y0; y <= y1; ++y) {
+            for (int x = x0; x <= x1; ++x) {
+                size_t k = y * _fast + x;
+                if (!_mask[k]) {
+                    continue;
+                }
+                double dy = y + 0.5 - spot_y;
+                double dx = x + 0.5 - spot_x;
+                double mean =
+                  scale * std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+                image[k] = std::min(image[k] + rng.poisson(mean), max_pixel_value);
+            }
+        }
+    }
+#pragma endregion Spots
+
+    for (auto [k, value] : _hot_pixels) {
+        image[k] = value;
+    }
+}
+
+SyntheticRead::SyntheticRead(SyntheticParameters params)
+    : _generator(params), _chunks(params.unique_images) {
+    // Generate and compress everything up front, so that reading is as
+    // cheap as it can be.
+    auto [slow, fast] = _generator.image_shape();
+    size_t num_threads = std::min<size_t>(
+      _chunks.size(), std::max(1u, std::thread::hardware_concurrency()));
+    {
+        std::vector<std::jthread> threads;
+        for (size_t thread = 0; thread < num_threads; ++thread) {
+            threads.emplace_back([&, thread]() {
+                auto image = std::vector<pixel_t>(slow * fast);
+                for (size_t i = thread; i < _chunks.size(); i += num_threads) {
+                    _generator.generate(i, image);
+                    auto bytes = reinterpret_cast<const uint8_t *>(image.data());
+                    _chunks[i] = bshuf_compress_lz4_chunk(
+                      {bytes, image.size() * sizeof(pixel_t)}, sizeof(pixel_t));
+                }
+            });
+        }
+    }
+}
+
+std::span<uint8_t> SyntheticRead::get_raw_chunk(size_t index,
+                                                std::span<uint8_t> destination) {
+    auto &chunk = _chunks[index % _chunks.size()];
+    if (chunk.size() > destination.size()) {
+        throw std::runtime_error("Not enough room to store compressed chunk");
+    }
+    std::copy(chunk.begin(), chunk.end(), destination.begin());
+    return {destination.data(), chunk.size()};
+}
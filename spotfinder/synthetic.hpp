@@ -0,0 +1,138 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "h5read.h"
+
+/// Parameters for generating synthetic diffraction images
+struct SyntheticParameters {
+    enum class Detector { E2XE_4M, E2XE_16M };
+
+    Detector detector = Detector::E2XE_16M;
+    size_t num_images = 100;
+    /// Number of distinct images. Later images repeat these.
+    size_t unique_images = 4;
+    uint64_t seed = 1;
+
+    /// Mean background counts per pixel at the beam centre. This falls
+    /// off linearly to half of this value at the furthest corner.
+    float background = 1.0f;
+    /// Mean number of spots on each image
+    float spots_per_image = 400;
+    /// Gaussian width of the spot profile, in pixels. Each spot varies
+    /// by up to 25% from this.
+    float spot_sigma = 1.0f;
+    /// Mean total counts in each spot. Spot intensities are exponentially
+    /// distributed, so most are weak and a few are very strong.
+    float spot_intensity = 200;
+    /// Number of hexagonal ice rings to add, strongest first (max 8)
+    int ice_rings = 0;
+    /// Mean counts per pixel added at the peak of each ice ring
+    float ice_ring_intensity = 5;
+    /// Number of hot pixels. These read high on every image, but are not
+    /// in the mask.
+    size_t hot_pixels = 20;
+
+    float wavelength = 0.976f;    ///< Beam wavelength, in Å
+    float distance = 0.2f;        ///< Detector distance, in m
+    float pixel_size = 75e-6f;    ///< Pixel size, in m
+    pixel_t trusted_max = 65534;  ///< Highest trusted pixel value
+
+    /// Parse a detector name, "4M" or "16M"
+    static auto parse_detector(const std::string &name) -> Detector;
+};
+
+/**
+ * @brief Generates realistic-looking diffraction images.
+ *
+ * Images are built from a Poisson-distributed background, Gaussian spots,
+ * optional ice rings and hot pixels, laid out on the modules of an Eiger
+ * 2 XE detector. Module gaps read as 0xFFFF, and are masked out.
+ *
+ * Each image only depends on the parameters and the image index, so
+ * images can be generated in any order or in parallel.
+ */
+class SyntheticImageGenerator {
+  public:
+    explicit SyntheticImageGenerator(SyntheticParameters params);
+
+    auto parameters() const -> const SyntheticParameters & {
+        return _params;
+    }
+    /// Image shape, in (slow, fast) pixels
+    auto image_shape() const -> std::array<size_t, 2> {
+        return {_slow, _fast};
+    }
+    /// Mask, with 1 for valid pixels
+    auto mask() const -> std::span<const uint8_t> {
+        return _mask;
+    }
+    /// Beam center (y, x), in pixels
+    auto beam_center() const -> std::array<float, 2> {
+        return {_slow / 2.0f, _fast / 2.0f};
+    }
+
+    /// Generate image number index, which must be < unique_images
+    void generate(size_t index, std::span<pixel_t> image) const;
+
+  private:
+    SyntheticParameters _params;
+    size_t _slow, _fast;
+    std::vector<uint8_t> _mask;
+    /// Positions (as pixel index) and values of the hot pixels
+    std::vector<std::pair<size_t, pixel_t>> _hot_pixels;
+    /// Radius, in pixels, of each ice ring
+    std::vector<float> _ice_ring_radii;
+};
+
+/// A Reader that serves generated, bitshuffle-LZ4 compressed images
+class SyntheticRead : public Reader {
+  public:
+    SyntheticRead(SyntheticParameters params = {});
+
+    bool is_image_available(size_t index) {
+        return index < _generator.parameters().num_images;
+    }
+
+    std::span<uint8_t> get_raw_chunk(size_t index, std::span<uint8_t> destination);
+
+    virtual auto get_raw_chunk_compression() -> ChunkCompression {
+        return Reader::ChunkCompression::BITSHUFFLE_LZ4;
+    }
+
+    size_t get_number_of_images() const {
+        return _generator.parameters().num_images;
+    }
+    std::array<size_t, 2> image_shape() const {
+        return _generator.image_shape();
+    }
+    std::optional<std::span<const uint8_t>> get_mask() const {
+        return _generator.mask();
+    }
+    virtual std::array<image_t_type, 2> get_trusted_range() const {
+        return {0, _generator.parameters().trusted_max};
+    }
+    std::optional<float> get_wavelength() const {
+        return _generator.parameters().wavelength;
+    }
+    virtual std::optional<std::array<float, 2>> get_pixel_size() const {
+        auto pixel_size = _generator.parameters().pixel_size;
+        return {{pixel_size, pixel_size}};
+    }
+    virtual std::optional<std::array<float, 2>> get_beam_center() const {
+        return _generator.beam_center();
+    }
+    virtual std::optional<float> get_detector_distance() const {
+        return _generator.parameters().distance;
+    }
+
+  private:
+    SyntheticImageGenerator _generator;
+    /// Compressed chunks for each unique image
+    std::vector<std::vector<uint8_t>> _chunks;
+};
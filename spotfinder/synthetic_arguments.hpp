@@ -0,0 +1,76 @@
+#pragma once
+
+#include <argparse/argparse.hpp>
+#include <string>
+
+#include "synthetic.hpp"
+
+/// Add options for each of the SyntheticParameters, except the image count
+inline void add_synthetic_arguments(argparse::ArgumentParser &parser) {
+    parser.add_argument("--detector")
+      .help("Synthetic detector to model, 4M or 16M")
+      .default_value<std::string>("16M");
+    parser.add_argument("--unique-images")
+      .help("Number of distinct synthetic images. Later images repeat these.")
+      .metavar("NUM")
+      .default_value<size_t>(4)
+      .scan<'u', size_t>();
+    parser.add_argument("--seed")
+      .help("Random seed")
+      .default_value<uint64_t>(1)
+      .scan<'u', uint64_t>();
+    parser.add_argument("--background")
+      .help("Mean background counts per pixel")
+      .metavar("COUNTS")
+      .default_value<float>(1.0f)
+      .scan<'f', float>();
+    parser.add_argument("--spots")
+      .help("Mean number of spots per image")
+      .metavar("NUM")
+      .default_value<float>(400)
+      .scan<'f', float>();
+    parser.add_argument("--spot-sigma")
+      .help("Width of the spot profile, in pixels")
+      .metavar("PX")
+      .default_value<float>(1.0f)
+      .scan<'f', float>();
+    parser.add_argument("--spot-intensity")
+      .help("Mean total counts per spot")
+      .metavar("COUNTS")
+      .default_value<float>(200)
+      .scan<'f', float>();
+    parser.add_argument("--ice-rings")
+      .help("Number of ice rings, 0-8")
+      .metavar("NUM")
+      .default_value<int>(0)
+      .scan<'i', int>();
+    parser.add_argument("--ice-ring-intensity")
+      .help("Mean counts per pixel at the peak of each ice ring")
+      .metavar("COUNTS")
+      .default_value<float>(5)
+      .scan<'f', float>();
+    parser.add_argument("--hot-pixels")
+      .help("Number of unmasked hot pixels")
+      .metavar("NUM")
+      .default_value<size_t>(20)
+      .scan<'u', size_t>();
+}
+
+/// Read back the options added by add_synthetic_arguments
+inline auto get_synthetic_parameters(argparse::ArgumentParser &parser,
+                                     size_t num_images) -> SyntheticParameters {
+    SyntheticParameters params;
+    params.detector =
+      SyntheticParameters::parse_detector(parser.get<std::string>("detector"));
+    params.num_images = num_images;
+    params.unique_images = parser.get<size_t>("unique-images");
+    params.seed = parser.get<uint64_t>("seed");
+    params.background = parser.get<float>("background");
+    params.spots_per_image = parser.get<float>("spots");
+    params.spot_sigma = parser.get<float>("spot-sigma");
+    params.spot_intensity = parser.get<float>("spot-intensity");
+    params.ice_rings = parser.get<int>("ice-rings");
+    params.ice_ring_intensity = parser.get<float>("ice-ring-intensity");
+    params.hot_pixels = parser.get<size_t>("hot-pixels");
+    return params;
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Helper threads that share out work from all of the CPU stages.
+ *
+ * Each helper thread has its own deque of tasks. It works through its own
+ * tasks newest first, and when it runs out, steals the oldest task from
+ * another's deque, so a burst of work from one frame spreads over every
+ * idle thread. Tasks from outside the pool are dealt out round-robin.
+ *
+ * Work is either a parallel_for over an index range, which the calling
+ * thread always takes part in, or a task submitted to run whenever a
+ * thread is free. A pool with zero helper threads degrades to running
+ * everything in the calling thread, straight away.
+ */
+class ThreadPool {
+  public:
+    /// on_thread_start(index) is called in each helper thread before it
+    /// takes any work, e.g. to set its CPU affinity
+    explicit ThreadPool(size_t num_threads,
+                        std::function<void(size_t)> on_thread_start = {}) {
+        for (size_t i = 0; i < num_threads; ++i) {
+            _queues.push_back(std::make_unique<TaskQueue>());
+        }
+        for (size_t i = 0; i < num_threads; ++i) {
+            _threads.emplace_back([this, i, on_thread_start](std::stop_token stop) {
+                // Shows up in top -H, debuggers and traces
+                auto thread_name = "task-" + std::to_string(i);
+                pthread_setname_np(pthread_self(), thread_name.c_str());
+                if (on_thread_start) {
+                    on_thread_start(i);
+                }
+                worker(i, stop);
+            });
+        }
+    }
+    /// Finishes every task already submitted, then stops the threads
+    ~ThreadPool() {
+        wait_idle();
+        for (auto &thread : _threads) {
+            thread.request_stop();
+        }
+        {
+            std::scoped_lock lock(_sleep_mutex);
+        }
+        _wake.notify_all();
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /// Number of helper threads, not counting the calling thread
+    auto size() const -> size_t {
+        return _threads.size();
+    }
+
+    /// Run task on whichever thread is free first. Without any helper
+    /// threads, this runs it immediately.
+    void submit(std::function<void()> task) {
+        if (_threads.empty()) {
+            task();
+            return;
+        }
+        // Helpers keep their own tasks close, for the cache; anyone else
+        // deals them out
+        size_t index = _current_pool == this
+                         ? _current_index
+                         : _next_queue.fetch_add(1, std::memory_order_relaxed)
+                             % _queues.size();
+        _pending.fetch_add(1);
+        {
+            std::scoped_lock lock(_queues[index]->mutex);
+            _queues[index]->tasks.push_back(std::move(task));
+        }
+        _queued.fetch_add(1);
+        // Taking the lock means a helper can't miss this between checking
+        // for work and going to sleep
+        {
+            std::scoped_lock lock(_sleep_mutex);
+        }
+        _wake.notify_one();
+    }
+
+    /// Run func(i) for every i in [0, count), and wait for them all to finish
+    void parallel_for(size_t count, std::function<void(size_t)> func) {
+        if (count == 0) {
+            return;
+        }
+        if (count == 1 || _threads.empty()) {
+            for (size_t i = 0; i < count; ++i) {
+                func(i);
+            }
+            return;
+        }
+        auto job = std::make_shared<Job>(std::move(func), count);
+        // Helpers that arrive after every index is taken return at once
+        for (size_t i = 0; i < std::min(count - 1, _threads.size()); ++i) {
+            submit([job]() { job->run(); });
+        }
+        job->run();
+
+        std::unique_lock lock(job->mutex);
+        job->finished.wait(lock, [&] { return job->completed == job->count; });
+    }
+
+    /// Wait until every submitted task has finished
+    void wait_idle() {
+        std::unique_lock lock(_idle_mutex);
+        _idle.wait(lock, [&] { return _pending.load() == 0; });
+    }
+
+  private:
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    struct Job {
+        Job(std::function<void(size_t)> func, size_t count)
+            : func(std::move(func)), count(count) {}
+
+        std::function<void(size_t)> func;
+        const size_t count;
+        /// Next index to hand out
+        std::atomic<size_t> next{0};
+        /// Number of indices finished. Guarded by mutex.
+        size_t completed = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        /// Claim and run indices until there are none left
+        void run() {
+            size_t done = 0;
+            for (size_t i = next++; i < count; i = next++) {
+                func(i);
+                ++done;
+            }
+            if (done > 0) {
+                std::scoped_lock lock(mutex);
+                completed += done;
+                if (completed == count) {
+                    finished.notify_all();
+                }
+            }
+        }
+    };
+
+    /// Take the newest of our own tasks, or else the oldest of someone else's
+    auto take_task(size_t index) -> std::optional<std::function<void()>> {
+        for (size_t i = 0; i < _queues.size(); ++i) {
+            auto &queue = *_queues[(index + i) % _queues.size()];
+            std::scoped_lock lock(queue.mutex);
+            if (queue.tasks.empty()) {
+                continue;
+            }
+            std::function<void()> task;
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            _queued.fetch_sub(1);
+            return task;
+        }
+        return std::nullopt;
+    }
+
+    void worker(size_t index, std::stop_token stop) {
+        _current_pool = this;
+        _current_index = index;
+        while (true) {
+            if (auto task = take_task(index)) {
+                (*task)();
+                if (_pending.fetch_sub(1) == 1) {
+                    {
+                        std::scoped_lock lock(_idle_mutex);
+                    }
+                    _idle.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock lock(_sleep_mutex);
+            _wake.wait(lock, stop, [&] { return _queued.load() > 0; });
+            if (stop.stop_requested()) {
+                return;
+            }
+        }
+    }
+
+    /// The pool, and index in it, of the helper running on this thread
+    static inline thread_local ThreadPool *_current_pool = nullptr;
+    static inline thread_local size_t _current_index = 0;
+
+    std::vector<std::unique_ptr<TaskQueue>> _queues;
+    /// Tasks waiting in any queue
+    std::atomic<size_t> _queued{0};
+    /// Tasks submitted and not yet finished
+    std::atomic<size_t> _pending{0};
+    std::atomic<size_t> _next_queue{0};
+    std::mutex _sleep_mutex;
+    std::condition_variable_any _wake;
+    std::mutex _idle_mutex;
+    std::condition_variable _idle;
+    std::vector<std::jthread> _threads;
+};
@@ -0,0 +1,208 @@
+#include "topology.hpp"
+
+#include <fmt/core.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+using namespace fmt;
+
+namespace {
+/// Parse a kernel CPU list, e.g. "0-19,40-59"
+auto parse_cpu_list(const std::string &text) -> std::vector<int> {
+    std::vector<int> cpus;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find(',', pos);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        auto range = text.substr(pos, end - pos);
+        if (auto dash = range.find('-'); dash != std::string::npos) {
+            int first = std::stoi(range.substr(0, dash));
+            int last = std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; ++cpu) {
+                cpus.push_back(cpu);
+            }
+        } else if (range.find_first_of("0123456789") != std::string::npos) {
+            cpus.push_back(std::stoi(range));
+        }
+        pos = end + 1;
+    }
+    return cpus;
+}
+
+/// Read a NUMA node number from a sysfs numa_node file. -1 means unknown.
+auto read_numa_node(const std::filesystem::path &path) -> std::optional<int> {
+    std::ifstream file(path);
+    int node = -1;
+    if (!(file >> node) || node < 0) {
+        return std::nullopt;
+    }
+    return node;
+}
+}  // namespace
+
+auto Topology::detect() -> Topology {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    Topology topology;
+    std::error_code ec;
+    for (auto &entry :
+         std::filesystem::directory_iterator("/sys/devices/system/node", ec)) {
+        auto name = entry.path().filename().string();
+        if (!name.starts_with("node")
+            || name.find_first_not_of("0123456789", 4) != std::string::npos) {
+            continue;
+        }
+        std::ifstream cpulist(entry.path() / "cpulist");
+        std::string text;
+        std::getline(cpulist, text);
+        NumaNode node{std::stoi(name.substr(4)), {}};
+        for (int cpu : parse_cpu_list(text)) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                node.cpus.push_back(cpu);
+            }
+        }
+        // Nodes with only memory, or none of our CPUs, can't run threads
+        if (!node.cpus.empty()) {
+            topology._nodes.push_back(std::move(node));
+        }
+    }
+    if (topology._nodes.empty()) {
+        NumaNode node{0, {}};
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                node.cpus.push_back(cpu);
+            }
+        }
+        topology._nodes.push_back(std::move(node));
+    }
+    std::ranges::sort(topology._nodes, {}, &NumaNode::id);
+    return topology;
+}
+
+auto Topology::node(int id) const -> const NumaNode & {
+    for (auto &node : _nodes) {
+        if (node.id == id) {
+            return node;
+        }
+    }
+    return _nodes.front();
+}
+
+auto Topology::node_of_pci_device(std::string bus_id) -> std::optional<int> {
+    // CUDA gives bus IDs in upper case, sysfs uses lower case
+    std::ranges::transform(bus_id, bus_id.begin(), ::tolower);
+    return read_numa_node(std::filesystem::path("/sys/bus/pci/devices") / bus_id
+                          / "numa_node");
+}
+
+auto Topology::node_of_path(const std::string &path) -> std::optional<int> {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return std::nullopt;
+    }
+    // Network filesystems have no block device here, so are left unknown
+    std::error_code ec;
+    auto device = std::filesystem::canonical(
+      format("/sys/dev/block/{}:{}", major(info.st_dev), minor(info.st_dev)), ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    // Walk up from the disk (or partition) to the controller it's on,
+    // which is the first level the kernel gives a node for
+    for (; device.has_relative_path(); device = device.parent_path()) {
+        if (std::filesystem::exists(device / "numa_node")) {
+            return read_numa_node(device / "numa_node");
+        }
+    }
+    return std::nullopt;
+}
+
+void ThreadLayout::assign(const std::string &group,
+                          size_t num_threads,
+                          std::optional<int> preferred_node) {
+    auto load_of = [&](int cpu) { return _load[cpu]; };
+    auto least_used = [&](const std::vector<int> &cpus) {
+        return *std::ranges::min_element(cpus, {}, load_of);
+    };
+    std::vector<int> all_cpus;
+    for (auto &node : _topology.nodes()) {
+        all_cpus.insert(all_cpus.end(), node.cpus.begin(), node.cpus.end());
+    }
+
+    auto &cpus = _groups.emplace_back(group, std::vector<int>{}).second;
+    for (size_t i = 0; i < num_threads; ++i) {
+        int cpu = least_used(all_cpus);
+        if (preferred_node) {
+            // Only leave the preferred node for a CPU that's less busy
+            int near_cpu = least_used(_topology.node(*preferred_node).cpus);
+            if (load_of(near_cpu) <= load_of(cpu)) {
+                cpu = near_cpu;
+            }
+        }
+        _load[cpu] += 1;
+        cpus.push_back(cpu);
+    }
+}
+
+void ThreadLayout::pin(const std::string &group, size_t index) const {
+    for (auto &[name, cpus] : _groups) {
+        if (name == group && index < cpus.size()) {
+            pin_current_thread(std::span{&cpus[index], 1});
+            return;
+        }
+    }
+}
+
+auto ThreadLayout::describe() const -> std::string {
+    std::string description;
+    for (auto &[name, cpus] : _groups) {
+        description += format("    {:<10} CPUs {}\n", name, format_cpu_list(cpus));
+    }
+    return description;
+}
+
+bool pin_current_thread(std::span<const int> cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void run_on_node(const NumaNode &node, const std::function<void()> &func) {
+    std::jthread([&]() {
+        pin_current_thread(node.cpus);
+        func();
+    });
+}
+
+auto format_cpu_list(std::span<const int> cpus) -> std::string {
+    auto sorted = std::vector<int>(cpus.begin(), cpus.end());
+    std::ranges::sort(sorted);
+    std::string text;
+    for (size_t i = 0; i < sorted.size();) {
+        size_t j = i;
+        while (j + 1 < sorted.size() && sorted[j + 1] <= sorted[j] + 1) {
+            ++j;
+        }
+        if (!text.empty()) {
+            text += ",";
+        }
+        text += sorted[i] == sorted[j] ? format("{}", sorted[i])
+                                       : format("{}-{}", sorted[i], sorted[j]);
+        i = j + 1;
+    }
+    return text;
+}
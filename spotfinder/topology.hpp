@@ -0,0 +1,80 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+/// A NUMA node, and the CPUs in it that this process may use
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
+
+/**
+ * @brief The machine's NUMA nodes, as the kernel describes them in sysfs.
+ *
+ * Without any NUMA information, every CPU is put in a single node 0.
+ */
+class Topology {
+  public:
+    /// Read the layout for the CPUs this process is allowed to run on
+    static auto detect() -> Topology;
+
+    auto nodes() const -> const std::vector<NumaNode> & {
+        return _nodes;
+    }
+    /// The node with this ID, or the first node if there isn't one
+    auto node(int id) const -> const NumaNode &;
+
+    /// Which node a PCI device, such as a GPU or NIC, is attached to
+    static auto node_of_pci_device(std::string bus_id) -> std::optional<int>;
+    /// Which node the local block device holding path is attached to.
+    /// Nothing for network filesystems, or if the kernel doesn't say.
+    static auto node_of_path(const std::string &path) -> std::optional<int>;
+
+  private:
+    std::vector<NumaNode> _nodes;
+};
+
+/**
+ * @brief Gives each pipeline thread a CPU of its own, near what it works on.
+ *
+ * Groups of threads are given CPUs on their preferred node first, taking
+ * whichever is least used so far. Once that node is full they spill onto
+ * less busy CPUs on other nodes.
+ */
+class ThreadLayout {
+  public:
+    explicit ThreadLayout(const Topology &topology) : _topology(topology) {}
+
+    /// Give num_threads threads CPUs, preferably on preferred_node.
+    /// A preferred_node of nullopt spreads them over the whole machine.
+    void assign(const std::string &group,
+                size_t num_threads,
+                std::optional<int> preferred_node);
+    /// Pin the calling thread to the CPU assigned to it, if there is one
+    void pin(const std::string &group, size_t index) const;
+    /// One line per group, listing its CPUs
+    auto describe() const -> std::string;
+
+  private:
+    const Topology &_topology;
+    /// CPUs given to each group, in the order they were assigned
+    std::vector<std::pair<std::string, std::vector<int>>> _groups;
+    /// How many threads each CPU has been given
+    std::map<int, size_t> _load;
+};
+
+/// Restrict the calling thread to these CPUs. Returns false on failure.
+bool pin_current_thread(std::span<const int> cpus);
+
+/// Run func on a thread bound to node, and wait for it. Under Linux's
+/// default first-touch policy, memory func allocates and touches (including
+/// pinned CUDA host memory) is then placed on node.
+void run_on_node(const NumaNode &node, const std::function<void()> &func);
+
+/// Write a list of CPUs compactly, e.g. "0-3,8"
+auto format_cpu_list(std::span<const int> cpus) -> std::string;
@@ -0,0 +1,137 @@
+#include "trace.hpp"
+
+#include <fmt/core.h>
+#include <fmt/os.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace fmt;
+
+namespace {
+struct TraceEvent {
+    const char *name;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    int64_t image;
+};
+
+/// Spans recorded by one thread. Only that thread writes to it.
+struct ThreadTrace {
+    static constexpr size_t block_size = 4096;
+
+    pid_t tid;
+    std::string name;
+    /// Events are kept in blocks, so that a long trace never has to be
+    /// copied to grow it
+    std::vector<std::unique_ptr<std::array<TraceEvent, block_size>>> blocks;
+    size_t used_in_last_block = block_size;
+
+    void add(const TraceEvent &event) {
+        if (used_in_last_block == block_size) {
+            blocks.push_back(std::make_unique<std::array<TraceEvent, block_size>>());
+            used_in_last_block = 0;
+        }
+        (*blocks.back())[used_in_last_block++] = event;
+    }
+};
+
+std::chrono::steady_clock::time_point trace_start;
+/// Every thread's trace. Kept after the thread exits, until the next trace
+/// is started.
+std::mutex thread_traces_mutex;
+std::vector<std::unique_ptr<ThreadTrace>> thread_traces;
+/// Bumped by each start_tracing(), so that threads kept between jobs don't
+/// keep recording into a trace that's been cleared
+std::atomic<uint64_t> trace_generation{0};
+thread_local ThreadTrace *current_thread_trace = nullptr;
+thread_local uint64_t current_thread_trace_generation = 0;
+
+auto this_thread_trace() -> ThreadTrace & {
+    auto generation = trace_generation.load(std::memory_order_acquire);
+    if (!current_thread_trace || current_thread_trace_generation != generation) {
+        auto trace = std::make_unique<ThreadTrace>();
+        trace->tid = syscall(SYS_gettid);
+        // Named by the pipeline, e.g. "decompress-3"
+        char name[16] = {};
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        trace->name = name;
+        std::scoped_lock lock(thread_traces_mutex);
+        current_thread_trace = thread_traces.emplace_back(std::move(trace)).get();
+        current_thread_trace_generation = generation;
+    }
+    return *current_thread_trace;
+}
+
+auto microseconds_since_start(std::chrono::steady_clock::time_point time) -> double {
+    return std::chrono::duration<double, std::micro>(time - trace_start).count();
+}
+}  // namespace
+
+void start_tracing() {
+    {
+        // Drop what an earlier job recorded
+        std::scoped_lock lock(thread_traces_mutex);
+        thread_traces.clear();
+        trace_generation.fetch_add(1, std::memory_order_release);
+    }
+    trace_start = std::chrono::steady_clock::now();
+    tracing_enabled.store(true);
+}
+
+void record_trace_span(const char *name,
+                       std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end,
+                       int64_t image) {
+    if (!tracing_enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    this_thread_trace().add({name, start, end, image});
+}
+
+void write_trace(const std::filesystem::path &path) {
+    tracing_enabled.store(false);
+    std::scoped_lock lock(thread_traces_mutex);
+    auto out = output_file(path.string());
+    auto pid = getpid();
+    out.print("{{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    out.print(
+      "{{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": {}, \"args\": "
+      "{{\"name\": \"spotfinder\"}}}}",
+      pid);
+    for (auto &trace : thread_traces) {
+        out.print(
+          ",\n{{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": {}, \"tid\": {}, "
+          "\"args\": {{\"name\": \"{}\"}}}}",
+          pid,
+          trace->tid,
+          trace->name);
+        for (size_t block = 0; block < trace->blocks.size(); ++block) {
+            size_t used = block + 1 == trace->blocks.size() ? trace->used_in_last_block
+                                                            : ThreadTrace::block_size;
+            for (size_t i = 0; i < used; ++i) {
+                auto &event = (*trace->blocks[block])[i];
+                out.print(
+                  ",\n{{\"ph\": \"X\", \"name\": \"{}\", \"pid\": {}, \"tid\": {}, "
+                  "\"ts\": {:.3f}, \"dur\": {:.3f}",
+                  event.name,
+                  pid,
+                  trace->tid,
+                  microseconds_since_start(event.start),
+                  std::chrono::duration<double, std::micro>(event.end - event.start)
+                    .count());
+                if (event.image >= 0) {
+                    out.print(", \"args\": {{\"image\": {}}}", event.image);
+                }
+                out.print("}}");
+            }
+        }
+    }
+    out.print("\n]}}\n");
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+
+// Records what every thread is doing, as a Chrome trace that can be
+// opened in Perfetto (ui.perfetto.dev) or chrome://tracing.
+//
+// Each thread records its spans into a buffer of its own, so recording
+// takes no locks beyond the first span of each thread. Until
+// start_tracing() is called, spans cost a single relaxed load.
+
+/// Whether spans are being recorded
+inline std::atomic<bool> tracing_enabled{false};
+
+/// Start recording, dropping anything recorded before
+void start_tracing();
+
+/// Stop recording, and write every span recorded since start_tracing() as
+/// Chrome trace-event JSON. Only call once no thread is recording any more.
+void write_trace(const std::filesystem::path &path);
+
+/// Record a span that has already finished, if tracing
+void record_trace_span(const char *name,
+                       std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point end,
+                       int64_t image = -1);
+
+/// A span from construction to destruction, or end(), on this thread
+class TraceSpan {
+  public:
+    /// name must outlive the trace, e.g. a string literal. image, if given,
+    /// is shown with the span.
+    explicit TraceSpan(const char *name, int64_t image = -1)
+        : _name(tracing_enabled.load(std::memory_order_relaxed) ? name : nullptr),
+          _image(image) {
+        if (_name) {
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+    ~TraceSpan() {
+        end();
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    void end() {
+        if (_name) {
+            record_trace_span(_name, _start, std::chrono::steady_clock::now(), _image);
+            _name = nullptr;
+        }
+    }
+
+  private:
+    const char *_name;
+    int64_t _image;
+    std::chrono::steady_clock::time_point _start;
+};
@@ -5,13 +5,14 @@ from __future__ import annotations
 import json
 import logging
 import os
+import socket
 import subprocess
 import sys
 import threading
 import time
 from datetime import datetime
 from pathlib import Path
-from typing import Iterator, Optional
+from typing import Iterator, Optional, TextIO
 
 import workflows.recipe
 from pydantic import BaseModel, ValidationError
@@ -111,6 +112,91 @@ def _find_spotfinder() -> Path:
     return spotfinder_path
 
 
+class SpotfinderDaemon:
+    """
+    A long-lived spotfinder, run with --serve, that requests are sent to
+
+    Between jobs it keeps its CUDA context, buffers, threads and masks, so
+    each job starts straight away instead of paying for a new process.
+    """
+
+    def __init__(self, executable: Path, socket_path: Path, arguments: list[str]):
+        self._executable = executable
+        self._socket_path = socket_path
+        self._arguments = arguments
+        self._proc: subprocess.Popen | None = None
+        self._connection: socket.socket | None = None
+        self._lines: TextIO | None = None
+
+    def _connect(self) -> None:
+        """Start the daemon, if it isn't running, and connect to it"""
+        if self._proc is None or self._proc.poll() is not None:
+            self._drop_connection()
+            self._socket_path.unlink(missing_ok=True)
+            command = [
+                str(self._executable),
+                "--serve",
+                str(self._socket_path),
+                *self._arguments,
+            ]
+            logger.info(f"Starting spotfinder daemon: {' '.join(command)}")
+            self._proc = subprocess.Popen(command)
+            # Starting up includes creating the CUDA context
+            deadline = time.monotonic() + 60
+            while not self._socket_path.exists():
+                if self._proc.poll() is not None or time.monotonic() > deadline:
+                    raise RuntimeError("Spotfinder daemon failed to start")
+                time.sleep(0.05)
+        if self._connection is None:
+            self._connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            self._connection.connect(str(self._socket_path))
+            self._lines = self._connection.makefile("r")
+
+    def run(self, job: dict) -> Iterator[dict]:
+        """
+        Run a job, and yield each image's results as they arrive
+
+        Args:
+            job: The file, and anything else the --serve job format takes
+
+        Yields:
+            dict: The results for one image
+        """
+        self._connect()
+        assert self._connection and self._lines
+        job_done = False
+        try:
+            self._connection.sendall((json.dumps(job) + "\n").encode())
+            for line in self._lines:
+                data = json.loads(line)
+                if data.get("job_done"):
+                    job_done = True
+                    if data.get("status"):
+                        logger.warning(f"Spotfinder job failed: {data}")
+                    return
+                yield data
+            raise RuntimeError("Spotfinder daemon went away during a job")
+        finally:
+            # If we stopped partway, the rest of this job's results would be
+            # read as the next job's, so start again on a new connection
+            if not job_done:
+                self._drop_connection()
+
+    def _drop_connection(self) -> None:
+        # The socket is only closed once the file reading from it is too
+        if self._lines:
+            self._lines.close()
+        if self._connection:
+            self._connection.close()
+        self._connection = None
+        self._lines = None
+
+    def close(self) -> None:
+        if self._proc and self._proc.poll() is None:
+            self._proc.terminate()
+            self._proc.wait()
+
+
 class MessageOrderResolver:
     """
     Handles logic over incoming message order
@@ -161,6 +247,7 @@ class GPUPerImageAnalysis(CommonService):
     _logger_name = "spotfinder.service"
     _spotfinder_executable: Path
     _spotfind_proc: subprocess.Popen | None = None
+    _daemon: SpotfinderDaemon | None = None
 
     def initializing(self):
         _setup_rich_logging()
@@ -175,6 +262,14 @@ class GPUPerImageAnalysis(CommonService):
         )
         self._spotfinder_executable = _find_spotfinder()
         self._order_resolver = MessageOrderResolver(self.log)
+        # With SPOTFINDER_SOCKET set, one spotfinder daemon serves every
+        # request, rather than starting a new process for each
+        if socket_path := os.getenv("SPOTFINDER_SOCKET"):
+            self._daemon = SpotfinderDaemon(
+                self._spotfinder_executable,
+                Path(socket_path),
+                ["--threads", str(40), "--ordered"],
+            )
 
     def gpu_per_image_analysis(
         self,
@@ -247,6 +342,37 @@ class GPUPerImageAnalysis(CommonService):
         # Otherwise, assume that this will work for now and nack the message
         rw.transport.ack(header)
 
+        # Set the default channel for the result
+        rw.set_default_channel("result")
+
+        def send_result(data: dict) -> None:
+            data["file-seen-at"] = time.time()
+            # XRC has one-based-indexing
+            data["file-number"] += 1
+            self.log.info(f"Sending: {data}")
+            rw.set_default_channel("result")
+            rw.send_to("result", data)
+
+        if self._daemon:
+            job = {
+                "file": str(data_path),
+                "images": parameters.number_of_frames,
+                "start_index": parameters.start_frame_index,
+                "detector": detector_geometry.dict(),
+            }
+            if parameters.wavelength is not None:
+                job["wavelength"] = parameters.wavelength
+            if parameters.d_min:
+                job["dmin"] = parameters.d_min
+            if parameters.d_max:
+                job["dmax"] = parameters.d_max
+            self.log.info(f"Sending job to spotfinder daemon: {job}")
+            for data in self._daemon.run(job):
+                send_result(data)
+            duration = time.monotonic() - start_time
+            self.log.info(f"Analysis complete in {duration:.1f} s")
+            return
+
         # Create a pipe for comms
         read_fd, write_fd = os.pipe()
 
@@ -262,6 +388,8 @@ class GPUPerImageAnalysis(CommonService):
             str(40),
             "--pipe_fd",
             str(write_fd),
+            # Results go to XRC in frame order
+            "--ordered",
             "--detector",
             detector_geometry.to_json(),
         ]
@@ -274,9 +402,6 @@ class GPUPerImageAnalysis(CommonService):
 
         self.log.info(f"Running: {' '.join(str(x) for x in command)}")
 
-        # Set the default channel for the result
-        rw.set_default_channel("result")
-
         def pipe_output(read_fd: int) -> Iterator[str]:
             """
             Generator to read from the pipe and yield the output
@@ -305,13 +430,7 @@ class GPUPerImageAnalysis(CommonService):
             """
             # Read from the pipe and send to the result queue
             for line in pipe_output(read_fd):
-                data = json.loads(line)
-                data["file-seen-at"] = time.time()
-                # XRC has one-based-indexing
-                data["file-number"] += 1
-                self.log.info(f"Sending: {data}")
-                rw.set_default_channel("result")
-                rw.send_to("result", data)
+                send_result(json.loads(line))
 
             self.log.info("Results finished sending")
 